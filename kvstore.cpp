@@ -19,20 +19,113 @@
 #include <set>  
 #include <functional>
 #include <iomanip>
+#include <future>
+#include <string_view>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+#include <array>
+#include <deque>
+#include <list>
+#include <optional>
+#include <dirent.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define KVSTORE_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 
 using namespace std;
 
+#ifdef KVSTORE_COUNT_ALLOCATIONS
+// Counts every heap allocation for --bench writes. Replacing the global
+// operator new costs an atomic add per allocation, so it is opt-in
+struct AllocationCounter {
+    static inline atomic<uint64_t> count{0};
+    static inline atomic<uint64_t> bytes{0};
+};
+
+void* operator new(size_t size) {
+    AllocationCounter::count.fetch_add(1, memory_order_relaxed);
+    AllocationCounter::bytes.fetch_add(size, memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw bad_alloc();
+}
+
+// Not inlined, or GCC pairs the inlined free() with operator new and warns
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { free(p); }
+#endif
+
+// How keys are placed on nodes. Ring walks a hash ring of virtual nodes.
+// Rendezvous (highest random weight) ranks every node by a hash of node
+// and key: no virtual nodes and an even spread, but O(nodes) per lookup
+enum class Placement { Ring, Rendezvous };
+
 // Hash function for consistent hashing
 class ConsistentHash {
 private:
     map<uint32_t, string> ring;
-    hash<string> hasher;
+    hash<string_view> hasher;
     int virtual_nodes;
+    Placement placement;
+    vector<pair<uint64_t, string>> members;   // Rendezvous: node hash and id
+    
+    // Keys with a hash tag hash only the tag, so "{user:1001}:profile" and
+    // "{user:1001}:orders" land on the same nodes
+    uint32_t keyHash(const string& key) const {
+        return hasher(hashTag(key));
+    }
+    
+    // splitmix64's finalizer, to score a node for a key
+    static uint64_t mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+    
+    vector<string> rankNodes(const string& key, int count) const {
+        uint64_t key_hash = keyHash(key);
+        vector<pair<uint64_t, const string*>> scores;
+        for (const auto& member : members) {
+            scores.push_back({mix(member.first ^ (key_hash * 0x9e3779b97f4a7c15ULL)), &member.second});
+        }
+        size_t take = min<size_t>(max(count, 0), scores.size());
+        partial_sort(scores.begin(), scores.begin() + take, scores.end(),
+                     [](const auto& a, const auto& b) { return a.first > b.first; });
+        vector<string> nodes;
+        for (size_t i = 0; i < take; ++i) {
+            nodes.push_back(*scores[i].second);
+        }
+        return nodes;
+    }
     
 public:
-    ConsistentHash(int vn = 100) : virtual_nodes(vn) {}
+    ConsistentHash(int vn = 100, Placement mode = Placement::Ring) : virtual_nodes(vn), placement(mode) {}
+    
+    Placement placementMode() const { return placement; }
+    int virtualNodes() const { return virtual_nodes; }
     
     void addNode(const string& node) {
+        if (placement == Placement::Rendezvous) {
+            auto it = find_if(members.begin(), members.end(), [&](const auto& member) { return member.second == node; });
+            if (it == members.end()) members.push_back({mix(hash<string>()(node)), node});
+            return;
+        }
         for (int i = 0; i < virtual_nodes; ++i) {
             uint32_t hash = hasher(node + to_string(i));
             ring[hash] = node;
@@ -40,6 +133,11 @@ public:
     }
     
     void removeNode(const string& node) {
+        if (placement == Placement::Rendezvous) {
+            members.erase(remove_if(members.begin(), members.end(), [&](const auto& member) { return member.second == node; }),
+                          members.end());
+            return;
+        }
         for (int i = 0; i < virtual_nodes; ++i) {
             uint32_t hash = hasher(node + to_string(i));
             ring.erase(hash);
@@ -47,9 +145,13 @@ public:
     }
     
     string getNode(const string& key) const {
+        if (placement == Placement::Rendezvous) {
+            auto nodes = rankNodes(key, 1);
+            return nodes.empty() ? "" : nodes[0];
+        }
         if (ring.empty()) return "";
         
-        uint32_t hash = hasher(key);
+        uint32_t hash = keyHash(key);
         auto it = ring.lower_bound(hash);
         if (it == ring.end()) {
             it = ring.begin();
@@ -57,11 +159,14 @@ public:
         return it->second;
     }
     
+    // Distinct nodes in ring order from the key's position; the first is
+    // the key's primary
     vector<string> getNodes(const string& key, int count) const {
+        if (placement == Placement::Rendezvous) return rankNodes(key, count);
         vector<string> nodes;
         if (ring.empty()) return nodes;
         
-        uint32_t hash = hasher(key);
+        uint32_t hash = keyHash(key);
         auto it = ring.lower_bound(hash);
         
         set<string> unique_nodes;
@@ -71,12 +176,14 @@ public:
         // Continue until we have 'count' unique nodes or we've traversed the entire ring
         while (unique_nodes.size() < count && iterations < max_iterations) {
             if (it == ring.end()) it = ring.begin();
-            unique_nodes.insert(it->second);
+            if (unique_nodes.insert(it->second).second) {
+                nodes.push_back(it->second);
+            }
             ++it;
             ++iterations;
         }
         
-        return vector<string>(unique_nodes.begin(), unique_nodes.end());
+        return nodes;
     }
     
     // Get nodes responsible for a key range (for redistribution)
@@ -127,7 +234,17 @@ public:
     }
     
     uint32_t getHash(const string& key) const {
-        return hasher(key);
+        return keyHash(key);
+    }
+    
+    // The text between the first '{' and the next '}', if it is not empty;
+    // otherwise the whole key
+    static string_view hashTag(string_view key) {
+        size_t open = key.find('{');
+        if (open == string_view::npos) return key;
+        size_t close = key.find('}', open + 1);
+        if (close == string_view::npos || close == open + 1) return key;
+        return key.substr(open + 1, close - open - 1);
     }
 };
 
@@ -139,7 +256,7 @@ private:
         K key;
         V value;
         shared_ptr<Node> prev, next;
-        Node(K k, V v) : key(k), value(v) {}
+        Node(K k, V v) : key(move(k)), value(move(v)) {}
     };
     
     unordered_map<K, shared_ptr<Node>> cache;
@@ -178,25 +295,27 @@ public:
         tail->prev = head;
     }
     
-    V get(const K& key) {
-        shared_lock<shared_mutex> lock(mutex);
+    // Takes the lock exclusively, since a hit moves the entry to the front
+    optional<V> get(const K& key) {
+        unique_lock<shared_mutex> lock(mutex);
         auto it = cache.find(key);
         if (it != cache.end()) {
             moveToHead(it->second);
             return it->second->value;
         }
-        return V{};
+        return nullopt;
     }
     
-    void put(const K& key, const V& value) {
+    // Takes the value by value so callers can move it in
+    void put(const K& key, V value) {
         unique_lock<shared_mutex> lock(mutex);
         auto it = cache.find(key);
         
         if (it != cache.end()) {
-            it->second->value = value;
+            it->second->value = move(value);
             moveToHead(it->second);
         } else {
-            auto newNode = make_shared<Node>(key, value);
+            auto newNode = make_shared<Node>(key, move(value));
             
             if (cache.size() >= capacity) {
                 auto tail_node = removeTail();
@@ -219,6 +338,19 @@ public:
         return false;
     }
     
+    size_t size() const {
+        shared_lock<shared_mutex> lock(mutex);
+        return cache.size();
+    }
+    
+    // Visit every entry, in no particular order
+    void forEach(const function<void(const K&, const V&)>& visit) const {
+        shared_lock<shared_mutex> lock(mutex);
+        for (const auto& pair : cache) {
+            visit(pair.first, pair.second->value);
+        }
+    }
+    
     // Get all keys in cache (for redistribution)
     vector<K> getAllKeys() {
         shared_lock<shared_mutex> lock(mutex);
@@ -230,248 +362,4254 @@ public:
     }
 };
 
-// Storage Engine with WAL (Write-Ahead Logging)
-class StorageEngine {
+// Read-only memory mapping of a whole file, for parsing logs in place
+class MappedFile {
 private:
-    unordered_map<string, string> data;
-    shared_mutex data_mutex;
-    ofstream wal_file;
-    mutex wal_mutex;
+    const char* base = nullptr;
+    size_t length = 0;
     
 public:
-    StorageEngine(const string& wal_path = "kvstore.wal") 
-        : wal_file(wal_path, ios::app) {
-        loadFromWAL(wal_path);
+    explicit MappedFile(const string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+#ifdef POSIX_FADV_SEQUENTIAL
+            // Widen kernel readahead for the whole file
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+            void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                base = static_cast<const char*>(addr);
+                length = st.st_size;
+                madvise(const_cast<char*>(base), length, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);  // The mapping stays valid after close
     }
     
-    void put(const string& key, const string& value) {
-        // Write to WAL first
-        {
-            lock_guard<mutex> wal_lock(wal_mutex);
-            wal_file << "PUT " << key << " " << value << "\n";
-            wal_file.flush();
-        }
+    ~MappedFile() {
+        if (base) munmap(const_cast<char*>(base), length);
+    }
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    string_view view() const { return string_view(base, length); }
+    
+    // Ask the kernel to start reading [offset, offset + len) ahead of use
+    void prefetch(size_t offset, size_t len) const {
+        if (!base || offset >= length) return;
         
-        // Then update in-memory data
-        unique_lock<shared_mutex> lock(data_mutex);
-        data[key] = value;
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t aligned = offset / page * page;
+        len = min(len, length - offset) + (offset - aligned);
+        madvise(const_cast<char*>(base) + aligned, len, MADV_WILLNEED);
     }
+};
+
+// Positional writes, optionally followed by fdatasync, completed
+// asynchronously. done(0) or done(-errno) is called from a backend thread
+// once the data is written (and synced, if asked); iov must stay valid
+// until then
+class WalIoBackend {
+public:
+    virtual ~WalIoBackend() = default;
+    virtual void submitWrite(int fd, const iovec* iov, int iovcnt, off_t offset, bool sync,
+                             function<void(int)> done) = 0;
+    virtual const char* name() const = 0;
     
-    string get(const string& key) {
-        shared_lock<shared_mutex> lock(data_mutex);
-        auto it = data.find(key);
-        return (it != data.end()) ? it->second : "";
+    // Process-wide backend shared by every WAL: io_uring when the kernel
+    // allows it, otherwise a pwrite thread pool
+    static WalIoBackend& shared();
+    
+protected:
+    static int syncData(int fd) {
+#ifdef __APPLE__
+        return fsync(fd);
+#else
+        return fdatasync(fd);
+#endif
     }
+};
+
+// Fallback backend: worker threads run pwritev + fdatasync
+class ThreadPoolIoBackend : public WalIoBackend {
+private:
+    struct Task {
+        int fd;
+        const iovec* iov;
+        int iovcnt;
+        off_t offset;
+        bool sync;
+        function<void(int)> done;
+    };
     
-    bool remove(const string& key) {
-        // Write to WAL first
+    queue<Task> tasks;
+    mutex tasks_mutex;
+    condition_variable tasks_cv;
+    vector<thread> workers;
+    bool stopping = false;
+    
+public:
+    explicit ThreadPoolIoBackend(unsigned num_threads) {
+        for (unsigned i = 0; i < num_threads; ++i) {
+            workers.emplace_back([this]() { workerLoop(); });
+        }
+    }
+    
+    ~ThreadPoolIoBackend() override {
         {
-            lock_guard<mutex> wal_lock(wal_mutex);
-            wal_file << "DEL " << key << "\n";
-            wal_file.flush();
+            lock_guard<mutex> lock(tasks_mutex);
+            stopping = true;
+        }
+        tasks_cv.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
         }
-        
-        unique_lock<shared_mutex> lock(data_mutex);
-        return data.erase(key) > 0;
     }
     
-    vector<string> getAllKeys() {
-        shared_lock<shared_mutex> lock(data_mutex);
-        vector<string> keys;
-        for (const auto& pair : data) {
-            keys.push_back(pair.first);
+    void submitWrite(int fd, const iovec* iov, int iovcnt, off_t offset, bool sync,
+                     function<void(int)> done) override {
+        {
+            lock_guard<mutex> lock(tasks_mutex);
+            tasks.push({fd, iov, iovcnt, offset, sync, move(done)});
         }
-        return keys;
+        tasks_cv.notify_one();
     }
     
-    // Get all key-value pairs for redistribution
-    unordered_map<string, string> getAllData() {
-        shared_lock<shared_mutex> lock(data_mutex);
-        return data;
+    const char* name() const override { return "pwrite thread pool"; }
+    
+private:
+    void workerLoop() {
+        while (true) {
+            Task task;
+            {
+                unique_lock<mutex> lock(tasks_mutex);
+                tasks_cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (tasks.empty()) return;
+                task = move(tasks.front());
+                tasks.pop();
+            }
+            
+            int result = writeFully(task.fd, task.iov, task.iovcnt, task.offset);
+            if (result == 0 && task.sync && syncData(task.fd) != 0) {
+                result = -errno;
+            }
+            task.done(result);
+        }
     }
     
-    // Batch operations for efficient redistribution
-    void putBatch(const unordered_map<string, string>& batch) {
-        unique_lock<shared_mutex> lock(data_mutex);
-        
-        // Write to WAL first
-        {
-            lock_guard<mutex> wal_lock(wal_mutex);
-            for (const auto& pair : batch) {
-                wal_file << "PUT " << pair.first << " " << pair.second << "\n";
+    static int writeFully(int fd, const iovec* iov, int iovcnt, off_t offset) {
+        vector<iovec> remaining(iov, iov + iovcnt);
+        size_t first = 0;
+        while (first < remaining.size()) {
+            ssize_t written = pwritev(fd, &remaining[first], remaining.size() - first, offset);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return -errno;
+            }
+            offset += written;
+            
+            // Skip fully written buffers and trim a partially written one
+            while (first < remaining.size() && (size_t)written >= remaining[first].iov_len) {
+                written -= remaining[first].iov_len;
+                ++first;
+            }
+            if (first < remaining.size()) {
+                remaining[first].iov_base = static_cast<char*>(remaining[first].iov_base) + written;
+                remaining[first].iov_len -= written;
             }
-            wal_file.flush();
         }
+        return 0;
+    }
+};
+
+#ifdef KVSTORE_HAVE_IO_URING
+// io_uring backend: each write is a WRITEV SQE linked to an FSYNC(DATASYNC)
+// SQE, so the kernel orders them and a single submission covers both. A
+// reaper thread turns completions into callbacks
+class IoUringBackend : public WalIoBackend {
+private:
+    struct Request {
+        function<void(int)> done;
+        size_t expected_bytes;
+        atomic<int> references;    // One per SQE in the kernel, one for submitWrite
+        atomic<int> result{0};     // The first error wins
+        bool write_done = false;
         
-        // Then update in-memory data
-        for (const auto& pair : batch) {
-            data[pair.first] = pair.second;
+        void fail(int error) {
+            int none = 0;
+            result.compare_exchange_strong(none, error);
+        }
+        
+        // Drops count references; the last one completes the request
+        static void release(Request* request, int count) {
+            if (request->references.fetch_sub(count) == count) {
+                request->done(request->result.load());
+                delete request;
+            }
+        }
+    };
+    
+    int ring_fd = -1;
+    
+    void* sq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_size = 0;
+    unsigned pending_sqes = 0;   // Filled but not yet published
+    
+    void* cq_ring = MAP_FAILED;
+    size_t cq_ring_size = 0;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    
+    mutex submit_mutex;
+    thread reaper;
+    
+    IoUringBackend() = default;
+    
+public:
+    // Returns nullptr when io_uring is unavailable (old kernel, seccomp)
+    static unique_ptr<IoUringBackend> create(unsigned entries = 256) {
+        unique_ptr<IoUringBackend> ring(new IoUringBackend());
+        if (!ring->setup(entries)) return nullptr;
+        ring->reaper = thread([r = ring.get()]() { r->reapLoop(); });
+        return ring;
+    }
+    
+    ~IoUringBackend() override {
+        if (reaper.joinable()) {
+            // A NOP with user_data 0 tells the reaper to exit
+            {
+                lock_guard<mutex> lock(submit_mutex);
+                io_uring_sqe* sqe = nextSqe();
+                sqe->opcode = IORING_OP_NOP;
+                int error;
+                publishSqes(1, error);
+            }
+            reaper.join();
         }
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+        if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+        if (ring_fd >= 0) close(ring_fd);
     }
     
-    void removeBatch(const vector<string>& keys) {
-        unique_lock<shared_mutex> lock(data_mutex);
+    void submitWrite(int fd, const iovec* iov, int iovcnt, off_t offset, bool sync,
+                     function<void(int)> done) override {
+        size_t expected = 0;
+        for (int i = 0; i < iovcnt; ++i) expected += iov[i].iov_len;
+        int count = sync ? 2 : 1;
+        auto request = new Request{move(done), expected, count + 1};
         
-        // Write to WAL first
+        int error;
+        int submitted;
         {
-            lock_guard<mutex> wal_lock(wal_mutex);
-            for (const string& key : keys) {
-                wal_file << "DEL " << key << "\n";
+            lock_guard<mutex> lock(submit_mutex);
+            io_uring_sqe* write_sqe = nextSqe();
+            write_sqe->opcode = IORING_OP_WRITEV;
+            write_sqe->flags = sync ? IOSQE_IO_LINK : 0;
+            write_sqe->fd = fd;
+            write_sqe->off = offset;
+            write_sqe->addr = reinterpret_cast<uint64_t>(iov);
+            write_sqe->len = iovcnt;
+            write_sqe->user_data = reinterpret_cast<uint64_t>(request);
+            
+            if (sync) {
+                io_uring_sqe* sync_sqe = nextSqe();
+                sync_sqe->opcode = IORING_OP_FSYNC;
+                sync_sqe->fd = fd;
+                sync_sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+                sync_sqe->user_data = reinterpret_cast<uint64_t>(request);
             }
-            wal_file.flush();
+            
+            submitted = publishSqes(count, error);
         }
         
-        // Then remove from in-memory data
-        for (const string& key : keys) {
-            data.erase(key);
-        }
+        // SQEs the kernel did not take will never complete. If it took the
+        // write but not the sync, the request ends with the write's CQE
+        if (submitted < count) request->fail(error);
+        Request::release(request, 1 + count - submitted);
     }
     
+    const char* name() const override { return "io_uring"; }
+    
 private:
-    void loadFromWAL(const string& wal_path) {
-        ifstream file(wal_path);
-        string line;
-        while (getline(file, line)) {
-            istringstream iss(line);
-            string op, key, value;
-            iss >> op >> key;
+    static int enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+        return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+    
+    bool setup(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0) return false;
+        
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+        }
+        
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) return false;
+        cq_ring = single_mmap ? sq_ring
+                              : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) return false;
+        
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) return false;
+        
+        char* sq = static_cast<char*>(sq_ring);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        
+        char* cq = static_cast<char*>(cq_ring);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+    
+    // Caller holds submit_mutex. Without SQPOLL the kernel consumes every
+    // SQE during io_uring_enter, so the queue is empty between submissions
+    io_uring_sqe* nextSqe() {
+        unsigned index = (*sq_tail + pending_sqes) & *sq_mask;
+        ++pending_sqes;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        return sqe;
+    }
+    
+    // Publishes the pending SQEs and submits them, returning how many the
+    // kernel took. On failure error is set to -errno and the SQEs it did
+    // not take are withdrawn from the queue; the kernel only reads the tail
+    // inside io_uring_enter, so nothing can pick them up later
+    int publishSqes(unsigned count, int& error) {
+        __atomic_store_n(sq_tail, *sq_tail + count, __ATOMIC_RELEASE);
+        pending_sqes = 0;
+        
+        unsigned submitted = 0;
+        error = 0;
+        while (submitted < count) {
+            int taken = enter(ring_fd, count - submitted, 0, 0);
+            if (taken > 0) {
+                submitted += taken;   // A short submit leaves the rest queued
+            } else if (taken < 0 && errno == EINTR) {
+                continue;
+            } else {
+                error = taken < 0 ? -errno : -EAGAIN;
+                __atomic_store_n(sq_tail, *sq_tail - (count - submitted), __ATOMIC_RELEASE);
+                break;
+            }
+        }
+        return submitted;
+    }
+    
+    void reapLoop() {
+        while (true) {
+            if (enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                return;
+            }
             
-            if (op == "PUT") {
-                getline(iss, value);
-                if (!value.empty() && value[0] == ' ') {
-                    value = value.substr(1);
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            bool stop = false;
+            for (; head != tail; ++head) {
+                const io_uring_cqe& cqe = cqes[head & *cq_mask];
+                if (cqe.user_data == 0) {
+                    stop = true;
+                    continue;
                 }
-                data[key] = value;
-            } else if (op == "DEL") {
-                data.erase(key);
+                complete(reinterpret_cast<Request*>(cqe.user_data), cqe.res);
             }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            if (stop) return;
         }
     }
+    
+    static void complete(Request* request, int res) {
+        // The write completes first; a failed or short write cancels the sync
+        if (res < 0) {
+            request->fail(res);
+        } else if (!request->write_done && (size_t)res != request->expected_bytes) {
+            request->fail(-EIO);
+        }
+        request->write_done = true;
+        Request::release(request, 1);
+    }
 };
+#endif
 
-// Node in the distributed system
-class KVNode {
+WalIoBackend& WalIoBackend::shared() {
+    static unique_ptr<WalIoBackend> backend = []() -> unique_ptr<WalIoBackend> {
+#ifdef KVSTORE_HAVE_IO_URING
+        if (auto ring = IoUringBackend::create()) return ring;
+#endif
+        return make_unique<ThreadPoolIoBackend>(min(8u, max(2u, thread::hardware_concurrency())));
+    }();
+    return *backend;
+}
+
+// How far a write has to get before put() returns, per store:
+//   None      - memory only, no WAL. A process crash loses everything.
+//   Buffered  - WAL written to the OS page cache. Survives a process crash;
+//               an OS crash or power loss can drop recent writes.
+//   GroupSync - WAL fdatasync'd per group commit. Acknowledged writes
+//               survive power loss. This is the default.
+//   Direct    - like GroupSync, but written with O_DIRECT from block-aligned
+//               buffers, bypassing the page cache. Same guarantees, no
+//               double buffering; batches are written one at a time.
+enum class Durability { None, Buffered, GroupSync, Direct };
+
+inline const char* durabilityName(Durability durability) {
+    switch (durability) {
+        case Durability::None: return "none";
+        case Durability::Buffered: return "buffered";
+        case Durability::GroupSync: return "fdatasync";
+        case Durability::Direct: return "direct";
+    }
+    return "unknown";
+}
+
+// Hybrid logical clock for write versions: wall-clock milliseconds in the
+// high 48 bits and a counter in the low 16. Versions never repeat and never
+// go backwards, even if the wall clock does
+class HybridClock {
 private:
-    string node_id;
-    StorageEngine storage;
-    LRUCache<string, string> cache;
-    vector<string> replica_nodes;
-    atomic<bool> is_leader{false};
+    atomic<uint64_t> last{0};
     
 public:
-    KVNode(const string& id, int cache_size = 1000) 
-        : node_id(id), cache(cache_size), storage(id + ".wal") {}
+    uint64_t now() {
+        uint64_t physical = fromMillis(wallMillis());
+        uint64_t previous = last.load();
+        uint64_t next;
+        do {
+            next = max(physical, previous + 1);
+        } while (!last.compare_exchange_weak(previous, next));
+        return next;
+    }
     
-    // Basic operations
-    void put(const string& key, const string& value) {
-        storage.put(key, value);
-        cache.put(key, value);
+    // Move past a version produced elsewhere, e.g. found during replay
+    void observe(uint64_t version) {
+        uint64_t previous = last.load();
+        while (previous < version && !last.compare_exchange_weak(previous, version)) {}
     }
     
-    string get(const string& key) {
-        // Try cache first
-        string value = cache.get(key);
-        if (!value.empty()) {
-            return value;
-        }
-        
-        // Fallback to storage
-        value = storage.get(key);
-        if (!value.empty()) {
-            cache.put(key, value);
+    static uint64_t fromMillis(uint64_t millis) { return millis << 16; }
+    static uint64_t toMillis(uint64_t version) { return version >> 16; }
+    
+    static uint64_t wallMillis() {
+        return chrono::duration_cast<chrono::milliseconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
+    }
+    
+    static HybridClock& shared() {
+        static HybridClock clock;
+        return clock;
+    }
+};
+
+// Latency histogram in the style of HdrHistogram: values up to 2^40 (ns,
+// about 18 minutes) in log-linear buckets of 256 sub-buckets, so a value
+// is kept to within 1%. Recording is lock-free but for one writer thread
+// at a time; other threads may read or merge it and see slightly stale
+// counts. Copies and merges are taken by the writer or once it is done
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BUCKET_BITS = 8;
+    static constexpr int MAX_VALUE_BITS = 40;
+    static constexpr uint64_t SUB_BUCKET_COUNT = 1ULL << SUB_BUCKET_BITS;
+    static constexpr uint64_t SUB_BUCKET_HALF = SUB_BUCKET_COUNT / 2;
+    static constexpr size_t BUCKET_COUNT = MAX_VALUE_BITS - SUB_BUCKET_BITS + 1;
+    static constexpr size_t COUNTS_LENGTH = (BUCKET_COUNT + 1) * SUB_BUCKET_HALF;
+    static constexpr uint64_t MAX_VALUE = (1ULL << MAX_VALUE_BITS) - 1;
+    
+    LatencyHistogram() : state(make_unique<State>()) {}
+    LatencyHistogram(const LatencyHistogram& other) : LatencyHistogram() { merge(other); }
+    LatencyHistogram(LatencyHistogram&&) = default;
+    LatencyHistogram& operator=(LatencyHistogram&&) = default;
+    
+    void record(uint64_t value) {
+        value = min(value, MAX_VALUE);
+        bump(state->counts[indexOf(value)], 1);
+        bump(state->total, 1);
+        if (value > state->max.load(memory_order_relaxed)) state->max.store(value, memory_order_relaxed);
+    }
+    
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < COUNTS_LENGTH; ++i) {
+            uint64_t count = other.state->counts[i].load(memory_order_relaxed);
+            if (count) bump(state->counts[i], count);
         }
-        return value;
+        bump(state->total, other.count());
+        state->max.store(max(maxValue(), other.maxValue()), memory_order_relaxed);
     }
     
-    bool remove(const string& key) {
-        bool result = storage.remove(key);
-        cache.remove(key);
-        return result;
+    void reset() {
+        for (auto& count : state->counts) {
+            count.store(0, memory_order_relaxed);
+        }
+        state->total.store(0, memory_order_relaxed);
+        state->max.store(0, memory_order_relaxed);
     }
     
-    // Batch operations for redistribution
-    void putBatch(const unordered_map<string, string>& batch) {
-        storage.putBatch(batch);
-        for (const auto& pair : batch) {
-            cache.put(pair.first, pair.second);
+    uint64_t count() const { return state->total.load(memory_order_relaxed); }
+    uint64_t maxValue() const { return state->max.load(memory_order_relaxed); }
+    
+    // The highest value (to the histogram's precision) at or below which
+    // p percent of the recorded values fall
+    uint64_t valueAtPercentile(double p) const {
+        uint64_t total = count();
+        if (total == 0) return 0;
+        uint64_t target = max<uint64_t>(1, uint64_t(ceil(min(p, 100.0) / 100 * total)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < COUNTS_LENGTH; ++i) {
+            seen += state->counts[i].load(memory_order_relaxed);
+            if (seen >= target) return min(highestEquivalent(valueAt(i)), maxValue());
         }
+        return maxValue();
     }
     
-    void removeBatch(const vector<string>& keys) {
-        storage.removeBatch(keys);
-        for (const string& key : keys) {
-            cache.remove(key);
+    double mean() const {
+        uint64_t total = count();
+        if (total == 0) return 0;
+        double sum = 0;
+        for (size_t i = 0; i < COUNTS_LENGTH; ++i) {
+            uint64_t count = state->counts[i].load(memory_order_relaxed);
+            if (count) sum += double(count) * medianEquivalent(valueAt(i));
         }
+        return sum / total;
     }
     
-    // Get data for redistribution
-    unordered_map<string, string> getAllData() {
-        return storage.getAllData();
+    double standardDeviation() const {
+        uint64_t total = count();
+        if (total == 0) return 0;
+        double average = mean(), sum = 0;
+        for (size_t i = 0; i < COUNTS_LENGTH; ++i) {
+            uint64_t count = state->counts[i].load(memory_order_relaxed);
+            double deviation = medianEquivalent(valueAt(i)) - average;
+            if (count) sum += double(count) * deviation * deviation;
+        }
+        return sqrt(sum / total);
     }
     
-    // Get keys that should be moved to other nodes
-    unordered_map<string, string> getKeysForRedistribution(
-        const function<bool(const string&)>& should_move) {
-        unordered_map<string, string> keys_to_move;
-        auto all_data = storage.getAllData();
+    // HdrHistogram's percentile distribution text format, as read by its
+    // plotter. Values are divided by scale (1000 reports ns in us); rows
+    // get denser toward the tail, ticks_per_half per halving of 1 - p
+    void writePercentiles(ostream& out, double scale = 1000.0, int ticks_per_half = 5) const {
+        char line[128];
+        snprintf(line, sizeof(line), "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+        out << line;
         
-        for (const auto& pair : all_data) {
-            if (should_move(pair.first)) {
-                keys_to_move[pair.first] = pair.second;
+        uint64_t total = count();
+        uint64_t seen = 0, last_value = 0;
+        double level = 0;
+        for (size_t i = 0; i < COUNTS_LENGTH && seen < total; ++i) {
+            uint64_t count = state->counts[i].load(memory_order_relaxed);
+            if (count == 0) continue;
+            seen += count;
+            last_value = highestEquivalent(valueAt(i));
+            double reached = 100.0 * seen / total;
+            while (level <= reached) {
+                snprintf(line, sizeof(line), "%12.3f %2.12f %10llu %14.2f\n", last_value / scale, level / 100,
+                         (unsigned long long)seen, 1 / (1 - level / 100));
+                out << line;
+                double half_distance = pow(2, floor(log2(100 / (100 - level))) + 1);
+                level += 100 / (ticks_per_half * half_distance);
+                if (seen == total) break;
             }
         }
+        if (total > 0) {
+            snprintf(line, sizeof(line), "%12.3f %2.12f %10llu\n", last_value / scale, 1.0, (unsigned long long)total);
+            out << line;
+        }
         
-        return keys_to_move;
+        uint64_t max_value = total ? highestEquivalent(maxValue()) : 0;
+        snprintf(line, sizeof(line), "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean() / scale, standardDeviation() / scale);
+        out << line;
+        snprintf(line, sizeof(line), "#[Max     = %12.3f, Total count    = %12llu]\n", max_value / scale, (unsigned long long)total);
+        out << line;
+        snprintf(line, sizeof(line), "#[Buckets = %12zu, SubBuckets     = %12llu]\n", BUCKET_COUNT, (unsigned long long)SUB_BUCKET_COUNT);
+        out << line;
     }
     
-    void addReplica(const string& replica_id) {
-        replica_nodes.push_back(replica_id);
+private:
+    struct State {
+        array<atomic<uint64_t>, COUNTS_LENGTH> counts{};
+        atomic<uint64_t> total{0};
+        atomic<uint64_t> max{0};
+    };
+    
+    // Single writer, so no read-modify-write is needed
+    static void bump(atomic<uint64_t>& counter, uint64_t by) {
+        counter.store(counter.load(memory_order_relaxed) + by, memory_order_relaxed);
     }
     
-    string getNodeId() const { return node_id; }
+    // Bucket b >= 1 holds [2^(b+7), 2^(b+8)) in steps of 2^b; bucket 0
+    // holds [0, 256) exactly
+    static int bucketOf(uint64_t value) {
+        return 64 - __builtin_clzll(value | (SUB_BUCKET_COUNT - 1)) - SUB_BUCKET_BITS;
+    }
     
-    void setLeader(bool leader) { is_leader = leader; }
-    bool isLeader() const { return is_leader; }
+    static size_t indexOf(uint64_t value) {
+        int bucket = bucketOf(value);
+        uint64_t sub_bucket = value >> bucket;
+        return ((bucket + 1) << (SUB_BUCKET_BITS - 1)) + (sub_bucket - SUB_BUCKET_HALF);
+    }
+    
+    // Lowest value counted at an index
+    static uint64_t valueAt(size_t index) {
+        int bucket = int(index >> (SUB_BUCKET_BITS - 1)) - 1;
+        uint64_t sub_bucket = (index & (SUB_BUCKET_HALF - 1)) + SUB_BUCKET_HALF;
+        if (bucket < 0) {
+            sub_bucket -= SUB_BUCKET_HALF;
+            bucket = 0;
+        }
+        return sub_bucket << bucket;
+    }
+    
+    // The highest and middle values counted alongside value
+    static uint64_t highestEquivalent(uint64_t value) {
+        int bucket = bucketOf(value);
+        return (value >> bucket << bucket) + (1ULL << bucket) - 1;
+    }
+    
+    static double medianEquivalent(uint64_t value) {
+        int bucket = bucketOf(value);
+        return (value >> bucket << bucket) + double(1ULL << bucket) / 2;
+    }
+    
+    unique_ptr<State> state;
 };
 
-// Distributed Key-Value Store Cluster
-class DistributedKVStore {
-private:
-    unordered_map<string, unique_ptr<KVNode>> nodes;
-    ConsistentHash hash_ring;
-    int replication_factor;
-    shared_mutex cluster_mutex;
-    
+// A latency metric recorded from any thread. Each thread records into its
+// own histogram, taken on its first record, and snapshot() merges them all.
+// A thread's histogram goes back to the recorder when the thread exits, to
+// be reused by the next one, its counts still included. Recorders must
+// outlive every thread that records into them
+class LatencyRecorder {
 public:
-    DistributedKVStore(int rf = 3) : replication_factor(rf) {}
+    explicit LatencyRecorder(string metric_name) : metric(move(metric_name)) {}
     
-    void addNode(const string& node_id) {
-        unique_lock<shared_mutex> lock(cluster_mutex);
-        
-        cout << "\n=== Adding Node: " << node_id << " ===" << endl;
-        
-        // Create the new node
-        nodes[node_id] = make_unique<KVNode>(node_id);
-        
-        // Store old ring state for redistribution
-        ConsistentHash old_ring = hash_ring;
-        
-        // Add to hash ring
-        hash_ring.addNode(node_id);
-        
-        // Perform smart redistribution
-        redistributeOnAdd(node_id, old_ring);
-        
-        // Set up replication
-        setupReplication();
-        
-        cout << "✓ Node " << node_id << " added successfully with minimal redistribution" << endl;
+    const string& name() const { return metric; }
+    
+    void record(uint64_t nanos) { local().record(nanos); }
+    
+    LatencyHistogram snapshot() const {
+        lock_guard<mutex> lock(histograms_mutex);
+        LatencyHistogram merged;
+        for (const auto& histogram : histograms) {
+            merged.merge(*histogram);
+        }
+        return merged;
     }
     
-    void removeNode(const string& node_id) {
-        unique_lock<shared_mutex> lock(cluster_mutex);
-        
-        cout << "\n=== Removing Node: " << node_id << " ===" << endl;
+    // Only while no thread is recording
+    void reset() {
+        lock_guard<mutex> lock(histograms_mutex);
+        for (auto& histogram : histograms) {
+            histogram->reset();
+        }
+    }
+    
+private:
+    struct ThreadHistograms {
+        vector<pair<LatencyRecorder*, LatencyHistogram*>> taken;
+        
+        ~ThreadHistograms() {
+            for (auto& pair : taken) {
+                lock_guard<mutex> lock(pair.first->histograms_mutex);
+                pair.first->spare.push_back(pair.second);
+            }
+        }
+    };
+    
+    LatencyHistogram& local() {
+        thread_local ThreadHistograms mine;
+        for (auto& pair : mine.taken) {
+            if (pair.first == this) return *pair.second;
+        }
+        lock_guard<mutex> lock(histograms_mutex);
+        LatencyHistogram* histogram;
+        if (!spare.empty()) {
+            histogram = spare.back();
+            spare.pop_back();
+        } else {
+            histograms.push_back(make_unique<LatencyHistogram>());
+            histogram = histograms.back().get();
+        }
+        mine.taken.push_back({this, histogram});
+        return *histogram;
+    }
+    
+    string metric;
+    mutable mutex histograms_mutex;
+    vector<unique_ptr<LatencyHistogram>> histograms;
+    vector<LatencyHistogram*> spare;      // Released by exited threads
+};
+
+// The store's own latency metrics, in nanoseconds: client puts, gets and
+// removes on the cluster, WAL appends (including the wait for durability)
+// and the fan-out of a put or remove to its replicas
+struct StoreLatency {
+    static inline LatencyRecorder put{"put"};
+    static inline LatencyRecorder get{"get"};
+    static inline LatencyRecorder remove{"remove"};
+    static inline LatencyRecorder wal_append{"wal_append"};
+    static inline LatencyRecorder fan_out{"fan_out"};
+    static inline atomic<bool> enabled{true};
+    
+    static vector<LatencyRecorder*> all() {
+        return {&put, &get, &remove, &wal_append, &fan_out};
+    }
+    
+    static void reset() {
+        for (LatencyRecorder* recorder : all()) {
+            recorder->reset();
+        }
+    }
+};
+
+// Records the time until it goes out of scope, if StoreLatency is enabled
+class LatencyTimer {
+public:
+    explicit LatencyTimer(LatencyRecorder& metric) : recorder(metric) {
+        if (StoreLatency::enabled.load(memory_order_relaxed)) start = chrono::steady_clock::now();
+    }
+    
+    ~LatencyTimer() {
+        if (start.time_since_epoch().count() == 0) return;
+        recorder.record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+    
+    LatencyTimer(const LatencyTimer&) = delete;
+    LatencyTimer& operator=(const LatencyTimer&) = delete;
+    
+private:
+    LatencyRecorder& recorder;
+    chrono::steady_clock::time_point start{};
+};
+
+// Immutable value bytes behind a shared reference count. Copies share the
+// buffer, so a value travels from storage through the caches to the caller
+// without its bytes being copied. Reads as a const string&
+class SharedValue {
+public:
+    SharedValue() = default;
+    SharedValue(string bytes) : buffer(make_shared<const string>(move(bytes))) {}
+    SharedValue(const char* bytes) : SharedValue(string(bytes)) {}
+    
+    const string& str() const { return buffer ? *buffer : empty_bytes; }
+    operator const string&() const { return str(); }
+    operator string_view() const { return str(); }
+    
+    size_t size() const { return str().size(); }
+    bool empty() const { return str().empty(); }
+    const char* data() const { return str().data(); }
+    
+    // Whether two handles share one buffer
+    bool sharesWith(const SharedValue& other) const { return buffer && buffer == other.buffer; }
+    
+    friend bool operator==(const SharedValue& a, const SharedValue& b) { return a.str() == b.str(); }
+    friend bool operator==(const SharedValue& a, const string& b) { return a.str() == b; }
+    friend bool operator==(const string& a, const SharedValue& b) { return a == b.str(); }
+    friend bool operator==(const SharedValue& a, const char* b) { return a.str() == b; }
+    friend bool operator==(const char* a, const SharedValue& b) { return a == b.str(); }
+    template <typename T>
+    friend bool operator!=(const SharedValue& a, const T& b) { return !(a == b); }
+    friend ostream& operator<<(ostream& out, const SharedValue& value) { return out << value.str(); }
+    
+private:
+    shared_ptr<const string> buffer;   // Null for the empty value
+    static inline const string empty_bytes;
+};
+
+// A stored value and the version of the write that produced it. A delete
+// leaves a tombstone (deleted = true) with the delete's version, so an
+// older write arriving late through a replica or a migration cannot bring
+// the key back. Tombstones are purged once older than a grace period.
+// expires_at is a wall-clock deadline in milliseconds, 0 for none
+struct VersionedValue {
+    SharedValue value;
+    uint64_t version = 0;
+    bool deleted = false;
+    uint64_t expires_at = 0;
+    
+    bool isLive(uint64_t now_ms) const {
+        return !deleted && (expires_at == 0 || expires_at > now_ms);
+    }
+};
+
+// Cross-node transactions. The transaction id doubles as the commit
+// version of all its writes. Its record lives on the replicas of the anchor
+// (its smallest written key); Staging is parallel commit's state, in which
+// the transaction is committed once every intent listed in keys exists
+enum class TxnStatus : uint8_t { Pending = 1, Staging = 2, Committed = 3, Aborted = 4 };
+
+inline bool isFinal(TxnStatus status) {
+    return status == TxnStatus::Committed || status == TxnStatus::Aborted;
+}
+
+struct TxnRecord {
+    TxnStatus status = TxnStatus::Pending;
+    vector<string> keys;           // Every key the transaction writes
+};
+
+// A provisional write, invisible to reads until its transaction commits
+struct WriteIntent {
+    uint64_t txn_id = 0;
+    string anchor;
+    VersionedValue entry;          // version is the transaction id
+};
+
+// CRC-32 (IEEE 802.3), used to detect torn WAL records and checkpoints
+inline uint32_t crc32(const char* data, size_t length, uint32_t crc = 0) {
+    static const array<uint32_t, 256> table = []() {
+        array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i) {
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// fsync the directory holding path, making a create, rename or unlink in
+// it durable
+inline void syncParentDirectory(const string& path) {
+    size_t slash = path.rfind('/');
+    string dir = (slash == string::npos) ? "." : path.substr(0, slash);
+    int dir_fd = open(dir.c_str(), O_RDONLY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+// On-disk WAL layout. A log is a series of fixed-size segment files named
+// <wal_path>.<number>, each starting with a HEADER_SIZE block
+//   "KVWALSEG" | u32 version | u32 reserved | u64 segment number |
+//   u64 first sequence number | u32 crc of the preceding fields
+// followed by records framed as
+//   u32 body length | u32 crc of body | u64 sequence number | body
+// where body = u8 type | u64 version | u32 key length | key | value
+// (version 1 segments have no version field). By type, the value is
+//   PUT_TTL     u64 expiry in ms since the epoch | value
+//   TXN         the framed records of one transaction (version 3 on), so
+//               a torn write loses all of it or none
+//   INTENT      u64 transaction id | u8 deleted | u32 anchor length |
+//               anchor | value, with the id as the record's version
+//   RESOLVE     empty; drops the key's intent of the transaction named
+//               in the version field
+//   TXN_STATUS  u8 status (0 = forget the record) | (u32 key length |
+//               key)*, with an empty key and the transaction id as version
+// The CRC leaves out the sequence number so records can be encoded before
+// the log assigns one. Replay stops at the first frame that does not carry
+// the next sequence number or fails its CRC, which covers the zeroed tail
+// of a fresh segment, stale records in a recycled one and torn writes
+struct WalFormat {
+    static constexpr size_t HEADER_SIZE = 4096;
+    static constexpr size_t FRAME_HEADER = 16;
+    static constexpr size_t BODY_HEADER = 13;
+    static constexpr uint32_t VERSION = 3;
+    
+    // DEL leaves a tombstone; DROP forgets the key entirely
+    enum RecordType : uint8_t { PUT = 1, DEL = 2, DROP = 3, PUT_TTL = 4, TXN = 5,
+                                INTENT = 6, RESOLVE = 7, TXN_STATUS = 8 };
+    
+    struct Record {
+        uint8_t type;
+        uint64_t version;
+        string_view key;
+        string_view value;
+        uint64_t expires_at;
+    };
+    
+    struct SegmentHeader {
+        uint32_t version;
+        uint64_t segment;
+        uint64_t start_seq;
+    };
+    
+    // A nonzero expires_at turns a PUT into a PUT_TTL
+    static void appendRecord(string& out, RecordType type, uint64_t version,
+                             string_view key, string_view value = {}, uint64_t expires_at = 0) {
+        if (type == PUT && expires_at) type = PUT_TTL;
+        size_t frame = out.size();
+        out.resize(frame + FRAME_HEADER);
+        out.push_back(static_cast<char>(type));
+        out.append(reinterpret_cast<const char*>(&version), 8);
+        putU32(out, key.size());
+        out.append(key.data(), key.size());
+        if (type == PUT_TTL) out.append(reinterpret_cast<const char*>(&expires_at), 8);
+        out.append(value.data(), value.size());
+        
+        uint32_t body_length = out.size() - frame - FRAME_HEADER;
+        uint32_t crc = crc32(out.data() + frame + FRAME_HEADER, body_length);
+        memcpy(&out[frame], &body_length, 4);
+        memcpy(&out[frame + 4], &crc, 4);
+    }
+    
+    // Bytes appendRecord adds for a key and value of these lengths
+    static size_t encodedSize(size_t key_length, size_t value_length = 0) {
+        return FRAME_HEADER + BODY_HEADER + key_length + value_length;
+    }
+    
+    // Wrap encoded records into one TXN record
+    static void appendTransaction(string& out, const string& records) {
+        appendRecord(out, TXN, 0, {}, records);
+    }
+    
+    // Number the frames of an encoded batch from first_seq; returns the count
+    static uint64_t stampSequence(string& records, uint64_t first_seq) {
+        uint64_t count = 0;
+        for (size_t frame = 0; frame + FRAME_HEADER <= records.size(); ++count) {
+            uint64_t seq = first_seq + count;
+            memcpy(&records[frame + 8], &seq, 8);
+            frame += FRAME_HEADER + getU32(records.data() + frame);
+        }
+        return count;
+    }
+    
+    // Length and sequence of the frame at offset, if one fits in log
+    static bool peekFrame(string_view log, size_t offset, uint32_t& body_length, uint64_t& seq) {
+        if (log.size() - offset < FRAME_HEADER) return false;
+        body_length = getU32(log.data() + offset);
+        memcpy(&seq, log.data() + offset + 8, 8);
+        return body_length > 0 && body_length <= log.size() - offset - FRAME_HEADER;
+    }
+    
+    // Check the CRC and decode the frame at offset (already peeked) of a
+    // segment written in format_version
+    static bool decodeFrame(string_view log, size_t offset, uint32_t format_version, Record& record) {
+        size_t body_header = (format_version >= 2) ? BODY_HEADER : 5;
+        uint32_t body_length = getU32(log.data() + offset);
+        uint32_t crc = getU32(log.data() + offset + 4);
+        string_view body = log.substr(offset + FRAME_HEADER, body_length);
+        if (body.size() < body_header || crc32(body.data(), body.size()) != crc) return false;
+        
+        uint32_t key_length = getU32(body.data() + body_header - 4);
+        if (key_length > body.size() - body_header) return false;
+        record.type = body[0];
+        record.version = 0;
+        if (format_version >= 2) memcpy(&record.version, body.data() + 1, 8);
+        record.key = body.substr(body_header, key_length);
+        record.value = body.substr(body_header + key_length);
+        record.expires_at = 0;
+        if (record.type == PUT_TTL) {
+            if (record.value.size() < 8) return false;
+            memcpy(&record.expires_at, record.value.data(), 8);
+            record.value.remove_prefix(8);
+        }
+        return true;
+    }
+    
+    // Decode the records inside a TXN record, in order
+    static bool decodeTransaction(const Record& txn, uint32_t format_version, vector<Record>& records) {
+        records.clear();
+        uint32_t body_length;
+        uint64_t seq;
+        for (size_t offset = 0; offset < txn.value.size(); offset += FRAME_HEADER + body_length) {
+            records.emplace_back();
+            if (!peekFrame(txn.value, offset, body_length, seq) ||
+                !decodeFrame(txn.value, offset, format_version, records.back()) ||
+                records.back().type == TXN) return false;
+        }
+        return true;
+    }
+    
+    static string encodeHeader(uint64_t segment, uint64_t start_seq) {
+        string header("KVWALSEG", 8);
+        putU32(header, VERSION);
+        putU32(header, 0);
+        header.append(reinterpret_cast<const char*>(&segment), 8);
+        header.append(reinterpret_cast<const char*>(&start_seq), 8);
+        putU32(header, crc32(header.data(), header.size()));
+        header.resize(HEADER_SIZE, '\0');
+        return header;
+    }
+    
+    static bool decodeHeader(string_view data, SegmentHeader& header) {
+        if (data.size() < HEADER_SIZE || data.substr(0, 8) != "KVWALSEG") return false;
+        header.version = getU32(data.data() + 8);
+        if (header.version < 1 || header.version > VERSION) return false;
+        if (getU32(data.data() + 32) != crc32(data.data(), 32)) return false;
+        memcpy(&header.segment, data.data() + 16, 8);
+        memcpy(&header.start_seq, data.data() + 24, 8);
+        return true;
+    }
+    
+    static void putU32(string& out, uint32_t v) {
+        out.append(reinterpret_cast<const char*>(&v), 4);
+    }
+    
+    static uint32_t getU32(const char* p) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
+    }
+};
+
+// What replay learned about the segment files, handed to WriteAheadLog
+struct WalRecovery {
+    struct SpareFile {
+        uint64_t number;
+        bool needs_rename;   // Could be mistaken for a live segment
+    };
+    
+    vector<pair<uint64_t, uint64_t>> segments;   // Replayed (number, first seq)
+    uint64_t next_seq = 1;
+    vector<SpareFile> spares;                     // Files outside the replayed chain
+    uint64_t max_number = 0;
+};
+
+// Position of a change feed in a node's WAL: the segment, byte offset and
+// sequence number of the next record to read. Cursors stay valid across
+// restarts until a checkpoint recycles their segment
+struct ChangeCursor {
+    string node;
+    uint64_t segment = 0;
+    uint64_t offset = 0;
+    uint64_t seq = 0;
+};
+
+// A data change read back from a WAL by a change feed. type is
+// WalFormat::PUT (with expires_at for a TTL), DEL or DROP; the records of
+// one transaction share a seq
+struct ChangeEvent {
+    uint8_t type;
+    string key;
+    string value;
+    uint64_t version;
+    uint64_t expires_at;
+    uint64_t seq;
+};
+
+// Append-only segmented log with group commit. Appends that arrive while
+// earlier batches are in flight are gathered into the next batch, which is
+// written with one vectored write and one fdatasync; append() returns once
+// its records are durable. Segments have a fixed preallocated size, so
+// appends never change file metadata. After a checkpoint, segments it
+// covers are renamed to future segment numbers and reused. Appends after a
+// restart go to a new segment: the tail of a replayed one may hold a torn
+// batch whose later frames are still intact
+class WriteAheadLog {
+public:
+    static constexpr off_t SEGMENT_SIZE = 16 << 20;
+    
+private:
+    static constexpr size_t MAX_INFLIGHT_BATCHES = 4;
+    static constexpr size_t MAX_SPARE_SEGMENTS = 2;
+    static constexpr size_t DIRECT_IO_BLOCK = 4096;
+    // Change feeds read recent appends from memory, up to this many bytes
+    static constexpr size_t RECENT_APPEND_BYTES = 4 << 20;
+    static constexpr size_t CHANGE_READ_CHUNK = 1 << 20;
+    
+    struct AlignedFree {
+        void operator()(char* p) const { free(p); }
+    };
+    
+    // An open segment; in-flight batches keep it open after rotation
+    struct Segment {
+        uint64_t number;
+        uint64_t start_seq;
+        int fd = -1;
+        off_t allocated = 0;
+        string tail_block;   // Direct mode: bytes of the last partial block
+        
+        ~Segment() {
+            if (fd >= 0) close(fd);
+        }
+    };
+    
+    struct Batch {
+        uint64_t id;
+        shared_ptr<Segment> segment;
+        off_t offset;
+        vector<string> records;
+        vector<iovec> iov;
+        off_t write_offset;
+        unique_ptr<char, AlignedFree> aligned;   // Direct mode only
+        uint64_t last_seq = 0;
+    };
+    
+    // A copy of appended frames and where they went, for change feeds
+    struct RecentAppend {
+        uint64_t segment;
+        off_t offset;
+        uint64_t first_seq;
+        uint64_t last_seq;
+        string frames;
+    };
+    
+    string path;
+    WalIoBackend& backend;
+    Durability durability;
+    size_t max_inflight;
+    
+    mutex log_mutex;
+    condition_variable durable_cv;
+    shared_ptr<Segment> active;
+    off_t tail = 0;               // Append offset in the active segment
+    uint64_t next_seq;
+    map<uint64_t, uint64_t> sealed;   // Earlier live segments: number -> first seq
+    set<uint64_t> spares;             // Recycled files, all numbered above live ones
+    uint64_t last_number;
+    multiset<uint64_t> unapplied;     // First seq of appends not yet applied in memory
+    
+    deque<unique_ptr<Batch>> pending;
+    map<uint64_t, unique_ptr<Batch>> inflight;
+    uint64_t next_batch_id = 1;
+    uint64_t durable_batch_id = 0;   // Every batch up to this one is durable
+    uint64_t durable_seq;            // ... and every record up to this one
+    map<uint64_t, uint64_t> completed_out_of_order;   // Batch id -> last seq
+    int io_error = 0;
+    
+    // Appends are copied here once a change feed has read, so feeds that
+    // keep up never go to the files
+    bool keep_recent = false;
+    deque<RecentAppend> recent;
+    size_t recent_bytes = 0;
+    
+public:
+    // durability is Buffered, GroupSync or Direct
+    WriteAheadLog(const string& wal_path, Durability mode, const WalRecovery& recovery)
+        : path(wal_path), backend(WalIoBackend::shared()), durability(mode),
+          next_seq(recovery.next_seq), last_number(recovery.max_number), durable_seq(recovery.next_seq - 1) {
+        max_inflight = (durability == Durability::Direct) ? 1 : MAX_INFLIGHT_BATCHES;
+        
+        // Move leftovers above every live number, so a stale but valid
+        // looking header can never be replayed, and cap how many are kept
+        bool renamed = false;
+        for (const auto& spare : recovery.spares) {
+            string file = segmentPath(path, spare.number);
+            if (spares.size() >= MAX_SPARE_SEGMENTS) {
+                ::remove(file.c_str());
+                renamed = true;
+            } else if (spare.needs_rename) {
+                uint64_t number = ++last_number;
+                if (rename(file.c_str(), segmentPath(path, number).c_str()) == 0) {
+                    spares.insert(number);
+                }
+                renamed = true;
+            } else {
+                spares.insert(spare.number);
+            }
+        }
+        if (renamed) syncParentDirectory(path);
+        
+        // Replayed segments stay until a checkpoint covers them
+        for (const auto& segment : recovery.segments) {
+            sealed[segment.first] = segment.second;
+        }
+    }
+    
+    ~WriteAheadLog() {
+        unique_lock<mutex> lock(log_mutex);
+        durable_cv.wait(lock, [this]() { return inflight.empty() && pending.empty(); });
+    }
+    
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+    
+    // Append one or more frames encoded by WalFormat::appendRecord. Blocks
+    // until they reach the configured durability and returns the sequence
+    // number of the first; pass it to markApplied() once the change is
+    // visible in memory
+    uint64_t append(string records) {
+        LatencyTimer timer(StoreLatency::wal_append);
+        unique_lock<mutex> lock(log_mutex);
+        if (io_error) {
+            throw runtime_error("WAL " + path + " is unwritable: " + strerror(io_error));
+        }
+        
+        if (!active || (tail + (off_t)records.size() > SEGMENT_SIZE && tail > (off_t)WalFormat::HEADER_SIZE)) {
+            rotate();
+        }
+        
+        uint64_t first_seq = next_seq;
+        next_seq += WalFormat::stampSequence(records, first_seq);
+        unapplied.insert(first_seq);
+        if (keep_recent) rememberAppend(records, first_seq);
+        
+        Batch* batch = currentBatch();
+        uint64_t batch_id = batch->id;
+        batch->last_seq = next_seq - 1;
+        tail += records.size();
+        batch->records.push_back(move(records));
+        ensureAllocated(*active, tail);
+        
+        auto ready = takeSubmittable();
+        lock.unlock();
+        submit(ready);
+        lock.lock();
+        
+        durable_cv.wait(lock, [&]() { return durable_batch_id >= batch_id; });
+        if (io_error) {
+            unapplied.erase(unapplied.find(first_seq));
+            throw runtime_error("WAL write to " + path + " failed: " + strerror(io_error));
+        }
+        return first_seq;
+    }
+    
+    // Returns how many sealed segments are waiting for a checkpoint
+    size_t markApplied(uint64_t first_seq) {
+        lock_guard<mutex> lock(log_mutex);
+        auto it = unapplied.find(first_seq);
+        if (it != unapplied.end()) unapplied.erase(it);
+        return sealed.size();
+    }
+    
+    // Every record up to the returned sequence is durable and applied
+    uint64_t appliedThrough() {
+        lock_guard<mutex> lock(log_mutex);
+        return unapplied.empty() ? next_seq - 1 : *unapplied.begin() - 1;
+    }
+    
+    // Called after a checkpoint covering seq is durable: sealed segments
+    // whose records are all <= seq become spares (or are deleted past the cap)
+    void recycleThrough(uint64_t seq) {
+        vector<pair<uint64_t, uint64_t>> renames;   // old number -> new number, 0 = delete
+        {
+            lock_guard<mutex> lock(log_mutex);
+            size_t keep = spares.size();
+            while (!sealed.empty()) {
+                auto next = nextSegmentStart(sealed.begin()->first);
+                if (next > seq + 1) break;
+                
+                uint64_t number = sealed.begin()->first;
+                sealed.erase(sealed.begin());
+                renames.push_back({number, keep < MAX_SPARE_SEGMENTS ? ++last_number : 0});
+                if (renames.back().second) ++keep;
+            }
+        }
+        if (renames.empty()) return;
+        
+        vector<uint64_t> recycled;
+        for (const auto& r : renames) {
+            string from = segmentPath(path, r.first);
+            if (r.second == 0) {
+                ::remove(from.c_str());
+            } else if (rename(from.c_str(), segmentPath(path, r.second).c_str()) == 0) {
+                recycled.push_back(r.second);
+            }
+        }
+        syncParentDirectory(path);
+        
+        lock_guard<mutex> lock(log_mutex);
+        spares.insert(recycled.begin(), recycled.end());
+    }
+    
+    // Where the next append will go, for a change feed that wants only
+    // what follows
+    ChangeCursor changeCursor() {
+        lock_guard<mutex> lock(log_mutex);
+        ChangeCursor cursor;
+        if (active) {
+            cursor.segment = active->number;
+            cursor.offset = tail;
+        }
+        cursor.seq = next_seq;
+        return cursor;
+    }
+    
+    // Change feed: decode the data records from cursor on, those inside
+    // TXN records included, into events and move the cursor past them.
+    // Stops after the frame that reaches max_events, or at the last durable
+    // record. If nothing is durable past the cursor, waits up to wait for an
+    // append; returns whether it read anything. Recent appends come from
+    // memory and older ones from the segment files. Throws once a
+    // checkpoint has recycled the cursor's segment
+    bool readChanges(ChangeCursor& cursor, vector<ChangeEvent>& events, size_t max_events,
+                     chrono::milliseconds wait = chrono::milliseconds(0)) {
+        uint64_t start_seq = cursor.seq;
+        unique_lock<mutex> lock(log_mutex);
+        keep_recent = true;
+        durable_cv.wait_for(lock, wait, [&]() { return durable_seq >= cursor.seq || io_error; });
+        
+        while (events.size() < max_events && cursor.seq <= durable_seq) {
+            uint64_t through = durable_seq;
+            uint64_t before = cursor.seq;
+            auto block = upper_bound(recent.begin(), recent.end(), cursor.seq,
+                                     [](uint64_t seq, const RecentAppend& append) { return seq < append.first_seq; });
+            if (block != recent.begin() && prev(block)->last_seq >= cursor.seq) {
+                --block;
+                if (cursor.segment != block->segment || cursor.offset < (uint64_t)block->offset ||
+                    cursor.offset > block->offset + block->frames.size()) {
+                    cursor.segment = block->segment;
+                    cursor.offset = block->offset;
+                }
+                string_view frames(block->frames);
+                decodeChanges(frames.substr(cursor.offset - block->offset), WalFormat::VERSION,
+                              cursor, events, max_events, through);
+            } else {
+                uint64_t number = segmentHolding(cursor.seq);
+                if (cursor.segment != number) {
+                    cursor.segment = number;
+                    cursor.offset = WalFormat::HEADER_SIZE;
+                }
+                lock.unlock();
+                readSegmentChanges(cursor, events, max_events, through);
+                lock.lock();
+            }
+            if (cursor.seq == before) {
+                throw runtime_error("Change feed cannot read record " + to_string(before) + " of " + path);
+            }
+        }
+        return cursor.seq != start_seq;
+    }
+    
+    const char* backendName() const { return backend.name(); }
+    Durability getDurability() const { return durability; }
+    
+    static string segmentPath(const string& wal_path, uint64_t number) {
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), ".%08llu", static_cast<unsigned long long>(number));
+        return wal_path + suffix;
+    }
+    
+    // Segment files of a log, sorted by number
+    static vector<pair<uint64_t, string>> listSegments(const string& wal_path) {
+        size_t slash = wal_path.rfind('/');
+        string dir = (slash == string::npos) ? "." : wal_path.substr(0, slash);
+        string prefix = ((slash == string::npos) ? wal_path : wal_path.substr(slash + 1)) + ".";
+        
+        vector<pair<uint64_t, string>> segments;
+        DIR* handle = opendir(dir.c_str());
+        if (!handle) return segments;
+        while (dirent* entry = readdir(handle)) {
+            string name = entry->d_name;
+            if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0) continue;
+            string digits = name.substr(prefix.size());
+            if (!all_of(digits.begin(), digits.end(), [](char c) { return isdigit((unsigned char)c); })) continue;
+            segments.push_back({stoull(digits), (slash == string::npos) ? name : dir + "/" + name});
+        }
+        closedir(handle);
+        sort(segments.begin(), segments.end());
+        return segments;
+    }
+    
+    // Delete every file belonging to a log: segments, checkpoint and the
+    // pre-segment single-file log
+    static void removeFiles(const string& wal_path) {
+        for (const auto& segment : listSegments(wal_path)) {
+            ::remove(segment.second.c_str());
+        }
+        ::remove((wal_path + ".checkpoint").c_str());
+        ::remove(wal_path.c_str());
+    }
+    
+private:
+    // Caller holds log_mutex. First sequence number after a sealed segment
+    uint64_t nextSegmentStart(uint64_t number) {
+        auto it = sealed.upper_bound(number);
+        if (it != sealed.end()) return it->second;
+        return active ? active->start_seq : next_seq;
+    }
+    
+    // Caller holds log_mutex. The live segment whose records include seq
+    uint64_t segmentHolding(uint64_t seq) {
+        if (active && active->start_seq <= seq) return active->number;
+        for (auto it = sealed.rbegin(); it != sealed.rend(); ++it) {
+            if (it->second <= seq) return it->first;
+        }
+        throw runtime_error("Change cursor at record " + to_string(seq) + " of " + path +
+                            " is behind the log; a checkpoint recycled its segment");
+    }
+    
+    // Caller holds log_mutex
+    void rememberAppend(const string& records, uint64_t first_seq) {
+        recent.push_back(RecentAppend{active->number, tail, first_seq, next_seq - 1, records});
+        recent_bytes += records.size();
+        while (recent_bytes > RECENT_APPEND_BYTES && recent.size() > 1) {
+            recent_bytes -= recent.front().frames.size();
+            recent.pop_front();
+        }
+    }
+    
+    // Decode frames at the start of log into events while their sequence
+    // numbers run on from cursor.seq, up to through; frames before it are
+    // skipped. Stops at the first other frame or once max_events is reached
+    static void decodeChanges(string_view log, uint32_t format_version, ChangeCursor& cursor,
+                              vector<ChangeEvent>& events, size_t max_events, uint64_t through) {
+        uint32_t body_length;
+        uint64_t seq;
+        WalFormat::Record record;
+        vector<WalFormat::Record> nested;
+        for (size_t offset = 0; events.size() < max_events && cursor.seq <= through &&
+                                WalFormat::peekFrame(log, offset, body_length, seq) && seq <= cursor.seq;
+             offset += WalFormat::FRAME_HEADER + body_length) {
+            if (!WalFormat::decodeFrame(log, offset, format_version, record)) break;
+            cursor.offset += WalFormat::FRAME_HEADER + body_length;
+            if (seq < cursor.seq) continue;
+            
+            if (record.type == WalFormat::TXN) {
+                if (!WalFormat::decodeTransaction(record, format_version, nested)) nested.clear();
+            } else {
+                nested.assign(1, record);
+            }
+            for (const auto& change : nested) {
+                uint8_t type = (change.type == WalFormat::PUT_TTL) ? static_cast<uint8_t>(WalFormat::PUT) : change.type;
+                if (type != WalFormat::PUT && type != WalFormat::DEL && type != WalFormat::DROP) continue;
+                events.push_back(ChangeEvent{type, string(change.key), string(change.value),
+                                             change.version, change.expires_at, seq});
+            }
+            ++cursor.seq;
+        }
+    }
+    
+    // Read frames at the cursor from its segment file, a chunk at a time;
+    // a frame larger than the chunk is read whole. The header must still
+    // name the segment, or the file was recycled meanwhile
+    void readSegmentChanges(ChangeCursor& cursor, vector<ChangeEvent>& events, size_t max_events,
+                            uint64_t through) {
+        string file = segmentPath(path, cursor.segment);
+        int fd = open(file.c_str(), O_RDONLY);
+        string header(WalFormat::HEADER_SIZE, '\0');
+        WalFormat::SegmentHeader decoded{};
+        bool valid = fd >= 0 && pread(fd, &header[0], header.size(), 0) == (ssize_t)header.size() &&
+                     WalFormat::decodeHeader(header, decoded) && decoded.segment == cursor.segment;
+        
+        string chunk;
+        size_t wanted = CHANGE_READ_CHUNK;
+        while (valid && events.size() < max_events && cursor.seq <= through) {
+            chunk.resize(wanted);
+            ssize_t got = pread(fd, &chunk[0], chunk.size(), cursor.offset);
+            if (got <= 0) break;
+            chunk.resize(got);
+            
+            uint64_t before = cursor.offset;
+            decodeChanges(chunk, decoded.version, cursor, events, max_events, through);
+            uint32_t body_length = 0;
+            if (cursor.offset != before) {
+                wanted = CHANGE_READ_CHUNK;
+            } else if (chunk.size() >= WalFormat::FRAME_HEADER &&
+                       (body_length = WalFormat::getU32(chunk.data())) + WalFormat::FRAME_HEADER > chunk.size() &&
+                       body_length <= SEGMENT_SIZE) {
+                wanted = WalFormat::FRAME_HEADER + body_length;
+            } else {
+                break;
+            }
+        }
+        if (fd >= 0) close(fd);
+        if (!valid) {
+            throw runtime_error("Change cursor segment " + file + " was recycled by a checkpoint");
+        }
+    }
+    
+    // Caller holds log_mutex. Seal the active segment and start the next
+    // one, preferring a recycled file; its header goes out with its first
+    // batch
+    void rotate() {
+        if (active) sealed[active->number] = active->start_seq;
+        
+        bool recycled = !spares.empty();
+        uint64_t number = recycled ? *spares.begin() : ++last_number;
+        if (recycled) spares.erase(spares.begin());
+        
+        active = openSegment(number, next_seq, !recycled);
+        tail = 0;
+        
+        Batch* batch = currentBatch();
+        batch->records.push_back(WalFormat::encodeHeader(number, next_seq));
+        tail = WalFormat::HEADER_SIZE;
+    }
+    
+    shared_ptr<Segment> openSegment(uint64_t number, uint64_t start_seq, bool create) {
+        auto segment = make_shared<Segment>();
+        segment->number = number;
+        segment->start_seq = start_seq;
+        
+        string file = segmentPath(path, number);
+        segment->fd = open(file.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+        if (segment->fd < 0) {
+            throw runtime_error("Cannot open WAL segment " + file + ": " + strerror(errno));
+        }
+        
+        struct stat st;
+        segment->allocated = (fstat(segment->fd, &st) == 0) ? st.st_size : 0;
+        if (create) {
+            ensureAllocated(*segment, SEGMENT_SIZE);
+            syncParentDirectory(path);
+        }
+        
+        if (durability == Durability::Direct && !enableDirectIo(*segment)) {
+            cerr << "Warning: direct I/O unsupported for " << file
+                 << ", falling back to fdatasync" << endl;
+            durability = Durability::GroupSync;
+            max_inflight = MAX_INFLIGHT_BATCHES;
+        }
+        return segment;
+    }
+    
+    // Switch the descriptor to uncached I/O
+    bool enableDirectIo(Segment& segment) {
+#if defined(O_DIRECT)
+        return fcntl(segment.fd, F_SETFL, fcntl(segment.fd, F_GETFL) | O_DIRECT) == 0;
+#elif defined(F_NOCACHE)
+        return fcntl(segment.fd, F_NOCACHE, 1) == 0;
+#else
+        return false;
+#endif
+    }
+    
+    // Direct mode: copy the batch behind the tail block into a zero-padded,
+    // block-aligned buffer written from the start of that block
+    void alignBatch(Batch* batch) {
+        string& tail_block = batch->segment->tail_block;
+        size_t payload = tail_block.size();
+        for (const auto& record : batch->records) payload += record.size();
+        size_t padded = (payload + DIRECT_IO_BLOCK - 1) / DIRECT_IO_BLOCK * DIRECT_IO_BLOCK;
+        
+        void* buffer = nullptr;
+        if (posix_memalign(&buffer, DIRECT_IO_BLOCK, padded) != 0) {
+            throw bad_alloc();
+        }
+        batch->aligned.reset(static_cast<char*>(buffer));
+        
+        char* out = batch->aligned.get();
+        out = copy(tail_block.begin(), tail_block.end(), out);
+        for (const auto& record : batch->records) {
+            out = copy(record.begin(), record.end(), out);
+        }
+        fill(out, batch->aligned.get() + padded, '\0');
+        
+        batch->write_offset = batch->offset - tail_block.size();
+        size_t partial = payload % DIRECT_IO_BLOCK;
+        tail_block.assign(batch->aligned.get() + payload - partial, partial);
+        
+        batch->records.clear();
+        batch->iov.push_back({batch->aligned.get(), padded});
+    }
+    
+    // Segments are preallocated whole; this only grows one for a batch
+    // larger than a segment
+    void ensureAllocated(Segment& segment, off_t needed) {
+        if (segment.allocated >= needed) return;
+#ifdef __linux__
+        if (fallocate(segment.fd, 0, segment.allocated, needed - segment.allocated) == 0) {
+            segment.allocated = needed;
+        }
+#else
+        if (ftruncate(segment.fd, needed) == 0) {
+            segment.allocated = needed;
+        }
+#endif
+    }
+    
+    // Caller holds log_mutex. The unsubmitted batch for the active segment
+    Batch* currentBatch() {
+        if (pending.empty() || pending.back()->segment != active) {
+            auto batch = make_unique<Batch>();
+            batch->id = next_batch_id++;
+            batch->segment = active;
+            batch->offset = tail;
+            pending.push_back(move(batch));
+        }
+        return pending.back().get();
+    }
+    
+    // Caller holds log_mutex. Hands pending batches to the backend while
+    // slots are free; otherwise they keep collecting appends
+    vector<Batch*> takeSubmittable() {
+        vector<Batch*> ready;
+        while (!pending.empty() && inflight.size() < max_inflight) {
+            Batch* batch = pending.front().get();
+            
+            if (durability == Durability::Direct) {
+                alignBatch(batch);
+            } else {
+                // Stay under the kernel's iovec limit by coalescing huge batches
+                if (batch->records.size() > IOV_MAX) {
+                    string merged;
+                    for (const auto& record : batch->records) merged += record;
+                    batch->records.assign(1, move(merged));
+                }
+                for (auto& record : batch->records) {
+                    batch->iov.push_back({&record[0], record.size()});
+                }
+                batch->write_offset = batch->offset;
+            }
+            
+            inflight[batch->id] = move(pending.front());
+            pending.pop_front();
+            ready.push_back(batch);
+        }
+        return ready;
+    }
+    
+    void submit(const vector<Batch*>& batches) {
+        for (Batch* batch : batches) {
+            uint64_t batch_id = batch->id;
+            bool sync = durability != Durability::Buffered;
+            backend.submitWrite(batch->segment->fd, batch->iov.data(), batch->iov.size(),
+                                batch->write_offset, sync,
+                                [this, batch_id](int result) { onBatchDone(batch_id, result); });
+        }
+    }
+    
+    void onBatchDone(uint64_t batch_id, int result) {
+        vector<Batch*> ready;
+        {
+            lock_guard<mutex> lock(log_mutex);
+            if (result < 0 && !io_error) io_error = -result;
+            
+            // Batches may finish out of order; a writer is released only
+            // when its batch and every earlier one are durable. A failed
+            // batch adds nothing for change feeds
+            completed_out_of_order[batch_id] = (result < 0) ? 0 : inflight[batch_id]->last_seq;
+            inflight.erase(batch_id);
+            for (auto it = completed_out_of_order.find(durable_batch_id + 1); it != completed_out_of_order.end();
+                 it = completed_out_of_order.find(durable_batch_id + 1)) {
+                durable_seq = max(durable_seq, it->second);
+                completed_out_of_order.erase(it);
+                ++durable_batch_id;
+            }
+            ready = takeSubmittable();
+            
+            // Notify under the lock: the destructor may run as soon as the
+            // last in-flight batch is gone
+            durable_cv.notify_all();
+        }
+        if (!ready.empty()) submit(ready);
+    }
+};
+
+// Hierarchical timing wheel for key expiry. LEVELS wheels of SLOTS buckets,
+// where one bucket on level n spans a whole turn of level n - 1. A key
+// waits on the coarsest level its deadline fits and cascades down as the
+// deadline nears, so scheduling is O(1) and a tick touches one bucket per
+// level instead of scanning every key. Not thread-safe
+class TimerWheel {
+public:
+    static constexpr uint64_t TICK_MS = 100;
+    
+private:
+    static constexpr int LEVELS = 4;         // 64^4 ticks, about 19 days
+    static constexpr int SLOT_BITS = 6;
+    static constexpr uint64_t SLOTS = 1 << SLOT_BITS;
+    
+    struct Timer {
+        string key;
+        uint64_t tick;
+    };
+    
+    vector<Timer> buckets[LEVELS][SLOTS];
+    uint64_t current_tick;
+    size_t scheduled = 0;
+    
+public:
+    explicit TimerWheel(uint64_t now_ms = HybridClock::wallMillis()) : current_tick(now_ms / TICK_MS) {}
+    
+    // Deadlines are rounded up to the next tick, so keys never fire early
+    void schedule(const string& key, uint64_t deadline_ms) {
+        place(Timer{key, (deadline_ms + TICK_MS - 1) / TICK_MS}, current_tick + 1);
+        ++scheduled;
+    }
+    
+    size_t size() const { return scheduled; }
+    
+    // Move the wheel up to now_ms and return the keys that came due
+    vector<string> advance(uint64_t now_ms) {
+        vector<string> due;
+        uint64_t target = now_ms / TICK_MS;
+        if (scheduled == 0) {
+            current_tick = max(current_tick, target);
+            return due;
+        }
+        
+        while (current_tick < target) {
+            ++current_tick;
+            
+            // Each time a level wraps, spread the next bucket above it down
+            for (int level = 1; level < LEVELS; ++level) {
+                if (current_tick & ((1ull << (SLOT_BITS * level)) - 1)) break;
+                auto& bucket = buckets[level][(current_tick >> (SLOT_BITS * level)) & (SLOTS - 1)];
+                vector<Timer> cascading;
+                cascading.swap(bucket);
+                for (auto& timer : cascading) {
+                    place(move(timer), current_tick);
+                }
+            }
+            
+            vector<Timer> firing;
+            firing.swap(buckets[0][current_tick & (SLOTS - 1)]);
+            for (auto& timer : firing) {
+                if (timer.tick <= current_tick) {
+                    due.push_back(move(timer.key));
+                    --scheduled;
+                } else {
+                    place(move(timer), current_tick + 1);   // Beyond the top level's range
+                }
+            }
+        }
+        return due;
+    }
+    
+private:
+    void place(Timer timer, uint64_t earliest_tick) {
+        uint64_t tick = max(timer.tick, earliest_tick);
+        uint64_t delta = tick - current_tick;
+        int level = 0;
+        while (level + 1 < LEVELS && delta >= (1ull << (SLOT_BITS * (level + 1)))) {
+            ++level;
+        }
+        buckets[level][(tick >> (SLOT_BITS * level)) & (SLOTS - 1)].push_back(move(timer));
+    }
+};
+
+// Storage Engine with WAL (Write-Ahead Logging)
+class StorageEngine {
+public:
+    struct TombstoneStats {
+        size_t count = 0;
+        size_t memory_bytes = 0;   // Map nodes and key storage
+        size_t disk_bytes = 0;     // In the last checkpoint plus DELs logged since
+    };
+    
+    // A consistent view of the data as of one point in the engine's change
+    // order: reads through it miss every later change. The versions it can
+    // see are kept until it is destroyed, which must happen before the
+    // engine goes
+    class Snapshot {
+    public:
+        Snapshot(const Snapshot&) = delete;
+        ~Snapshot() { engine.releaseSnapshot(seq); }
+        
+        // The HLC time it was taken at; expiry is judged at this time
+        uint64_t timestamp() const { return time; }
+        
+    private:
+        friend class StorageEngine;
+        Snapshot(StorageEngine& engine, uint64_t seq, uint64_t time) : engine(engine), seq(seq), time(time) {}
+        
+        StorageEngine& engine;
+        uint64_t seq;
+        uint64_t time;
+    };
+    
+private:
+    // One replayed change: op is 'P' for PUT, 'D' for DEL (a tombstone) and
+    // 'X' for DROP (forget the key). Key and value point into a mapped file
+    // and are copied only when applied. seq and version are 0 for records
+    // of the pre-segment text log
+    struct WalRecord {
+        char op;
+        string_view key;
+        string_view value;
+        uint64_t seq;
+        uint64_t version;
+        uint64_t expires_at;
+    };
+    
+    // A replaced entry, kept while an open snapshot or a read in the
+    // retention window may still see it. An entry with version 0 stands for
+    // "the key did not exist"
+    struct OldVersion {
+        VersionedValue entry;
+        uint64_t replaced;   // change_seq of the change that replaced it
+    };
+    
+    using Shard = unordered_map<string, VersionedValue>;
+    using Emit = function<void(const WalRecord&)>;
+    
+    // The pre-segment text log is replayed in windows of this size
+    static constexpr size_t WAL_REPLAY_WINDOW = 64 << 20;
+    // Logs smaller than this are replayed on the calling thread
+    static constexpr size_t WAL_PARALLEL_REPLAY_MIN = 4 << 20;
+    // Checkpoint once this many full segments are waiting to be recycled
+    static constexpr size_t CHECKPOINT_AFTER_SEGMENTS = 4;
+    // Batches are applied this many keys per data_mutex hold
+    static constexpr size_t APPLY_SLICE = 256;
+    static constexpr size_t KEY_LOCK_STRIPES = 64;
+    
+    unordered_map<string, VersionedValue> data;
+    shared_mutex data_mutex;
+    // Serialize writers of a key, so update() and transactions can read,
+    // decide and write without another write slipping in between
+    mutex key_locks[KEY_LOCK_STRIPES];
+    
+    // Cross-node transaction state, guarded by data_mutex
+    unordered_map<string, WriteIntent> intents;
+    unordered_map<uint64_t, TxnRecord> txn_records;
+    atomic<size_t> intent_count{0};   // Lets reads skip the intent lookup
+    mutex txn_record_mutex;          // Serializes putTxnRecord's check and write
+    
+    // Multi-version reads. Versions replaced while a snapshot is open or a
+    // retention window is set go to history, oldest first per key. The
+    // three are guarded by data_mutex
+    unordered_map<string, deque<OldVersion>> history;
+    uint64_t change_seq = 0;            // Numbers the changes that keep a version
+    multiset<uint64_t> open_snapshots;  // change_seq at each open snapshot
+    atomic<size_t> history_versions{0};
+    atomic<bool> collecting{false};
+    atomic<long long> version_retention_ms{0};
+    atomic<uint64_t> retained_from{0};  // HLC time the window has kept history from
+    string wal_path;
+    unique_ptr<WriteAheadLog> wal;
+    
+    mutex checkpoint_mutex;          // One checkpoint at a time
+    mutex checkpoint_thread_mutex;
+    thread checkpoint_thread;
+    atomic<bool> checkpoint_running{false};
+    
+    atomic<long long> tombstone_grace_ms{DEFAULT_TOMBSTONE_GRACE.count()};
+    atomic<size_t> checkpoint_tombstone_bytes{0};
+    atomic<size_t> logged_tombstone_bytes{0};
+    
+    // Keys with a TTL; the expiry thread starts with the first one
+    mutex expiry_mutex;
+    condition_variable expiry_cv;
+    TimerWheel expiry_wheel;
+    thread expiry_thread;
+    bool expiry_stopping = false;
+    function<void(const string&, uint64_t)> expiry_listener;
+    
+public:
+    // Tombstones younger than this survive checkpoints
+    static constexpr chrono::milliseconds DEFAULT_TOMBSTONE_GRACE = chrono::hours(24);
+    
+    // replay_threads = 0 picks a worker count from the WAL size and core
+    // count. Durability::None keeps data in memory only and ignores the WAL
+    StorageEngine(const string& path = "kvstore.wal",
+                  Durability durability = Durability::GroupSync,
+                  unsigned replay_threads = 0)
+        : wal_path(path) {
+        if (durability != Durability::None) {
+            bool replayed_legacy = false;
+            WalRecovery recovery = loadFromWAL(replay_threads, replayed_legacy);
+            wal = make_unique<WriteAheadLog>(wal_path, durability, recovery);
+            
+            // Fold a pre-segment text log into a checkpoint so it can go
+            if (replayed_legacy) checkpoint();
+            
+            for (const auto& pair : data) {
+                if (pair.second.expires_at && !pair.second.deleted) {
+                    scheduleExpiry(pair.first, pair.second.expires_at);
+                }
+            }
+        }
+    }
+    
+    ~StorageEngine() {
+        {
+            lock_guard<mutex> lock(expiry_mutex);
+            expiry_stopping = true;
+        }
+        expiry_cv.notify_all();
+        if (expiry_thread.joinable()) expiry_thread.join();
+        
+        lock_guard<mutex> lock(checkpoint_thread_mutex);
+        if (checkpoint_thread.joinable()) checkpoint_thread.join();
+    }
+    
+    // version = 0 stamps the write from the local clock. A write older than
+    // what the key already holds (value or tombstone) is ignored; returns
+    // whether it was applied. expires_at is a wall-clock deadline in
+    // milliseconds (0 = never); past it the key reads as missing. A string
+    // value is copied or moved into a new buffer, a handle is shared as is
+    bool put(const string& key, SharedValue value, uint64_t version = 0, uint64_t expires_at = 0) {
+        lock_guard<mutex> key_lock(key_locks[keyStripe(key)]);
+        return write(key, VersionedValue{move(value), stamp(version), false, expires_at});
+    }
+    
+    // Missing, deleted and expired keys read as nullopt; "" is a value
+    optional<SharedValue> get(const string& key) {
+        shared_lock<shared_mutex> lock(data_mutex);
+        auto it = data.find(key);
+        if (it == data.end() || !it->second.isLive(HybridClock::wallMillis())) return nullopt;
+        return it->second.value;
+    }
+    
+    // The stored entry for key, tombstones included
+    bool getEntry(const string& key, VersionedValue& entry) {
+        shared_lock<shared_mutex> lock(data_mutex);
+        auto it = data.find(key);
+        if (it == data.end()) return false;
+        entry = it->second;
+        return true;
+    }
+    
+    // Open a snapshot; see Snapshot. Taking one costs a lock and an
+    // insert, but while any is open every change keeps the entry it replaces
+    shared_ptr<const Snapshot> snapshot() {
+        unique_lock<shared_mutex> lock(data_mutex);
+        open_snapshots.insert(change_seq);
+        return shared_ptr<const Snapshot>(new Snapshot(*this, change_seq, HybridClock::shared().now()));
+    }
+    
+    // The entry for key as the snapshot sees it, tombstones included
+    bool getEntry(const string& key, VersionedValue& entry, const Snapshot& snapshot) {
+        shared_lock<shared_mutex> lock(data_mutex);
+        return visibleLocked(key, snapshot.seq, entry);
+    }
+    
+    optional<SharedValue> get(const string& key, const Snapshot& snapshot) {
+        VersionedValue entry;
+        if (!getEntry(key, entry, snapshot) || !entry.isLive(HybridClock::toMillis(snapshot.time))) return nullopt;
+        return entry.value;
+    }
+    
+    // The value key held at HLC time at_timestamp: its newest version no
+    // newer than that. Versions replaced before the retention window are
+    // kept only while a snapshot needs them, so a read further back than
+    // the window throws unless the key has not changed since
+    optional<SharedValue> get(const string& key, uint64_t at_timestamp) {
+        shared_lock<shared_mutex> lock(data_mutex);
+        const VersionedValue* found = nullptr;
+        auto it = data.find(key);
+        auto old = history.find(key);
+        if (it != data.end() && it->second.version <= at_timestamp) {
+            found = &it->second;
+        } else if (at_timestamp < retainedSince() && (it != data.end() || old != history.end())) {
+            throw runtime_error("Versions of " + key + " from before the retention window are not kept");
+        } else if (old != history.end()) {
+            for (auto version = old->second.rbegin(); version != old->second.rend(); ++version) {
+                if (version->entry.version <= at_timestamp) {
+                    found = &version->entry;
+                    break;
+                }
+            }
+        }
+        if (!found || !found->isLive(HybridClock::toMillis(at_timestamp))) return nullopt;
+        return found->value;
+    }
+    
+    // Call visit with each live key the snapshot sees, or with every entry,
+    // tombstones and expired values included, if tombstones is set. Keys are
+    // listed and read a slice at a time, so writers keep going during a
+    // long scan
+    void scan(const Snapshot& snapshot, const function<void(const string&, const VersionedValue&)>& visit,
+              bool tombstones = false) {
+        // A rehash between slices moves keys across buckets, so the listing
+        // starts over. Keys removed since the snapshot live on in history
+        vector<string> keys;
+        size_t listed = 0;
+        for (size_t bucket = 0, buckets = 0;;) {
+            shared_lock<shared_mutex> lock(data_mutex);
+            if (data.bucket_count() != buckets) {
+                keys.clear();
+                bucket = 0;
+                buckets = data.bucket_count();
+                keys.reserve(data.size());
+            }
+            if (bucket == buckets) {
+                listed = keys.size();
+                for (const auto& pair : history) {
+                    if (!data.count(pair.first)) keys.push_back(pair.first);
+                }
+                break;
+            }
+            for (size_t end = min(buckets, bucket + APPLY_SLICE); bucket < end; ++bucket) {
+                for (auto it = data.begin(bucket); it != data.end(bucket); ++it) {
+                    keys.push_back(it->first);
+                }
+            }
+        }
+        // A key removed during the listing may have been listed twice
+        if (keys.size() > listed) {
+            sort(keys.begin() + listed, keys.end());
+            auto removed = [&](const string& key) { return binary_search(keys.begin() + listed, keys.end(), key); };
+            keys.erase(remove_if(keys.begin(), keys.begin() + listed, removed), keys.begin() + listed);
+        }
+        
+        uint64_t now = HybridClock::toMillis(snapshot.time);
+        vector<VersionedValue> entries;
+        for (size_t start = 0; start < keys.size(); start += APPLY_SLICE) {
+            size_t end = min(keys.size(), start + APPLY_SLICE);
+            entries.assign(end - start, VersionedValue{});
+            {
+                shared_lock<shared_mutex> lock(data_mutex);
+                for (size_t i = start; i < end; ++i) {
+                    visibleLocked(keys[i], snapshot.seq, entries[i - start]);
+                }
+            }
+            for (size_t i = start; i < end; ++i) {
+                const VersionedValue& entry = entries[i - start];
+                if (entry.version && (tombstones || entry.isLive(now))) visit(keys[i], entry);
+            }
+        }
+    }
+    
+    // Keep replaced versions this long for get(key, at_timestamp). The
+    // default, 0, keeps only what open snapshots need
+    void setVersionRetention(chrono::milliseconds retention) {
+        // Versions that left the old window, or every version if there was
+        // none, are already gone
+        uint64_t now = HybridClock::wallMillis();
+        long long previous = version_retention_ms.exchange(retention.count());
+        uint64_t start = previous > 0 ? HybridClock::fromMillis(now - min<long long>(now, previous))
+                                      : HybridClock::shared().now();
+        retained_from = previous > 0 ? max(retained_from.load(), start) : start;
+    }
+    
+    // Leaves a tombstone, even for a key this node never saw, so a late
+    // older write cannot bring it back. Returns whether a live value went
+    bool remove(const string& key, uint64_t version = 0) {
+        lock_guard<mutex> key_lock(key_locks[keyStripe(key)]);
+        bool was_live = false;
+        return write(key, VersionedValue{"", stamp(version), true}, &was_live) && was_live;
+    }
+    
+    // Apply an entry from another replica (value or tombstone) if it is
+    // newer than the local one
+    bool merge(const string& key, const VersionedValue& entry) {
+        lock_guard<mutex> key_lock(key_locks[keyStripe(key)]);
+        return write(key, entry);
+    }
+    
+    // Atomic read-modify-write. compute(current, next) sees the live entry
+    // (nullptr if there is none) and fills next, or returns false to leave
+    // the key alone. Writes of one key are serialized by a striped lock, and
+    // the write gets a version newer than the one it replaced. Returns
+    // whether a write happened; result is the written entry, or the current
+    // one when compute declined
+    bool update(const string& key, const function<bool(const VersionedValue*, VersionedValue&)>& compute,
+                VersionedValue& result) {
+        lock_guard<mutex> key_lock(key_locks[keyStripe(key)]);
+        
+        VersionedValue current;
+        bool live = getEntry(key, current) && current.isLive(HybridClock::wallMillis());
+        VersionedValue next;
+        if (!compute(live ? &current : nullptr, next)) {
+            result = live ? current : VersionedValue{};
+            return false;
+        }
+        
+        HybridClock::shared().observe(current.version);
+        next.version = HybridClock::shared().now();
+        next.deleted = false;
+        write(key, next);
+        result = next;
+        return true;
+    }
+    
+    // Optimistic commit. reads holds the version the transaction saw for
+    // each key it read (0 = missing), writes its new values and tombstones.
+    // With the key locks of all of them held, the reads are checked against
+    // the current versions; if none changed, the writes get one new version
+    // and are logged as a single TXN record and applied in one data_mutex
+    // hold. Keys under a cross-node transaction's intent conflict too.
+    // Returns false, writing nothing, on a conflict
+    bool commitTransaction(const unordered_map<string, uint64_t>& reads,
+                           unordered_map<string, VersionedValue>& writes) {
+        auto key_locks_held = lockKeys(reads, writes);
+        
+        uint64_t newest = 0;
+        if (!validateLocked(0, reads, writes, newest)) return false;
+        if (writes.empty()) return true;
+        
+        HybridClock::shared().observe(newest);
+        uint64_t version = HybridClock::shared().now();
+        for (auto& change : writes) {
+            change.second.version = version;
+        }
+        logAndApply(writes, true);
+        return true;
+    }
+    
+    // Apply a transaction resolved by another replica's commitTransaction,
+    // with the same all-or-nothing logging
+    void mergeTransaction(const unordered_map<string, VersionedValue>& writes) {
+        auto key_locks_held = lockKeys(writes);
+        logAndApply(writes, true);
+    }
+    
+    // Phase one of a cross-node transaction on this participant: like
+    // commitTransaction it checks the reads and rejects keys under another
+    // transaction's intent, and a written key must hold nothing newer than
+    // the transaction. On success each write is stored as an intent, all
+    // in one TXN record. Returns the vote. Replicas of a participant that
+    // voted yes store its intents with validate = false
+    bool prepareIntents(uint64_t txn_id, const string& anchor,
+                        const unordered_map<string, uint64_t>& reads,
+                        const unordered_map<string, VersionedValue>& writes, bool validate = true) {
+        auto key_locks_held = lockKeys(reads, writes);
+        
+        uint64_t newest = 0;
+        if (validate && (!validateLocked(txn_id, reads, writes, newest) || newest >= txn_id)) {
+            return false;
+        }
+        
+        string records;
+        for (const auto& change : writes) {
+            WriteIntent intent{txn_id, anchor, change.second};
+            WalFormat::appendRecord(records, WalFormat::INTENT, txn_id, change.first, encodeIntent(intent));
+        }
+        logAndApplyRecords(records);
+        return true;
+    }
+    
+    // Phase two: the transaction's intents on keys become writes at its
+    // version (commit) or are dropped. Keys without one are skipped
+    void resolveIntents(uint64_t txn_id, const vector<string>& keys, bool commit) {
+        auto key_locks_held = lockKeys(keys);
+        
+        string records;
+        {
+            shared_lock<shared_mutex> lock(data_mutex);
+            for (const string& key : keys) {
+                auto it = intents.find(key);
+                if (it == intents.end() || it->second.txn_id != txn_id) continue;
+                if (commit) encodeEntry(records, key, it->second.entry);
+                WalFormat::appendRecord(records, WalFormat::RESOLVE, txn_id, key);
+            }
+        }
+        logAndApplyRecords(records);
+    }
+    
+    bool getIntent(const string& key, WriteIntent& intent) {
+        if (intent_count == 0) return false;
+        shared_lock<shared_mutex> lock(data_mutex);
+        auto it = intents.find(key);
+        if (it == intents.end()) return false;
+        intent = it->second;
+        return true;
+    }
+    
+    unordered_map<string, WriteIntent> getIntents() {
+        shared_lock<shared_mutex> lock(data_mutex);
+        return intents;
+    }
+    
+    // Store a transaction record unless one with a different final status
+    // is already here; returns the status the record ends up with
+    TxnStatus putTxnRecord(uint64_t txn_id, const TxnRecord& record) {
+        lock_guard<mutex> serialize(txn_record_mutex);
+        {
+            shared_lock<shared_mutex> lock(data_mutex);
+            auto it = txn_records.find(txn_id);
+            if (it != txn_records.end() && isFinal(it->second.status) && it->second.status != record.status) {
+                return it->second.status;
+            }
+        }
+        
+        string records;
+        WalFormat::appendRecord(records, WalFormat::TXN_STATUS, txn_id, {}, encodeTxnRecord(&record));
+        logAndApplyRecords(records);
+        return record.status;
+    }
+    
+    bool getTxnRecord(uint64_t txn_id, TxnRecord& record) {
+        shared_lock<shared_mutex> lock(data_mutex);
+        auto it = txn_records.find(txn_id);
+        if (it == txn_records.end()) return false;
+        record = it->second;
+        return true;
+    }
+    
+    unordered_map<uint64_t, TxnRecord> getTxnRecords() {
+        shared_lock<shared_mutex> lock(data_mutex);
+        return txn_records;
+    }
+    
+    // Drop the record of a transaction whose intents are all resolved
+    void forgetTxnRecord(uint64_t txn_id) {
+        lock_guard<mutex> serialize(txn_record_mutex);
+        string records;
+        WalFormat::appendRecord(records, WalFormat::TXN_STATUS, txn_id, {}, encodeTxnRecord(nullptr));
+        logAndApplyRecords(records);
+    }
+    
+    vector<string> getAllKeys() {
+        uint64_t now = HybridClock::wallMillis();
+        shared_lock<shared_mutex> lock(data_mutex);
+        vector<string> keys;
+        for (const auto& pair : data) {
+            if (pair.second.isLive(now)) keys.push_back(pair.first);
+        }
+        return keys;
+    }
+    
+    // Get all live key-value pairs, as of one snapshot
+    unordered_map<string, string> getAllData() {
+        unordered_map<string, string> live;
+        scan(*snapshot(), [&](const string& key, const VersionedValue& entry) {
+            live.emplace(key, entry.value);
+        });
+        return live;
+    }
+    
+    // Every entry with its version, tombstones included, for redistribution
+    unordered_map<string, VersionedValue> getAllEntries() {
+        shared_lock<shared_mutex> lock(data_mutex);
+        return data;
+    }
+    
+    // Batch operations for efficient redistribution. The batch is encoded
+    // and logged without holding data_mutex, then applied a slice at a time
+    // so reads keep flowing during a large migration
+    void putBatch(const unordered_map<string, string>& batch) {
+        uint64_t version = HybridClock::shared().now();
+        unordered_map<string, VersionedValue> entries;
+        for (const auto& pair : batch) {
+            entries.emplace(pair.first, VersionedValue{pair.second, version, false});
+        }
+        mergeBatch(entries);
+    }
+    
+    // Last-writer-wins merge: each entry replaces the local one only if newer
+    void mergeBatch(const unordered_map<string, VersionedValue>& batch) {
+        logAndApply(batch, false);
+    }
+    
+    // Tombstone every key with one version
+    void removeBatch(const vector<string>& keys) {
+        uint64_t version = HybridClock::shared().now();
+        unordered_map<string, VersionedValue> entries;
+        for (const string& key : keys) {
+            entries.emplace(key, VersionedValue{"", version, true});
+        }
+        mergeBatch(entries);
+    }
+    
+    // Forget keys outright, without tombstones: for data migrated to the
+    // node that now owns it
+    void dropBatch(const vector<string>& keys) {
+        // Write to WAL first, as a single group commit
+        uint64_t seq = 0;
+        if (wal) {
+            size_t bytes = 0;
+            for (const string& key : keys) {
+                bytes += WalFormat::encodedSize(key.size());
+            }
+            string records;
+            records.reserve(bytes);
+            for (const string& key : keys) {
+                WalFormat::appendRecord(records, WalFormat::DROP, 0, key);
+            }
+            seq = wal->append(move(records));
+        }
+        
+        // Then remove from in-memory data
+        for (size_t start = 0; start < keys.size(); start += APPLY_SLICE) {
+            unique_lock<shared_mutex> lock(data_mutex);
+            for (size_t i = start; i < min(keys.size(), start + APPLY_SLICE); ++i) {
+                auto it = data.find(keys[i]);
+                if (it == data.end()) continue;
+                keepVersionLocked(keys[i], &it->second);
+                data.erase(it);
+            }
+        }
+        markApplied(seq);
+    }
+    
+    void setTombstoneGracePeriod(chrono::milliseconds grace) {
+        tombstone_grace_ms = grace.count();
+    }
+    
+    // Change feed over the WAL; see WriteAheadLog::readChanges. An engine
+    // without a WAL (Durability::None) has none
+    ChangeCursor changeCursor() {
+        return changeLog().changeCursor();
+    }
+    
+    bool readChanges(ChangeCursor& cursor, vector<ChangeEvent>& events, size_t max_events,
+                     chrono::milliseconds wait = chrono::milliseconds(0)) {
+        return changeLog().readChanges(cursor, events, max_events, wait);
+    }
+    
+    // Called with each key the expiry thread retires and the version of
+    // its tombstone. Set before the first TTL write; it runs on the expiry
+    // thread
+    void setExpiryListener(function<void(const string&, uint64_t)> listener) {
+        lock_guard<mutex> lock(expiry_mutex);
+        expiry_listener = move(listener);
+    }
+    
+    size_t pendingExpiries() {
+        lock_guard<mutex> lock(expiry_mutex);
+        return expiry_wheel.size();
+    }
+    
+    TombstoneStats tombstoneStats() {
+        TombstoneStats stats;
+        {
+            shared_lock<shared_mutex> lock(data_mutex);
+            for (const auto& pair : data) {
+                if (!pair.second.deleted) continue;
+                ++stats.count;
+                stats.memory_bytes += tombstoneMemory(pair.first);
+            }
+        }
+        stats.disk_bytes = checkpoint_tombstone_bytes + logged_tombstone_bytes;
+        return stats;
+    }
+    
+    // Snapshot the data to <wal_path>.checkpoint, then recycle the WAL
+    // segments the snapshot covers. Tombstones past the grace period are
+    // left out of the snapshot and dropped from memory. The data is copied
+    // through a Snapshot, so writes continue meanwhile. Runs in the
+    // background once enough segments fill up; safe to call directly
+    void checkpoint() {
+        lock_guard<mutex> serialize(checkpoint_mutex);
+        uint64_t purge_before = HybridClock::fromMillis(
+            HybridClock::wallMillis() - min<long long>(HybridClock::wallMillis(), tombstone_grace_ms));
+        
+        if (wal) {
+            // Read the watermark before copying: every record up to it is
+            // already in data. Later changes caught by the copy are replayed
+            // again on top of it, in order, which is harmless
+            uint64_t seq = wal->appliedThrough();
+            logged_tombstone_bytes = 0;
+            unordered_map<string, VersionedValue> entries;
+            scan(*snapshot(), [&](const string& key, const VersionedValue& entry) {
+                entries.emplace(key, entry);
+            }, true);
+            writeCheckpoint(entries, getIntents(), getTxnRecords(), seq, purge_before);
+            wal->recycleThrough(seq);
+            ::remove(wal_path.c_str());   // Pre-segment log, now covered
+        }
+        purgeTombstones(purge_before);
+        collectVersions();
+    }
+    
+private:
+    WriteAheadLog& changeLog() {
+        if (!wal) throw runtime_error("No change feed for " + wal_path + ": it keeps no WAL");
+        return *wal;
+    }
+    
+    static uint64_t stamp(uint64_t version) {
+        return version ? version : HybridClock::shared().now();
+    }
+    
+    static size_t keyStripe(const string& key) {
+        return hash<string>{}(key) % KEY_LOCK_STRIPES;
+    }
+    
+    static const string& keyOf(const string& key) {
+        return key;
+    }
+    
+    template<typename V>
+    static const string& keyOf(const pair<const string, V>& entry) {
+        return entry.first;
+    }
+    
+    // Lock the stripes of every key in the containers (key lists or maps
+    // keyed by key)
+    template<typename... Containers>
+    vector<unique_lock<mutex>> lockKeys(const Containers&... containers) {
+        vector<size_t> stripes;
+        auto add = [&](const auto& keys) {
+            for (const auto& key : keys) stripes.push_back(keyStripe(keyOf(key)));
+        };
+        (add(containers), ...);
+        return lockStripes(move(stripes));
+    }
+    
+    // Lock each stripe once, in index order, so holders of several
+    // stripes cannot deadlock
+    vector<unique_lock<mutex>> lockStripes(vector<size_t> stripes) {
+        sort(stripes.begin(), stripes.end());
+        stripes.erase(unique(stripes.begin(), stripes.end()), stripes.end());
+        vector<unique_lock<mutex>> held;
+        held.reserve(stripes.size());
+        for (size_t stripe : stripes) {
+            held.emplace_back(key_locks[stripe]);
+        }
+        return held;
+    }
+    
+    // Log the batch with one append, then apply it a slice at a time; a
+    // transaction goes in one TXN record and is applied in a single slice,
+    // its caller holding the key locks of the batch throughout. Otherwise the
+    // batch is logged with no key lock held and each slice locks its own
+    // stripes only while it is applied, so the append and its sync stall no
+    // writer. A transaction between validating and applying still holds its
+    // stripes, so a slice touching its keys waits and lands after it, where
+    // the versions decide as in any merge
+    void logAndApply(const unordered_map<string, VersionedValue>& batch, bool transaction) {
+        // Write to WAL first, as a single group commit
+        uint64_t seq = 0;
+        if (wal && !batch.empty()) {
+            size_t bytes = 0;
+            for (const auto& pair : batch) {
+                bytes += WalFormat::encodedSize(pair.first.size(), pair.second.value.size());
+            }
+            string records;
+            records.reserve(bytes);
+            for (const auto& pair : batch) {
+                encodeEntry(records, pair.first, pair.second);
+            }
+            if (transaction) {
+                string txn;
+                txn.reserve(WalFormat::encodedSize(0, records.size()));
+                WalFormat::appendTransaction(txn, records);
+                records = move(txn);
+            }
+            seq = wal->append(move(records));
+        }
+        
+        // Then update in-memory data
+        size_t slice = transaction ? batch.size() : APPLY_SLICE;
+        auto it = batch.begin();
+        while (it != batch.end()) {
+            auto end = it;
+            vector<size_t> stripes;
+            for (size_t n = 0; n < slice && end != batch.end(); ++n, ++end) {
+                if (!transaction) stripes.push_back(keyStripe(end->first));
+            }
+            auto key_locks_held = lockStripes(move(stripes));
+            unique_lock<shared_mutex> lock(data_mutex);
+            for (; it != end; ++it) {
+                applyLocked(it->first, it->second);
+            }
+        }
+        markApplied(seq);
+    }
+    
+    // Reads still at the versions seen and no intent of another transaction
+    // (txn_id 0 = any) on the keys; newest is the highest version held by a
+    // written key. Caller holds the key locks
+    bool validateLocked(uint64_t txn_id, const unordered_map<string, uint64_t>& reads,
+                        const unordered_map<string, VersionedValue>& writes, uint64_t& newest) {
+        uint64_t now = HybridClock::wallMillis();
+        shared_lock<shared_mutex> lock(data_mutex);
+        auto foreign_intent = [&](const string& key) {
+            auto it = intents.find(key);
+            return it != intents.end() && it->second.txn_id != txn_id;
+        };
+        
+        for (const auto& read : reads) {
+            auto it = data.find(read.first);
+            uint64_t version = (it != data.end() && it->second.isLive(now)) ? it->second.version : 0;
+            if (version != read.second || foreign_intent(read.first)) return false;
+        }
+        newest = 0;
+        for (const auto& change : writes) {
+            if (foreign_intent(change.first)) return false;
+            auto it = data.find(change.first);
+            if (it != data.end()) newest = max(newest, it->second.version);
+        }
+        return true;
+    }
+    
+    // Log encoded records, data and transaction state mixed, as one TXN
+    // record and apply them together. Caller holds the key locks involved
+    void logAndApplyRecords(const string& records) {
+        if (records.empty()) return;
+        uint64_t seq = 0;
+        if (wal) {
+            string txn;
+            txn.reserve(WalFormat::encodedSize(0, records.size()));
+            WalFormat::appendTransaction(txn, records);
+            seq = wal->append(move(txn));
+        }
+        
+        WalFormat::Record wrapper{WalFormat::TXN, 0, {}, records, 0};
+        vector<WalFormat::Record> changes;
+        WalFormat::decodeTransaction(wrapper, WalFormat::VERSION, changes);
+        {
+            unique_lock<shared_mutex> lock(data_mutex);
+            for (const auto& change : changes) {
+                if (change.type == WalFormat::PUT || change.type == WalFormat::PUT_TTL ||
+                    change.type == WalFormat::DEL) {
+                    applyLocked(string(change.key), VersionedValue{string(change.value), change.version,
+                                                                   change.type == WalFormat::DEL, change.expires_at});
+                } else {
+                    applyTxnStateLocked(change.type, change.version, change.key, change.value);
+                }
+            }
+        }
+        markApplied(seq);
+    }
+    
+    // Apply an INTENT, RESOLVE or TXN_STATUS change, live or replayed.
+    // Caller holds data_mutex exclusively (or is still recovering)
+    void applyTxnStateLocked(uint8_t type, uint64_t version, string_view key, string_view value) {
+        if (type == WalFormat::INTENT) {
+            WriteIntent intent;
+            if (decodeIntent(value, version, intent)) intents[string(key)] = move(intent);
+        } else if (type == WalFormat::RESOLVE) {
+            auto it = intents.find(string(key));
+            if (it != intents.end() && it->second.txn_id == version) intents.erase(it);
+        } else if (type == WalFormat::TXN_STATUS && !value.empty()) {
+            TxnRecord record;
+            if (value[0] == 0) {
+                txn_records.erase(version);
+            } else if (decodeTxnRecord(value, record)) {
+                // A decided transaction stays decided, even if an older
+                // record is replayed over a checkpoint that has the newer one
+                auto it = txn_records.find(version);
+                if (it == txn_records.end() || !isFinal(it->second.status)) {
+                    txn_records[version] = move(record);
+                }
+            }
+        }
+        intent_count = intents.size();
+    }
+    
+    static string encodeIntent(const WriteIntent& intent) {
+        string out(reinterpret_cast<const char*>(&intent.txn_id), 8);
+        out.push_back(intent.entry.deleted ? 1 : 0);
+        WalFormat::putU32(out, intent.anchor.size());
+        out += intent.anchor;
+        out += intent.entry.value;
+        return out;
+    }
+    
+    static bool decodeIntent(string_view in, uint64_t version, WriteIntent& intent) {
+        if (in.size() < 13) return false;
+        uint32_t anchor_length = WalFormat::getU32(in.data() + 9);
+        if (anchor_length > in.size() - 13) return false;
+        memcpy(&intent.txn_id, in.data(), 8);
+        intent.anchor.assign(in.substr(13, anchor_length));
+        intent.entry = VersionedValue{string(in.substr(13 + anchor_length)), version, in[8] != 0};
+        return true;
+    }
+    
+    // nullptr encodes "forget the record"
+    static string encodeTxnRecord(const TxnRecord* record) {
+        string out(1, record ? static_cast<char>(record->status) : 0);
+        if (record) {
+            for (const string& key : record->keys) {
+                WalFormat::putU32(out, key.size());
+                out += key;
+            }
+        }
+        return out;
+    }
+    
+    static bool decodeTxnRecord(string_view in, TxnRecord& record) {
+        record.status = static_cast<TxnStatus>(in[0]);
+        record.keys.clear();
+        for (size_t offset = 1; offset < in.size();) {
+            if (in.size() - offset < 4) return false;
+            uint32_t key_length = WalFormat::getU32(in.data() + offset);
+            if (key_length > in.size() - offset - 4) return false;
+            record.keys.emplace_back(in.substr(offset + 4, key_length));
+            offset += 4 + key_length;
+        }
+        return true;
+    }
+    
+    // Caller holds the key's lock
+    bool write(const string& key, const VersionedValue& entry, bool* was_live = nullptr) {
+        // Write to WAL first
+        uint64_t seq = 0;
+        if (wal) {
+            string record;
+            encodeEntry(record, key, entry);
+            seq = wal->append(move(record));
+        }
+        
+        // Then update in-memory data
+        bool applied;
+        {
+            unique_lock<shared_mutex> lock(data_mutex);
+            if (was_live) {
+                auto it = data.find(key);
+                *was_live = it != data.end() && it->second.isLive(HybridClock::wallMillis());
+            }
+            applied = applyLocked(key, entry);
+        }
+        markApplied(seq);
+        return applied;
+    }
+    
+    void encodeEntry(string& out, const string& key, const VersionedValue& entry) {
+        if (entry.deleted) {
+            WalFormat::appendRecord(out, WalFormat::DEL, entry.version, key);
+            logged_tombstone_bytes += WalFormat::encodedSize(key.size());
+        } else {
+            WalFormat::appendRecord(out, WalFormat::PUT, entry.version, key, entry.value, entry.expires_at);
+        }
+    }
+    
+    // Caller holds data_mutex exclusively
+    bool applyLocked(const string& key, const VersionedValue& entry) {
+        auto it = data.find(key);
+        if (it == data.end()) {
+            keepVersionLocked(key, nullptr);
+            data.emplace(key, entry);
+        } else if (entry.version < it->second.version) {
+            return false;
+        } else {
+            keepVersionLocked(key, &it->second);
+            it->second = entry;
+        }
+        if (entry.expires_at && !entry.deleted) {
+            scheduleExpiry(key, entry.expires_at);
+        }
+        return true;
+    }
+    
+    void scheduleExpiry(const string& key, uint64_t expires_at) {
+        lock_guard<mutex> lock(expiry_mutex);
+        expiry_wheel.schedule(key, expires_at);
+        if (!expiry_thread.joinable()) {
+            expiry_thread = thread([this]() { runExpiry(); });
+        }
+    }
+    
+    // Tick the wheel and turn keys that are past their deadline into
+    // tombstones, so an older copy elsewhere cannot return either. A key
+    // rewritten since it was scheduled carries a new deadline and stays.
+    // The tombstone is stamped at the deadline, not with the value's
+    // version, so a read at an earlier time still finds the value. Every
+    // replica stamps the same version, as they hold the same deadline
+    void runExpiry() {
+        unique_lock<mutex> lock(expiry_mutex);
+        while (!expiry_stopping) {
+            expiry_cv.wait_for(lock, chrono::milliseconds(TimerWheel::TICK_MS));
+            uint64_t now = HybridClock::wallMillis();
+            vector<string> due = expiry_wheel.advance(now);
+            if (due.empty()) continue;
+            
+            auto listener = expiry_listener;
+            lock.unlock();
+            vector<pair<string, uint64_t>> expired;
+            for (size_t start = 0; start < due.size(); start += APPLY_SLICE) {
+                unique_lock<shared_mutex> data_lock(data_mutex);
+                for (size_t i = start; i < min(due.size(), start + APPLY_SLICE); ++i) {
+                    auto it = data.find(due[i]);
+                    if (it == data.end() || it->second.deleted ||
+                        !it->second.expires_at || it->second.expires_at > now) continue;
+                    uint64_t version = max(HybridClock::fromMillis(it->second.expires_at), it->second.version + 1);
+                    keepVersionLocked(due[i], &it->second);
+                    it->second = VersionedValue{"", version, true, 0};
+                    expired.push_back({due[i], version});
+                }
+            }
+            if (listener) {
+                for (const auto& key : expired) listener(key.first, key.second);
+            }
+            lock.lock();
+        }
+    }
+    
+    // Erase tombstones older than the cutoff in short lock slices,
+    // rechecking each in case it was overwritten meanwhile
+    void purgeTombstones(uint64_t purge_before) {
+        vector<string> expired;
+        {
+            shared_lock<shared_mutex> lock(data_mutex);
+            for (const auto& pair : data) {
+                if (pair.second.deleted && pair.second.version < purge_before) {
+                    expired.push_back(pair.first);
+                }
+            }
+        }
+        
+        for (size_t start = 0; start < expired.size(); start += APPLY_SLICE) {
+            unique_lock<shared_mutex> lock(data_mutex);
+            for (size_t i = start; i < min(expired.size(), start + APPLY_SLICE); ++i) {
+                auto it = data.find(expired[i]);
+                if (it != data.end() && it->second.deleted && it->second.version < purge_before) {
+                    data.erase(it);
+                }
+            }
+        }
+    }
+    
+    // Before key changes: keep the outgoing entry (nullptr = the key did
+    // not exist) if an open snapshot or the retention window may want it.
+    // It became current at the previous kept version's replacement (or
+    // earlier), so only a snapshot at least that new can see it. With a
+    // retention window, versions that left it go from the front here, so
+    // busy keys stay trimmed between collections. Caller holds data_mutex
+    // exclusively
+    void keepVersionLocked(const string& key, VersionedValue* outgoing) {
+        bool retaining = version_retention_ms > 0;
+        if (open_snapshots.empty() && !retaining) return;
+        ++change_seq;
+        auto old = history.find(key);
+        uint64_t since = (old != history.end() && !old->second.empty()) ? old->second.back().replaced : 0;
+        if (!retaining && *open_snapshots.rbegin() < since) return;
+        
+        if (old == history.end()) old = history.try_emplace(key).first;
+        deque<OldVersion>& versions = old->second;
+        versions.push_back(OldVersion{outgoing ? move(*outgoing) : VersionedValue{"", 0, true}, change_seq});
+        ++history_versions;
+        
+        if (retaining) {
+            uint64_t now = HybridClock::wallMillis();
+            uint64_t cutoff = HybridClock::fromMillis(now - min<long long>(now, version_retention_ms));
+            while (versions.size() > 1 && versions[1].entry.version <= cutoff &&
+                   (open_snapshots.empty() || *open_snapshots.begin() >= versions[0].replaced)) {
+                versions.pop_front();
+                --history_versions;
+            }
+        }
+    }
+    
+    // The earliest HLC time get(key, at_timestamp) answers for every key
+    uint64_t retainedSince() const {
+        long long retention = version_retention_ms;
+        if (retention <= 0) return UINT64_MAX;
+        uint64_t now = HybridClock::wallMillis();
+        return max(retained_from.load(), HybridClock::fromMillis(now - min<long long>(now, retention)));
+    }
+    
+    // The entry a snapshot taken at change seq sees: the first version
+    // replaced after it, or else the current one. Caller holds data_mutex
+    bool visibleLocked(const string& key, uint64_t seq, VersionedValue& entry) {
+        auto old = history.find(key);
+        if (old != history.end()) {
+            for (const OldVersion& version : old->second) {
+                if (version.replaced <= seq) continue;
+                if (!version.entry.version) return false;
+                entry = version.entry;
+                return true;
+            }
+        }
+        auto it = data.find(key);
+        if (it == data.end()) return false;
+        entry = it->second;
+        return true;
+    }
+    
+    void releaseSnapshot(uint64_t seq) {
+        {
+            unique_lock<shared_mutex> lock(data_mutex);
+            open_snapshots.erase(open_snapshots.find(seq));
+        }
+        if (history_versions) collectVersions();
+    }
+    
+    // Drop kept versions nobody can see any more: those current only
+    // between open snapshots, and those replaced before the retention
+    // window. In short lock slices, like purgeTombstones; a caller that
+    // finds a collection running leaves the work to it
+    void collectVersions() {
+        bool expected = false;
+        if (!collecting.compare_exchange_strong(expected, true)) return;
+        uint64_t now = HybridClock::wallMillis();
+        uint64_t cutoff = HybridClock::fromMillis(now - min<long long>(now, version_retention_ms));
+        
+        vector<string> keys;
+        {
+            shared_lock<shared_mutex> lock(data_mutex);
+            keys.reserve(history.size());
+            for (const auto& pair : history) {
+                keys.push_back(pair.first);
+            }
+        }
+        for (size_t start = 0; start < keys.size(); start += APPLY_SLICE) {
+            unique_lock<shared_mutex> lock(data_mutex);
+            for (size_t i = start; i < min(keys.size(), start + APPLY_SLICE); ++i) {
+                auto old = history.find(keys[i]);
+                if (old == history.end()) continue;
+                pruneVersionsLocked(old->first, old->second, cutoff);
+                if (old->second.empty()) history.erase(old);
+            }
+        }
+        collecting = false;
+    }
+    
+    // A version is visible to snapshots taken from its predecessor's
+    // replacement up to its own, and to reads at times from its version up
+    // to its successor's. Caller holds data_mutex exclusively
+    void pruneVersionsLocked(const string& key, deque<OldVersion>& versions, uint64_t cutoff) {
+        auto current = data.find(key);
+        uint64_t since = 0;
+        size_t kept = 0;
+        for (size_t i = 0; i < versions.size(); ++i) {
+            uint64_t successor = (i + 1 < versions.size()) ? versions[i + 1].entry.version
+                               : (current != data.end() ? current->second.version : 0);
+            auto open = open_snapshots.lower_bound(since);
+            bool needed = (open != open_snapshots.end() && *open < versions[i].replaced) ||
+                          (version_retention_ms > 0 && successor > cutoff);
+            since = versions[i].replaced;
+            if (!needed) continue;
+            if (kept != i) versions[kept] = move(versions[i]);
+            ++kept;
+        }
+        history_versions -= versions.size() - kept;
+        versions.resize(kept);
+    }
+    
+    static size_t tombstoneMemory(const string& key) {
+        // Hash node with its next pointer and cached hash, plus the key's
+        // heap buffer when it is too long for the small-string buffer
+        size_t heap = (key.capacity() > 15) ? key.capacity() + 1 : 0;
+        return sizeof(pair<const string, VersionedValue>) + 2 * sizeof(void*) + heap;
+    }
+    
+    void markApplied(uint64_t seq) {
+        if (!wal) return;
+        if (wal->markApplied(seq) >= CHECKPOINT_AFTER_SEGMENTS) {
+            startCheckpoint();
+        }
+    }
+    
+    void startCheckpoint() {
+        bool expected = false;
+        if (!checkpoint_running.compare_exchange_strong(expected, true)) return;
+        
+        lock_guard<mutex> lock(checkpoint_thread_mutex);
+        if (checkpoint_thread.joinable()) checkpoint_thread.join();
+        checkpoint_thread = thread([this]() {
+            try {
+                checkpoint();
+            } catch (const exception& e) {
+                cerr << "Checkpoint of " << wal_path << " failed: " << e.what() << endl;
+            }
+            checkpoint_running = false;
+        });
+    }
+    
+    // Checkpoint file, written to a temporary file and renamed into place:
+    //   "KVCHKPT2" | u64 seq | u64 count | entry* | u32 crc of all before
+    // where entry = u32 key length | u32 value length | u64 version |
+    //   u8 flags | key | value
+    // and flags are
+    //   1  tombstone
+    //   2  the value starts with a u64 expiry
+    //   4  a write intent, the value as in an INTENT record
+    //   8  a transaction record: key empty, version = id, value as in
+    //      TXN_STATUS
+    void writeCheckpoint(const unordered_map<string, VersionedValue>& snapshot,
+                         const unordered_map<string, WriteIntent>& intent_snapshot,
+                         const unordered_map<uint64_t, TxnRecord>& record_snapshot,
+                         uint64_t seq, uint64_t purge_before) {
+        string final_path = wal_path + ".checkpoint";
+        string temp_path = final_path + ".tmp";
+        int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw runtime_error("Cannot create checkpoint " + temp_path + ": " + strerror(errno));
+        }
+        
+        uint32_t crc = 0;
+        string buffer("KVCHKPT2", 8);
+        uint64_t count = intent_snapshot.size() + record_snapshot.size();
+        for (const auto& pair : snapshot) {
+            if (!pair.second.deleted || pair.second.version >= purge_before) ++count;
+        }
+        buffer.append(reinterpret_cast<const char*>(&seq), 8);
+        buffer.append(reinterpret_cast<const char*>(&count), 8);
+        
+        auto flush = [&](bool checksum) {
+            if (checksum) crc = crc32(buffer.data(), buffer.size(), crc);
+            for (size_t done = 0; done < buffer.size();) {
+                ssize_t written = ::write(fd, buffer.data() + done, buffer.size() - done);
+                if (written < 0 && errno == EINTR) continue;
+                if (written < 0) {
+                    int error = errno;
+                    close(fd);
+                    throw runtime_error("Checkpoint write failed: " + string(strerror(error)));
+                }
+                done += written;
+            }
+            buffer.clear();
+        };
+        
+        size_t tombstone_bytes = 0;
+        for (const auto& pair : snapshot) {
+            const VersionedValue& entry = pair.second;
+            if (entry.deleted) {
+                if (entry.version < purge_before) continue;
+                tombstone_bytes += 17 + pair.first.size();
+            }
+            bool expires = entry.expires_at && !entry.deleted;
+            WalFormat::putU32(buffer, pair.first.size());
+            WalFormat::putU32(buffer, entry.value.size() + (expires ? 8 : 0));
+            buffer.append(reinterpret_cast<const char*>(&entry.version), 8);
+            buffer.push_back((entry.deleted ? 1 : 0) | (expires ? 2 : 0));
+            buffer += pair.first;
+            if (expires) buffer.append(reinterpret_cast<const char*>(&entry.expires_at), 8);
+            buffer += entry.value;
+            if (buffer.size() >= (1 << 20)) flush(true);
+        }
+        
+        auto append_state = [&](uint64_t version, uint8_t flags, const string& key, const string& value) {
+            WalFormat::putU32(buffer, key.size());
+            WalFormat::putU32(buffer, value.size());
+            buffer.append(reinterpret_cast<const char*>(&version), 8);
+            buffer.push_back(flags);
+            buffer += key;
+            buffer += value;
+        };
+        for (const auto& pair : intent_snapshot) {
+            append_state(pair.second.txn_id, 4, pair.first, encodeIntent(pair.second));
+        }
+        for (const auto& pair : record_snapshot) {
+            append_state(pair.first, 8, "", encodeTxnRecord(&pair.second));
+        }
+        flush(true);
+        WalFormat::putU32(buffer, crc);
+        flush(false);
+        
+        bool synced = fsync(fd) == 0;
+        close(fd);
+        if (!synced || rename(temp_path.c_str(), final_path.c_str()) != 0) {
+            throw runtime_error("Cannot install checkpoint " + final_path + ": " + strerror(errno));
+        }
+        syncParentDirectory(final_path);
+        checkpoint_tombstone_bytes = tombstone_bytes;
+    }
+    
+    // Rebuild data from the checkpoint, the pre-segment text log (only when
+    // there is no checkpoint yet) and the segment chain. Records are spread
+    // over shards by key hash so each key is applied by one worker, in log
+    // order; shards are merged into data at the end
+    WalRecovery loadFromWAL(unsigned replay_threads, bool& replayed_legacy) {
+        auto segments = WriteAheadLog::listSegments(wal_path);
+        size_t total_size = fileSize(wal_path) + fileSize(wal_path + ".checkpoint");
+        for (const auto& segment : segments) total_size += fileSize(segment.second);
+        
+        unsigned workers = replay_threads ? replay_threads : defaultReplayThreads(total_size);
+        vector<Shard> shards(workers);
+        
+        uint64_t checkpoint_seq = 0;
+        bool has_checkpoint = loadCheckpoint(shards, checkpoint_seq);
+        replayed_legacy = !has_checkpoint && replayLegacyLog(shards);
+        WalRecovery recovery = replaySegments(segments, checkpoint_seq, shards);
+        
+        // Shards hold disjoint keys, so merging only relinks nodes. New
+        // writes must be stamped after everything replayed
+        size_t total = 0;
+        uint64_t max_version = 0;
+        for (const auto& shard : shards) {
+            total += shard.size();
+            for (const auto& pair : shard) max_version = max(max_version, pair.second.version);
+        }
+        HybridClock::shared().observe(max_version);
+        data.reserve(total);
+        for (auto& shard : shards) {
+            data.merge(shard);
+        }
+        return recovery;
+    }
+    
+    bool loadCheckpoint(vector<Shard>& shards, uint64_t& seq) {
+        string path = wal_path + ".checkpoint";
+        MappedFile file(path);
+        string_view image = file.view();
+        if (image.empty()) return false;
+        
+        // KVCHKPT1 checkpoints predate versions and tombstones
+        bool versioned = image.substr(0, 8) == "KVCHKPT2";
+        if (image.size() < 28 || (!versioned && image.substr(0, 8) != "KVCHKPT1") ||
+            WalFormat::getU32(image.data() + image.size() - 4) != crc32(image.data(), image.size() - 4)) {
+            throw runtime_error("Corrupt checkpoint " + path);
+        }
+        uint64_t count;
+        memcpy(&seq, image.data() + 8, 8);
+        memcpy(&count, image.data() + 16, 8);
+        
+        // Entries are located in one pass, then hashed and copied in parallel
+        vector<WalRecord> entries;
+        entries.reserve(count);
+        size_t entry_header = versioned ? 17 : 8;
+        size_t offset = 24, end = image.size() - 4;
+        size_t tombstone_bytes = 0;
+        while (offset + entry_header <= end) {
+            uint32_t key_length = WalFormat::getU32(image.data() + offset);
+            uint32_t value_length = WalFormat::getU32(image.data() + offset + 4);
+            if (end - offset - entry_header < (size_t)key_length + value_length) break;
+            
+            WalRecord entry{'P', image.substr(offset + entry_header, key_length),
+                            image.substr(offset + entry_header + key_length, value_length), 0, 0, 0};
+            if (versioned) {
+                uint8_t flags = image[offset + 16];
+                memcpy(&entry.version, image.data() + offset + 8, 8);
+                if (flags & (4 | 8)) {
+                    applyTxnStateLocked((flags & 4) ? WalFormat::INTENT : WalFormat::TXN_STATUS,
+                                        entry.version, entry.key, entry.value);
+                    offset += entry_header + key_length + value_length;
+                    continue;
+                }
+                if (flags & 1) {
+                    entry.op = 'D';
+                    tombstone_bytes += entry_header + key_length;
+                }
+                if ((flags & 2) && entry.value.size() >= 8) {
+                    memcpy(&entry.expires_at, entry.value.data(), 8);
+                    entry.value.remove_prefix(8);
+                }
+            }
+            entries.push_back(entry);
+            offset += entry_header + key_length + value_length;
+        }
+        checkpoint_tombstone_bytes = tombstone_bytes;
+        
+        size_t workers = shards.size();
+        replaySlices(shards, [&](size_t w, const Emit& emit) {
+            for (size_t i = entries.size() * w / workers; i < entries.size() * (w + 1) / workers; ++i) {
+                emit(entries[i]);
+            }
+        });
+        return true;
+    }
+    
+    // The single-file text log written before segments existed
+    bool replayLegacyLog(vector<Shard>& shards) {
+        MappedFile wal_file(wal_path);
+        string_view log = wal_file.view();
+        
+        // A preallocated log ends in zeros, and a crash can leave a torn
+        // final line; both are dropped
+        size_t last = log.find_last_not_of('\0');
+        log = log.substr(0, last == string_view::npos ? 0 : log.rfind('\n', last) + 1);
+        if (log.empty()) return false;
+        
+        size_t offset = 0;
+        wal_file.prefetch(0, WAL_REPLAY_WINDOW);
+        while (offset < log.size()) {
+            // Extend the window to the end of its last line
+            size_t window_end = log.size();
+            if (log.size() - offset > WAL_REPLAY_WINDOW) {
+                size_t newline = log.find('\n', offset + WAL_REPLAY_WINDOW);
+                if (newline != string_view::npos) window_end = newline + 1;
+            }
+            
+            // Overlap reading the next window with parsing this one
+            wal_file.prefetch(window_end, WAL_REPLAY_WINDOW);
+            replayTextWindow(log.substr(offset, window_end - offset), shards);
+            offset = window_end;
+        }
+        return true;
+    }
+    
+    void replayTextWindow(string_view window, vector<Shard>& shards) {
+        size_t workers = shards.size();
+        
+        // Cut the window into one slice per worker at line boundaries
+        vector<string_view> slices;
+        size_t slice_start = 0;
+        for (size_t i = 0; i < workers; ++i) {
+            size_t slice_end = window.size();
+            if (i + 1 < workers) {
+                size_t target = max(slice_start, window.size() * (i + 1) / workers);
+                size_t newline = window.find('\n', target);
+                if (newline != string_view::npos) slice_end = newline + 1;
+            }
+            slices.push_back(window.substr(slice_start, slice_end - slice_start));
+            slice_start = slice_end;
+        }
+        
+        replaySlices(shards, [&](size_t w, const Emit& emit) {
+            string_view slice = slices[w];
+            WalRecord record{};
+            while (!slice.empty()) {
+                size_t newline = slice.find('\n');
+                string_view line = slice.substr(0, newline);
+                slice = (newline == string_view::npos) ? string_view() : slice.substr(newline + 1);
+                
+                if (parseWalLine(line, record)) emit(record);
+            }
+        });
+    }
+    
+    // Replay segments in number order while they form a gap-free chain that
+    // starts at or before the checkpoint. Files that are not part of it are
+    // handed back as spares
+    WalRecovery replaySegments(const vector<pair<uint64_t, string>>& segments,
+                               uint64_t checkpoint_seq, vector<Shard>& shards) {
+        WalRecovery recovery;
+        recovery.next_seq = checkpoint_seq + 1;
+        bool chain_started = false, chain_open = true;
+        uint64_t expected = 0;
+        
+        for (const auto& segment : segments) {
+            uint64_t number = segment.first;
+            recovery.max_number = max(recovery.max_number, number);
+            
+            MappedFile file(segment.second);
+            string_view log = file.view();
+            WalFormat::SegmentHeader header;
+            bool valid = WalFormat::decodeHeader(log, header) && header.segment == number;
+            bool continues = valid && chain_open &&
+                (chain_started ? header.start_seq == expected : header.start_seq <= checkpoint_seq + 1);
+            if (!continues) {
+                if (valid && chain_started) chain_open = false;
+                recovery.spares.push_back({number, valid});
+                continue;
+            }
+            
+            // Walk the frame headers while sequence numbers run on
+            vector<size_t> frames;
+            size_t offset = WalFormat::HEADER_SIZE;
+            uint32_t body_length;
+            uint64_t seq;
+            while (WalFormat::peekFrame(log, offset, body_length, seq) &&
+                   seq == header.start_seq + frames.size()) {
+                frames.push_back(offset);
+                offset += WalFormat::FRAME_HEADER + body_length;
+            }
+            
+            // Verify and decode in parallel; the first CRC failure ends the
+            // segment there, and the next one must start right after it
+            size_t workers = shards.size();
+            atomic<size_t> first_bad{frames.size()};
+            atomic<size_t> tombstone_bytes{0};
+            // Transaction state is kept aside per worker and applied after,
+            // in log order
+            vector<vector<WalRecord>> txn_state(workers);
+            replaySlices(shards, [&](size_t w, const Emit& emit) {
+                WalFormat::Record record;
+                vector<WalFormat::Record> nested;
+                size_t slice_tombstone_bytes = 0;
+                for (size_t i = frames.size() * w / workers; i < frames.size() * (w + 1) / workers; ++i) {
+                    bool valid = WalFormat::decodeFrame(log, frames[i], header.version, record);
+                    if (valid && record.type == WalFormat::TXN) {
+                        valid = WalFormat::decodeTransaction(record, header.version, nested);
+                    } else {
+                        nested.assign(1, record);
+                    }
+                    if (!valid) {
+                        size_t bad = first_bad;
+                        while (i < bad && !first_bad.compare_exchange_weak(bad, i)) {}
+                        break;
+                    }
+                    uint64_t record_seq = header.start_seq + i;
+                    if (record_seq <= checkpoint_seq) continue;
+                    
+                    for (const auto& change : nested) {
+                        if (change.type >= WalFormat::INTENT) {
+                            txn_state[w].push_back({static_cast<char>(change.type), change.key, change.value,
+                                                    record_seq, change.version, 0});
+                            continue;
+                        }
+                        char op = (change.type == WalFormat::DEL) ? 'D' : (change.type == WalFormat::DROP) ? 'X' : 'P';
+                        if (op == 'D') slice_tombstone_bytes += WalFormat::encodedSize(change.key.size());
+                        emit({op, change.key, change.value, record_seq, change.version, change.expires_at});
+                    }
+                }
+                tombstone_bytes += slice_tombstone_bytes;
+            }, [&]() { return header.start_seq + first_bad; });
+            logged_tombstone_bytes += tombstone_bytes;
+            for (const auto& slice : txn_state) {
+                for (const auto& change : slice) {
+                    if (change.seq >= header.start_seq + first_bad) break;
+                    applyTxnStateLocked(change.op, change.version, change.key, change.value);
+                }
+            }
+            
+            expected = header.start_seq + first_bad;
+            recovery.segments.push_back({number, header.start_seq});
+            recovery.next_seq = max(expected, checkpoint_seq + 1);
+            chain_started = true;
+        }
+        
+        // Spares get reused in number order, so any below a live segment
+        // must move above it
+        for (auto& spare : recovery.spares) {
+            if (!recovery.segments.empty() && spare.number < recovery.segments.back().first) {
+                spare.needs_rename = true;
+            }
+        }
+        return recovery;
+    }
+    
+    // Phase 1 runs parse_slice(w, emit) on every worker; emitted records
+    // are bucketed by key hash. Phase 2 applies each bucket's records, in
+    // slice order, on its own worker. Records at or past stop_seq() are
+    // dropped, for logs found torn during phase 1
+    void replaySlices(vector<Shard>& shards, const function<void(size_t, const Emit&)>& parse_slice,
+                      const function<uint64_t()>& stop_seq = nullptr) {
+        size_t workers = shards.size();
+        vector<vector<vector<WalRecord>>> buckets(workers, vector<vector<WalRecord>>(workers));
+        
+        runOnWorkers(workers, [&](size_t w) {
+            auto& own = buckets[w];
+            parse_slice(w, [&](const WalRecord& record) {
+                own[hash<string_view>{}(record.key) % workers].push_back(record);
+            });
+        });
+        
+        uint64_t stop = stop_seq ? stop_seq() : UINT64_MAX;
+        runOnWorkers(workers, [&](size_t s) {
+            auto& shard = shards[s];
+            for (size_t w = 0; w < workers; ++w) {
+                for (const auto& record : buckets[w][s]) {
+                    if (record.seq >= stop) continue;
+                    string key(record.key);
+                    if (record.op == 'X') {
+                        shard.erase(key);
+                        continue;
+                    }
+                    
+                    // Same last-writer-wins rule as live writes
+                    auto it = shard.try_emplace(move(key)).first;
+                    VersionedValue& entry = it->second;
+                    if (record.version < entry.version) continue;
+                    entry.value = string(record.value);
+                    entry.version = record.version;
+                    entry.deleted = record.op == 'D';
+                    entry.expires_at = entry.deleted ? 0 : record.expires_at;
+                }
+            }
+        });
+    }
+    
+    // Parse "PUT <key> <value>" or "DEL <key>"; unknown ops are skipped
+    static bool parseWalLine(string_view line, WalRecord& record) {
+        auto is_space = [](char c) { return c == ' ' || (c >= '\t' && c <= '\r'); };
+        auto next_token = [&](string_view& rest) {
+            size_t begin = 0;
+            while (begin < rest.size() && is_space(rest[begin])) ++begin;
+            size_t end = begin;
+            while (end < rest.size() && !is_space(rest[end])) ++end;
+            string_view token = rest.substr(begin, end - begin);
+            rest.remove_prefix(end);
+            return token;
+        };
+        
+        string_view rest = line;
+        string_view op = next_token(rest);
+        string_view key = next_token(rest);
+        
+        if (op == "PUT") {
+            if (!rest.empty() && rest[0] == ' ') {
+                rest.remove_prefix(1);
+            }
+            record.op = 'P';
+            record.value = rest;
+        } else if (op == "DEL") {
+            record.op = 'D';
+            record.value = string_view();
+        } else {
+            return false;
+        }
+        record.key = key;
+        return true;
+    }
+    
+    static size_t fileSize(const string& path) {
+        struct stat st;
+        return (stat(path.c_str(), &st) == 0) ? st.st_size : 0;
+    }
+    
+    static unsigned defaultReplayThreads(size_t wal_size) {
+        if (wal_size < WAL_PARALLEL_REPLAY_MIN) return 1;
+        return max(1u, thread::hardware_concurrency());
+    }
+    
+    // Run task(0..count-1), one per thread, with the caller taking index 0
+    static void runOnWorkers(size_t count, const function<void(size_t)>& task) {
+        vector<thread> threads;
+        for (size_t i = 1; i < count; ++i) {
+            threads.emplace_back(task, i);
+        }
+        task(0);
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+};
+
+// Coordinator-side cache of recently read entries, in LRU shards. A write
+// empties the key's slot and gives it a new generation; a read that missed
+// is handed the slot's generation as a ticket and fills the slot only if
+// the ticket is still current, so a value read before a write is never
+// kept after it
+class NearCache {
+public:
+    static constexpr size_t SHARDS = 16;
+    
+    // 0 turns the cache off
+    void resize(size_t capacity) {
+        for (auto& shard : shards) {
+            lock_guard<mutex> lock(shard.shard_mutex);
+            shard.capacity = (capacity + SHARDS - 1) / SHARDS;
+            shard.slots.clear();
+            shard.order.clear();
+        }
+        enabled = capacity > 0;
+    }
+    
+    void clear() {
+        for (auto& shard : shards) {
+            lock_guard<mutex> lock(shard.shard_mutex);
+            shard.slots.clear();
+            shard.order.clear();
+        }
+    }
+    
+    // A cached entry, or else the ticket to fill with; 0 when the cache is off
+    bool get(const string& key, VersionedValue& entry, uint64_t& ticket) {
+        ticket = 0;
+        if (!enabled) return false;
+        Shard& shard = shardFor(key);
+        lock_guard<mutex> lock(shard.shard_mutex);
+        if (shard.capacity == 0) return false;
+        
+        auto it = shard.slots.find(key);
+        if (it != shard.slots.end()) {
+            shard.order.splice(shard.order.begin(), shard.order, it->second.position);
+            if (it->second.filled) {
+                entry = it->second.entry;
+                hit_count.fetch_add(1, memory_order_relaxed);
+                return true;
+            }
+        } else {
+            if (shard.slots.size() >= shard.capacity) {
+                shard.slots.erase(shard.order.back());
+                shard.order.pop_back();
+            }
+            shard.order.push_front(key);
+            it = shard.slots.emplace(key, Slot{VersionedValue(), false, ++shard.generation,
+                                               shard.order.begin()}).first;
+        }
+        miss_count.fetch_add(1, memory_order_relaxed);
+        ticket = it->second.generation;
+        return false;
+    }
+    
+    void fill(const string& key, const VersionedValue& entry, uint64_t ticket) {
+        if (ticket == 0) return;
+        Shard& shard = shardFor(key);
+        lock_guard<mutex> lock(shard.shard_mutex);
+        auto it = shard.slots.find(key);
+        if (it != shard.slots.end() && it->second.generation == ticket) {
+            it->second.entry = entry;
+            it->second.filled = true;
+        }
+    }
+    
+    void invalidate(const string& key) {
+        if (!enabled) return;
+        Shard& shard = shardFor(key);
+        lock_guard<mutex> lock(shard.shard_mutex);
+        auto it = shard.slots.find(key);
+        if (it != shard.slots.end()) {
+            it->second.entry = VersionedValue();
+            it->second.filled = false;
+            it->second.generation = ++shard.generation;
+        }
+    }
+    
+    bool isEnabled() const { return enabled; }
+    uint64_t hits() const { return hit_count; }
+    uint64_t misses() const { return miss_count; }
+    
+private:
+    struct Slot {
+        VersionedValue entry;
+        bool filled;
+        uint64_t generation;
+        list<string>::iterator position;
+    };
+    
+    struct Shard {
+        mutex shard_mutex;
+        unordered_map<string, Slot> slots;
+        list<string> order;   // Most recently used first
+        size_t capacity = 0;
+        uint64_t generation = 0;
+    };
+    
+    array<Shard, SHARDS> shards;
+    atomic<bool> enabled{false};
+    atomic<uint64_t> hit_count{0};
+    atomic<uint64_t> miss_count{0};
+    
+    Shard& shardFor(const string& key) {
+        return shards[hash<string>()(key) % SHARDS];
+    }
+};
+
+// Coordinator-side set of keys recently read as missing, in LRU shards.
+// Each shard counts the writes to its keys, and a read that finds its key
+// missing records it only if no write reached the shard since the read
+// began, so a key written meanwhile is never remembered as missing
+class NegativeCache {
+public:
+    static constexpr size_t SHARDS = 64;
+    static constexpr size_t DEFAULT_CAPACITY = 8192;
+    
+    // 0 turns the cache off
+    void resize(size_t capacity) {
+        for (auto& shard : shards) {
+            lock_guard<mutex> lock(shard.shard_mutex);
+            shard.capacity = (capacity + SHARDS - 1) / SHARDS;
+            shard.keys.clear();
+            shard.order.clear();
+        }
+        enabled = capacity > 0;
+    }
+    
+    void clear() {
+        for (auto& shard : shards) {
+            lock_guard<mutex> lock(shard.shard_mutex);
+            shard.keys.clear();
+            shard.order.clear();
+        }
+    }
+    
+    // Whether key is known to be missing; otherwise the ticket to insert
+    // with, 0 when the cache is off
+    bool contains(const string& key, uint64_t& ticket) {
+        ticket = 0;
+        if (!enabled) return false;
+        Shard& shard = shardFor(key);
+        lock_guard<mutex> lock(shard.shard_mutex);
+        auto it = shard.keys.find(key);
+        if (it != shard.keys.end()) {
+            shard.order.splice(shard.order.begin(), shard.order, it->second);
+            hit_count.fetch_add(1, memory_order_relaxed);
+            return true;
+        }
+        ticket = shard.writes;
+        return false;
+    }
+    
+    void insert(const string& key, uint64_t ticket) {
+        if (ticket == 0) return;
+        Shard& shard = shardFor(key);
+        lock_guard<mutex> lock(shard.shard_mutex);
+        if (ticket != shard.writes || shard.capacity == 0 || shard.keys.count(key)) return;
+        if (shard.keys.size() >= shard.capacity) {
+            shard.keys.erase(shard.order.back());
+            shard.order.pop_back();
+        }
+        shard.order.push_front(key);
+        shard.keys.emplace(key, shard.order.begin());
+    }
+    
+    void invalidate(const string& key) {
+        if (!enabled) return;
+        Shard& shard = shardFor(key);
+        lock_guard<mutex> lock(shard.shard_mutex);
+        ++shard.writes;
+        auto it = shard.keys.find(key);
+        if (it != shard.keys.end()) {
+            shard.order.erase(it->second);
+            shard.keys.erase(it);
+        }
+    }
+    
+    bool isEnabled() const { return enabled; }
+    uint64_t hits() const { return hit_count; }
+    
+private:
+    struct Shard {
+        mutex shard_mutex;
+        unordered_map<string, list<string>::iterator> keys;
+        list<string> order;   // Most recently used first
+        size_t capacity = 0;
+        uint64_t writes = 1;
+    };
+    
+    array<Shard, SHARDS> shards;
+    atomic<bool> enabled{false};
+    atomic<uint64_t> hit_count{0};
+    
+    Shard& shardFor(const string& key) {
+        return shards[hash<string>()(key) % SHARDS];
+    }
+};
+
+// Approximate most-read keys of one node: space-saving counters over a
+// sample of reads. A key that no longer fits takes over the least count,
+// which is remembered as its possible overestimate
+class HotKeyTracker {
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 256;
+    static constexpr uint32_t SAMPLE_EVERY = 8;        // Reads per sampled read
+    static constexpr double HOT_SHARE = 0.01;          // Of sampled reads
+    static constexpr uint64_t HOT_MIN_SAMPLES = 32;
+    
+    explicit HotKeyTracker(size_t capacity = DEFAULT_CAPACITY) : capacity(max<size_t>(1, capacity)) {}
+    
+    void record(const string& key) {
+        thread_local uint32_t reads = 0;
+        if (++reads % SAMPLE_EVERY != 0) return;
+        
+        lock_guard<mutex> lock(tracker_mutex);
+        ++sampled;
+        auto it = counts.find(key);
+        if (it != counts.end()) {
+            ranked.erase({it->second.count, key});
+        } else if (counts.size() < capacity) {
+            it = counts.emplace(key, Counter{0, 0}).first;
+        } else {
+            auto least = ranked.begin();
+            uint64_t floor = least->first;
+            counts.erase(least->second);
+            ranked.erase(least);
+            it = counts.emplace(key, Counter{floor, floor}).first;
+        }
+        ranked.emplace(++it->second.count, key);
+    }
+    
+    // Keys surely read at least HOT_SHARE of the recent sampled reads, most
+    // read first. Counts are halved on each call so keys that cool off fade
+    vector<string> hotKeys() {
+        lock_guard<mutex> lock(tracker_mutex);
+        vector<string> hot;
+        uint64_t threshold = max<uint64_t>(HOT_MIN_SAMPLES, sampled * HOT_SHARE);
+        for (auto it = ranked.rbegin(); it != ranked.rend() && it->first >= threshold; ++it) {
+            const Counter& counter = counts.at(it->second);
+            if (counter.count - counter.error >= threshold) hot.push_back(it->second);
+        }
+        
+        ranked.clear();
+        for (auto it = counts.begin(); it != counts.end();) {
+            it->second.count /= 2;
+            it->second.error /= 2;
+            if (it->second.count == 0) {
+                it = counts.erase(it);
+                continue;
+            }
+            ranked.emplace(it->second.count, it->first);
+            ++it;
+        }
+        sampled /= 2;
+        return hot;
+    }
+    
+private:
+    struct Counter {
+        uint64_t count;
+        uint64_t error;   // Inherited from the key it displaced
+    };
+    
+    size_t capacity;
+    mutex tracker_mutex;
+    unordered_map<string, Counter> counts;
+    set<pair<uint64_t, string>> ranked;   // (count, key), least first
+    uint64_t sampled = 0;
+};
+
+// A subscription to the writes of keys under a prefix, filled by the nodes
+// it is registered on. Pending changes wait in a ring of fixed capacity. A
+// key already pending is updated in place, so a burst of writes to one key
+// takes one slot; when the ring is full the oldest change is dropped and
+// counted. Every replica reports a write, with the same version, and it is
+// delivered once
+class Watch {
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 1024;
+    
+    struct Change {
+        string key;
+        SharedValue value;
+        uint64_t version;   // 0 for a write stamped locally
+        bool deleted;       // Deleted or expired
+    };
+    
+    Watch(const string& prefix, size_t capacity = DEFAULT_CAPACITY)
+        : key_prefix(prefix), ring(max<size_t>(1, capacity)) {}
+    
+    const string& prefix() const { return key_prefix; }
+    
+    bool matches(const string& key) const {
+        return key.compare(0, key_prefix.size(), key_prefix) == 0;
+    }
+    
+    // Add changes, oldest first, under one lock. Pollers only wait on an
+    // empty ring, so they are woken only when it stops being empty
+    void publish(const vector<Change>& changes) {
+        bool was_empty;
+        {
+            lock_guard<mutex> lock(watch_mutex);
+            was_empty = count == 0;
+            for (const Change& change : changes) {
+                if (change.version && !firstReport(change)) continue;
+                
+                auto slot = pending.find(change.key);
+                if (slot != pending.end()) {
+                    ring[slot->second] = change;
+                    continue;
+                }
+                if (count == ring.size()) {
+                    pending.erase(ring[head].key);
+                    head = (head + 1) % ring.size();
+                    --count;
+                    ++dropped_changes;
+                }
+                size_t index = (head + count) % ring.size();
+                ring[index] = change;
+                pending[change.key] = index;
+                ++count;
+            }
+            if (count == 0) return;
+        }
+        if (was_empty) changed.notify_all();
+    }
+    
+    // Take up to max_changes pending changes, oldest first, waiting up to
+    // wait for one to arrive
+    vector<Change> poll(size_t max_changes, chrono::milliseconds wait = chrono::milliseconds(0)) {
+        unique_lock<mutex> lock(watch_mutex);
+        changed.wait_for(lock, wait, [this]() { return count > 0; });
+        vector<Change> taken;
+        while (count > 0 && taken.size() < max_changes) {
+            pending.erase(ring[head].key);
+            taken.push_back(move(ring[head]));
+            head = (head + 1) % ring.size();
+            --count;
+        }
+        return taken;
+    }
+    
+    // Changes lost to a full ring
+    size_t dropped() {
+        lock_guard<mutex> lock(watch_mutex);
+        return dropped_changes;
+    }
+    
+private:
+    string key_prefix;
+    mutex watch_mutex;
+    condition_variable changed;
+    vector<Change> ring;
+    size_t head = 0;
+    size_t count = 0;
+    unordered_map<string, size_t> pending;   // Key -> ring slot
+    size_t dropped_changes = 0;
+    
+    // Newest version reported for the last ring-capacity keys, so copies
+    // of one write from other replicas are recognized. An expiry carries a
+    // version above the write it ends, stamped at its deadline; at equal
+    // versions deleted still ranks above live
+    unordered_map<string, pair<uint64_t, bool>> reported;
+    deque<string> reported_order;
+    
+    // Caller holds watch_mutex
+    bool firstReport(const Change& change) {
+        pair<uint64_t, bool> rank{change.version, change.deleted};
+        auto it = reported.find(change.key);
+        if (it != reported.end()) {
+            if (it->second >= rank) return false;
+            it->second = rank;
+            return true;
+        }
+        reported.emplace(change.key, rank);
+        reported_order.push_back(change.key);
+        if (reported_order.size() > ring.size()) {
+            reported.erase(reported_order.front());
+            reported_order.pop_front();
+        }
+        return true;
+    }
+};
+
+// What a node keeps in front of its storage engine. The engine holds every
+// value in memory, so None is the default: an LRU cache there only adds a
+// lock, a lookup and a second copy of each value it holds
+enum class NodeCache { None, Lru };
+
+// Node in the distributed system
+class KVNode {
+private:
+    string node_id;
+    // Null for NodeCache::None. Declared first so storage's expiry thread
+    // stops before it goes
+    unique_ptr<LRUCache<string, VersionedValue>> cache;
+    StorageEngine storage;
+    vector<string> replica_nodes;
+    atomic<bool> is_leader{false};
+    
+    // Watches on key prefixes. watched lets writes skip the lock when
+    // there are none
+    vector<shared_ptr<Watch>> watches;
+    shared_mutex watch_mutex;
+    atomic<bool> watched{false};
+    
+    // Client reads served, and the most read keys among them
+    atomic<uint64_t> reads_served{0};
+    HotKeyTracker hot_reads;
+    atomic<bool> tracking_reads{true};
+    
+    // Read-only copies of hot keys this node serves. A write drops the copy
+    // and bumps its generation, so a value read before the write cannot be
+    // kept after it. Generations start at 1; 0 means no copy is open
+    struct ReadCopy {
+        VersionedValue entry;
+        bool filled = false;
+        uint64_t generation = 1;
+    };
+    unordered_map<string, ReadCopy> read_copies;
+    shared_mutex copies_mutex;
+    
+public:
+    struct CacheStats {
+        size_t entries = 0;
+        size_t bytes = 0;   // Keys and the value copies held
+    };
+    
+    KVNode(const string& id, int cache_size = 1000, Durability durability = Durability::GroupSync,
+           NodeCache cache_mode = NodeCache::None)
+        : node_id(id),
+          cache(cache_mode == NodeCache::Lru ? make_unique<LRUCache<string, VersionedValue>>(cache_size) : nullptr),
+          storage(id + ".wal", durability) {
+        storage.setExpiryListener([this](const string& key, uint64_t version) {
+            uncache(key);
+            publish(key, VersionedValue{"", version, true});
+        });
+    }
+    
+    // Basic operations. version = 0 stamps the write locally; expires_at is
+    // a wall-clock deadline in milliseconds, 0 for none. Writes drop the
+    // key from the cache and the next read brings it back
+    void put(const string& key, SharedValue value, uint64_t version = 0, uint64_t expires_at = 0) {
+        if (storage.put(key, value, version, expires_at)) {
+            uncache(key);
+            if (watched) publish(key, VersionedValue{move(value), version, false, expires_at});
+        }
+    }
+    
+    optional<SharedValue> get(const string& key) {
+        VersionedValue entry;
+        if (!readEntry(key, entry) || !entry.isLive(HybridClock::wallMillis())) {
+            return nullopt;
+        }
+        return entry.value;
+    }
+    
+    bool remove(const string& key, uint64_t version = 0) {
+        bool result = storage.remove(key, version);
+        uncache(key);
+        if (result) publish(key, VersionedValue{"", version, true});
+        return result;
+    }
+    
+    // Versioned access for read repair and anti-entropy
+    bool getEntry(const string& key, VersionedValue& entry) {
+        return storage.getEntry(key, entry);
+    }
+    
+    // A client read, counted toward this node's load and its hot keys.
+    // The cache answers first if there is one; expired entries are dropped
+    // on sight. A live entry read from storage is cached, then checked
+    // against storage again so a write that slipped in between cannot
+    // leave it stale
+    bool readEntry(const string& key, VersionedValue& entry) {
+        noteRead(key);
+        if (!cache) return storage.getEntry(key, entry);
+        
+        uint64_t now = HybridClock::wallMillis();
+        if (auto cached = cache->get(key)) {
+            if (cached->isLive(now)) {
+                entry = move(*cached);
+                return true;
+            }
+            cache->remove(key);
+        }
+        if (!storage.getEntry(key, entry)) return false;
+        if (entry.isLive(now)) {
+            cache->put(key, entry);
+            VersionedValue current;
+            if (!storage.getEntry(key, current) || current.version != entry.version) {
+                cache->remove(key);
+            }
+        }
+        return true;
+    }
+    
+    CacheStats cacheStats() {
+        CacheStats stats;
+        if (!cache) return stats;
+        cache->forEach([&](const string& key, const VersionedValue& entry) {
+            ++stats.entries;
+            stats.bytes += key.size() + entry.value.size();
+        });
+        return stats;
+    }
+    
+    // Hot key copies; see DistributedKVStore::get. Returns whether a copy
+    // is filled, and otherwise the generation fillCopy must be given
+    bool readCopy(const string& key, VersionedValue& entry, uint64_t& generation) {
+        shared_lock<shared_mutex> lock(copies_mutex);
+        auto it = read_copies.find(key);
+        generation = 0;
+        if (it == read_copies.end()) return false;
+        if (!it->second.filled) {
+            generation = it->second.generation;
+            return false;
+        }
+        noteRead(key);
+        entry = it->second.entry;
+        return true;
+    }
+    
+    void fillCopy(const string& key, const VersionedValue& entry, uint64_t generation) {
+        unique_lock<shared_mutex> lock(copies_mutex);
+        auto it = read_copies.find(key);
+        if (it != read_copies.end() && it->second.generation == generation) {
+            it->second.entry = entry;
+            it->second.filled = true;
+        }
+    }
+    
+    void dropCopy(const string& key) {
+        unique_lock<shared_mutex> lock(copies_mutex);
+        auto it = read_copies.find(key);
+        if (it != read_copies.end()) {
+            it->second.filled = false;
+            it->second.entry = VersionedValue();
+            ++it->second.generation;
+        }
+    }
+    
+    void openCopy(const string& key) {
+        unique_lock<shared_mutex> lock(copies_mutex);
+        read_copies.emplace(key, ReadCopy());
+    }
+    
+    void closeCopy(const string& key) {
+        unique_lock<shared_mutex> lock(copies_mutex);
+        read_copies.erase(key);
+    }
+    
+    void closeCopies() {
+        unique_lock<shared_mutex> lock(copies_mutex);
+        read_copies.clear();
+    }
+    
+    void trackHotKeys(bool enabled) { tracking_reads = enabled; }
+    vector<string> hotKeys() { return hot_reads.hotKeys(); }
+    uint64_t readsServed() const { return reads_served; }
+    
+    void merge(const string& key, const VersionedValue& entry) {
+        if (storage.merge(key, entry)) {
+            uncache(key);
+        }
+    }
+    
+    // Atomic read-modify-write; see StorageEngine::update
+    bool update(const string& key, const function<bool(const VersionedValue*, VersionedValue&)>& compute,
+                VersionedValue& result) {
+        bool updated = storage.update(key, compute, result);
+        if (updated) {
+            uncache(key);
+            publish(key, result);
+        }
+        return updated;
+    }
+    
+    // See StorageEngine::commitTransaction; writes come back versioned
+    bool commitTransaction(const unordered_map<string, uint64_t>& reads,
+                           unordered_map<string, VersionedValue>& writes) {
+        if (!storage.commitTransaction(reads, writes)) return false;
+        vector<Watch::Change> changes;
+        for (const auto& change : writes) {
+            uncache(change.first);
+            if (watched) {
+                changes.push_back({change.first, change.second.value, change.second.version, change.second.deleted});
+            }
+        }
+        publish(changes);
+        return true;
+    }
+    
+    void mergeTransaction(const unordered_map<string, VersionedValue>& writes) {
+        storage.mergeTransaction(writes);
+        for (const auto& change : writes) {
+            uncache(change.first);
+        }
+    }
+    
+    // Cross-node transaction participant and record keeper; see the
+    // StorageEngine methods of the same names
+    bool prepareIntents(uint64_t txn_id, const string& anchor,
+                        const unordered_map<string, uint64_t>& reads,
+                        const unordered_map<string, VersionedValue>& writes, bool validate = true) {
+        return storage.prepareIntents(txn_id, anchor, reads, writes, validate);
+    }
+    
+    void resolveIntents(uint64_t txn_id, const vector<string>& keys, bool commit) {
+        storage.resolveIntents(txn_id, keys, commit);
+        if (commit) {
+            vector<Watch::Change> changes;
+            for (const string& key : keys) {
+                uncache(key);
+                VersionedValue entry;
+                if (watched && storage.getEntry(key, entry)) {
+                    changes.push_back({key, entry.value, entry.version, entry.deleted});
+                }
+            }
+            publish(changes);
+        }
+    }
+    
+    bool getIntent(const string& key, WriteIntent& intent) {
+        return storage.getIntent(key, intent);
+    }
+    
+    unordered_map<string, WriteIntent> getIntents() {
+        return storage.getIntents();
+    }
+    
+    TxnStatus putTxnRecord(uint64_t txn_id, const TxnRecord& record) {
+        return storage.putTxnRecord(txn_id, record);
+    }
+    
+    bool getTxnRecord(uint64_t txn_id, TxnRecord& record) {
+        return storage.getTxnRecord(txn_id, record);
+    }
+    
+    unordered_map<uint64_t, TxnRecord> getTxnRecords() {
+        return storage.getTxnRecords();
+    }
+    
+    void forgetTxnRecord(uint64_t txn_id) {
+        storage.forgetTxnRecord(txn_id);
+    }
+    
+    // Batch operations for redistribution
+    void putBatch(const unordered_map<string, string>& batch) {
+        storage.putBatch(batch);
+        for (const auto& pair : batch) {
+            uncache(pair.first);
+        }
+    }
+    
+    void removeBatch(const vector<string>& keys) {
+        storage.removeBatch(keys);
+        for (const string& key : keys) {
+            uncache(key);
+        }
+    }
+    
+    void mergeBatch(const unordered_map<string, VersionedValue>& batch) {
+        storage.mergeBatch(batch);
+        for (const auto& pair : batch) {
+            uncache(pair.first);
+        }
+    }
+    
+    void dropBatch(const vector<string>& keys) {
+        storage.dropBatch(keys);
+        for (const string& key : keys) {
+            uncache(key);
+        }
+    }
+    
+    // Get data for redistribution
+    unordered_map<string, string> getAllData() {
+        return storage.getAllData();
+    }
+    
+    unordered_map<string, VersionedValue> getAllEntries() {
+        return storage.getAllEntries();
+    }
+    
+    // Get entries, tombstones included, that should be moved to other nodes
+    unordered_map<string, VersionedValue> getKeysForRedistribution(
+        const function<bool(const string&)>& should_move) {
+        unordered_map<string, VersionedValue> keys_to_move;
+        auto all_data = storage.getAllEntries();
+        
+        for (const auto& pair : all_data) {
+            if (should_move(pair.first)) {
+                keys_to_move[pair.first] = pair.second;
+            }
+        }
+        
+        return keys_to_move;
+    }
+    
+    StorageEngine::TombstoneStats tombstoneStats() {
+        return storage.tombstoneStats();
+    }
+    
+    void setTombstoneGracePeriod(chrono::milliseconds grace) {
+        storage.setTombstoneGracePeriod(grace);
+    }
+    
+    void addWatch(const shared_ptr<Watch>& watch) {
+        unique_lock<shared_mutex> lock(watch_mutex);
+        watches.push_back(watch);
+        watched = true;
+    }
+    
+    void removeWatch(const shared_ptr<Watch>& watch) {
+        unique_lock<shared_mutex> lock(watch_mutex);
+        watches.erase(std::remove(watches.begin(), watches.end(), watch), watches.end());
+        watched = !watches.empty();
+    }
+    
+    ChangeCursor changeCursor() {
+        ChangeCursor cursor = storage.changeCursor();
+        cursor.node = node_id;
+        return cursor;
+    }
+    
+    bool readChanges(ChangeCursor& cursor, vector<ChangeEvent>& events, size_t max_events,
+                     chrono::milliseconds wait) {
+        return storage.readChanges(cursor, events, max_events, wait);
+    }
+    
+    void checkpoint() {
+        storage.checkpoint();
+    }
+    
+    void addReplica(const string& replica_id) {
+        replica_nodes.push_back(replica_id);
+    }
+    
+    string getNodeId() const { return node_id; }
+    
+    void setLeader(bool leader) { is_leader = leader; }
+    bool isLeader() const { return is_leader; }
+    
+private:
+    void uncache(const string& key) {
+        if (cache) cache->remove(key);
+    }
+    
+    void noteRead(const string& key) {
+        reads_served.fetch_add(1, memory_order_relaxed);
+        if (tracking_reads) hot_reads.record(key);
+    }
+    
+    void publish(const string& key, const VersionedValue& entry) {
+        if (!watched) return;
+        shared_lock<shared_mutex> lock(watch_mutex);
+        for (const auto& watch : watches) {
+            if (watch->matches(key)) {
+                watch->publish({{key, entry.value, entry.version, entry.deleted}});
+            }
+        }
+    }
+    
+    // Each watch takes the changes under its prefix as one batch
+    void publish(const vector<Watch::Change>& changes) {
+        if (!watched || changes.empty()) return;
+        shared_lock<shared_mutex> lock(watch_mutex);
+        vector<Watch::Change> matching;
+        for (const auto& watch : watches) {
+            matching.clear();
+            for (const auto& change : changes) {
+                if (watch->matches(change.key)) matching.push_back(change);
+            }
+            if (!matching.empty()) watch->publish(matching);
+        }
+    }
+};
+
+// How many replicas a read consults. One answers from the first replica,
+// in ring order, that holds an entry for the key; Quorum answers with the
+// newest of a majority of them
+enum class ReadConsistency { One, Quorum };
+
+// Distributed Key-Value Store Cluster
+class DistributedKVStore {
+private:
+    unordered_map<string, unique_ptr<KVNode>> nodes;
+    ConsistentHash hash_ring;
+    int replication_factor;
+    Durability durability;
+    chrono::milliseconds tombstone_grace = StorageEngine::DEFAULT_TOMBSTONE_GRACE;
+    shared_mutex cluster_mutex;
+    atomic<bool> parallel_commit{true};
+    NodeCache node_cache;
+    vector<shared_ptr<Watch>> watches;   // Registered on every node
+    NearCache near_cache;                // Off unless setNearCache is called
+    NegativeCache negative_cache;        // Off unless setNegativeCache is called
+    atomic<ReadConsistency> read_consistency{ReadConsistency::One};
+    atomic<uint32_t> read_repair_every{10};   // Reads per repairing read, 0 = none
+    
+public:
+    // What the last addNode or removeNode, or a repairReplicas call, copied
+    // between nodes
+    struct RedistributionStats {
+        size_t keys_moved = 0;
+        size_t bytes_moved = 0;          // Keys and values
+    };
+    
+private:
+    RedistributionStats last_redistribution;
+    
+    // Hot keys, found by polling the nodes' trackers, and the nodes holding
+    // a copy of each: its replicas and hot_key_replicas more along the ring
+    unordered_map<string, vector<string>> hot_keys;
+    shared_mutex hot_mutex;
+    atomic<size_t> hot_key_count{0};
+    // Bits set by hot key hashes, so reads of other keys skip hot_mutex.
+    // Rebuilt at each refresh, when a hot key may briefly read as cold
+    array<atomic<uint64_t>, 64> hot_filter{};
+    bool hot_key_tracking = true;
+    size_t hot_key_replicas = DEFAULT_HOT_KEY_REPLICAS;
+    // The nodes are polled for hot keys every HOT_KEY_REFRESH, off the read
+    // path; the refresh thread starts with the first node
+    mutex hot_refresh_mutex;
+    condition_variable hot_refresh_cv;
+    thread hot_refresh_thread;
+    bool hot_refresh_stopping = false;
+    static constexpr chrono::milliseconds HOT_KEY_REFRESH = chrono::milliseconds(250);
+    
+    // An undecided cross-node transaction this old has lost its coordinator
+    // and may be aborted by whoever runs into it
+    static constexpr chrono::milliseconds TXN_ABANDON_TIMEOUT = chrono::seconds(10);
+    // A change feed waits this long at a time with cluster_mutex held
+    static constexpr chrono::milliseconds CHANGE_WAIT_SLICE = chrono::milliseconds(50);
+    
+    // The keys of one transaction that live on one set of nodes
+    struct Participant {
+        unordered_map<string, uint64_t> reads;
+        unordered_map<string, VersionedValue> writes;
+    };
+    
+    // Decided cross-node transactions whose intents are still to resolve
+    struct Resolution {
+        uint64_t txn_id;
+        string anchor;
+        vector<string> keys;
+        bool commit;
+        bool mark_committed;   // Parallel commit: the record still says Staging
+    };
+    mutex resolver_mutex;
+    condition_variable resolver_cv;
+    deque<Resolution> resolutions;
+    thread resolver_thread;
+    bool resolver_stopping = false;
+    
+    // Run round one of cross-node commits for all of them; the workers
+    // start with the first such commit
+    mutex commit_mutex;
+    condition_variable commit_cv;
+    queue<function<void()>> commit_tasks;
+    vector<thread> commit_workers;
+    bool commit_stopping = false;
+    static constexpr unsigned COMMIT_WORKERS = 4;
+    
+public:
+    static constexpr size_t DEFAULT_HOT_KEY_REPLICAS = 2;
+    
+    // Optimistic multi-key transaction. Reads go to each key's primary and
+    // remember the version they saw; writes are buffered until commit. If
+    // every key lives on the same nodes, which hash tags arrange
+    // ("{user:1001}:profile" and "{user:1001}:orders" hash only
+    // "user:1001"), the primary commits it alone; otherwise it takes a
+    // cross-node commit
+    class Transaction {
+    public:
+        // Sees the transaction's own writes
+        optional<SharedValue> get(const string& key) {
+            auto written = writes.find(key);
+            if (written != writes.end()) {
+                if (written->second.deleted) return nullopt;
+                return written->second.value;
+            }
+            VersionedValue entry;
+            bool live = store.readPrimary(key, entry);
+            reads.emplace(key, live ? entry.version : 0);
+            if (!live) return nullopt;
+            return entry.value;
+        }
+        
+        void put(const string& key, SharedValue value) {
+            writes[key] = VersionedValue{move(value), 0, false};
+        }
+        
+        void remove(const string& key) {
+            writes[key] = VersionedValue{"", 0, true};
+        }
+        
+        // Returns false, changing nothing, if a key read has changed since
+        // or another transaction holds one of the keys. The transaction is
+        // spent either way
+        bool commit() {
+            bool committed = store.commitTransaction(reads, writes);
+            reads.clear();
+            writes.clear();
+            return committed;
+        }
+        
+    private:
+        friend class DistributedKVStore;
+        
+        DistributedKVStore& store;
+        unordered_map<string, uint64_t> reads;
+        unordered_map<string, VersionedValue> writes;
+        
+        explicit Transaction(DistributedKVStore& s) : store(s) {}
+    };
+    
+    DistributedKVStore(int rf = 3, Durability mode = Durability::GroupSync, NodeCache cache_mode = NodeCache::None)
+        : replication_factor(rf), durability(mode), node_cache(cache_mode) {}
+    
+    ~DistributedKVStore() {
+        {
+            lock_guard<mutex> lock(hot_refresh_mutex);
+            hot_refresh_stopping = true;
+        }
+        hot_refresh_cv.notify_all();
+        if (hot_refresh_thread.joinable()) hot_refresh_thread.join();
+        
+        {
+            lock_guard<mutex> lock(resolver_mutex);
+            resolver_stopping = true;
+        }
+        resolver_cv.notify_all();
+        if (resolver_thread.joinable()) resolver_thread.join();
+        
+        {
+            lock_guard<mutex> lock(commit_mutex);
+            commit_stopping = true;
+        }
+        commit_cv.notify_all();
+        for (auto& worker : commit_workers) {
+            worker.join();
+        }
+    }
+    
+    void addNode(const string& node_id) {
+        // Recover the node from its WAL before taking the cluster lock, so
+        // client operations keep flowing while the log is replayed
+        auto node = make_unique<KVNode>(node_id, 1000, durability, node_cache);
+        
+        unique_lock<shared_mutex> lock(cluster_mutex);
+        attachNode(node_id, move(node));
+    }
+    
+    // Add several nodes at once; their WALs are replayed concurrently
+    void addNodes(const vector<string>& node_ids) {
+        auto recovered = recoverNodes(node_ids, durability, node_cache);
+        
+        unique_lock<shared_mutex> lock(cluster_mutex);
+        for (size_t i = 0; i < node_ids.size(); ++i) {
+            attachNode(node_ids[i], move(recovered[i]));
+        }
+    }
+    
+    // Construct nodes in parallel, each replaying its own WAL
+    static vector<unique_ptr<KVNode>> recoverNodes(const vector<string>& node_ids,
+                                                   Durability durability = Durability::GroupSync,
+                                                   NodeCache cache_mode = NodeCache::None) {
+        vector<future<unique_ptr<KVNode>>> recovering;
+        for (const auto& node_id : node_ids) {
+            recovering.push_back(async(launch::async, [node_id, durability, cache_mode]() {
+                return make_unique<KVNode>(node_id, 1000, durability, cache_mode);
+            }));
+        }
+        
+        vector<unique_ptr<KVNode>> recovered;
+        for (auto& pending : recovering) {
+            recovered.push_back(pending.get());
+        }
+        return recovered;
+    }
+    
+    void removeNode(const string& node_id) {
+        unique_lock<shared_mutex> lock(cluster_mutex);
+        
+        cout << "\n=== Removing Node: " << node_id << " ===" << endl;
+        resolvePending();
         
         auto node_it = nodes.find(node_id);
         if (node_it == nodes.end()) {
@@ -479,127 +4617,1019 @@ public:
             return;
         }
         
-        // Store old ring state for redistribution
-        ConsistentHash old_ring = hash_ring;
+        // Copies are placed by the ring, and the node's keys may not all
+        // find a new home
+        coolHotKeys();
+        near_cache.clear();
+        negative_cache.clear();
+        
+        // Store old ring state for redistribution
+        ConsistentHash old_ring = hash_ring;
+        
+        // Perform smart redistribution before removing
+        redistributeOnRemove(node_id, old_ring);
+        
+        // Remove from hash ring and nodes
+        hash_ring.removeNode(node_id);
+        nodes.erase(node_id);
+        
+        cout << "✓ Node " << node_id << " removed successfully with data preserved" << endl;
+    }
+    
+    // ttl > 0 expires the key that long after the write, on every replica.
+    // The value is copied (or moved, for an rvalue) into one buffer that all
+    // replicas share
+    void put(const string& key, SharedValue value, chrono::milliseconds ttl = chrono::milliseconds::zero()) {
+        LatencyTimer timer(StoreLatency::put);
+        shared_lock<shared_mutex> lock(cluster_mutex);
+        
+        auto responsible_nodes = hash_ring.getNodes(key, replication_factor);
+        if (responsible_nodes.empty()) {
+            throw runtime_error("No nodes available");
+        }
+        
+        // Validate we have enough nodes for replication
+        if (responsible_nodes.size() < replication_factor) {
+            cout << "Warning: Only " << responsible_nodes.size() 
+                 << " nodes available for replication (requested " << replication_factor << ")" << endl;
+        }
+        
+        // Write to primary node and replicas, all with one version and deadline
+        uint64_t version = HybridClock::shared().now();
+        uint64_t expires_at = (ttl.count() > 0) ? HybridClock::toMillis(version) + ttl.count() : 0;
+        {
+            LatencyTimer fan_out(StoreLatency::fan_out);
+            for (size_t i = 0; i < responsible_nodes.size(); ++i) {
+                auto it = nodes.find(responsible_nodes[i]);
+                if (it == nodes.end()) continue;
+                // The last replica takes the handle, the others share it
+                if (i + 1 == responsible_nodes.size()) {
+                    it->second->put(key, move(value), version, expires_at);
+                } else {
+                    it->second->put(key, value, version, expires_at);
+                }
+            }
+        }
+        dropCopies(key);
+    }
+    
+    // nullopt when the key is missing; "" is a value like any other
+    optional<SharedValue> get(const string& key) {
+        uint64_t version;
+        return get(key, version);
+    }
+    
+    // Also reports the value's version, 0 when the key is missing, for
+    // use with compareAndSet
+    optional<SharedValue> get(const string& key, uint64_t& version) {
+        LatencyTimer timer(StoreLatency::get);
+        
+        // The near cache answers repeated reads without the ring or any
+        // node, and the negative cache answers for keys recently found
+        // missing. On a miss each hands out a ticket, and the answer read
+        // below is kept unless a write to the key gets there first
+        version = 0;
+        VersionedValue newest;
+        uint64_t ticket = 0;
+        if (near_cache.get(key, newest, ticket)) {
+            return liveValue(newest, version);
+        }
+        uint64_t absence_ticket = 0;
+        if (negative_cache.contains(key, absence_ticket)) {
+            return nullopt;
+        }
+        
+        shared_lock<shared_mutex> lock(cluster_mutex);
+        
+        // A hot key is answered by one of the nodes holding a copy, in
+        // turn, without touching its replicas. A node whose copy is not
+        // filled reads the replicas as usual and keeps the answer the same
+        // way
+        KVNode* reader = nullptr;
+        uint64_t generation = 0;
+        if (hot_key_count > 0 && mayBeHot(key) && readHotCopy(key, newest, reader, generation)) {
+            keepAnswer(key, newest, ticket, absence_ticket);
+            return liveValue(newest, version);
+        }
+        
+        auto responsible_nodes = hash_ring.getNodes(key, replication_factor);
+        if (responsible_nodes.empty()) {
+            return nullopt;
+        }
+        
+        // Validate we have enough nodes for replication
+        if (responsible_nodes.size() < replication_factor) {
+            cout << "Warning: Only " << responsible_nodes.size() 
+                 << " nodes available for replication (requested " << replication_factor << ")" << endl;
+        }
+        
+        // A committed cross-node transaction may not have resolved its
+        // intent here yet
+        settleIntent(responsible_nodes, key);
+        
+        // Read replicas in ring order until one holds an entry and enough
+        // have answered, and answer with the newest version read, where a
+        // tombstone or an expired value reads as missing. One read in
+        // read_repair_every reads every replica, so the repair below can
+        // bring them all up to date
+        size_t wanted = read_consistency == ReadConsistency::Quorum ? replication_factor / 2 + 1 : 1;
+        uint32_t repair_every = read_repair_every.load(memory_order_relaxed);
+        thread_local uint32_t reads = 0;
+        if (repair_every && ++reads % repair_every == 0) {
+            wanted = responsible_nodes.size();
+        }
+        
+        vector<pair<KVNode*, uint64_t>> replicas;   // Node, version held (0 = none)
+        bool found = false;
+        for (const auto& node_id : responsible_nodes) {
+            if (found && replicas.size() >= wanted) break;
+            auto it = nodes.find(node_id);
+            if (it == nodes.end()) continue;
+            
+            VersionedValue entry;
+            bool has_entry = it->second->readEntry(key, entry);
+            if (has_entry && (!found || entry.version > newest.version)) {
+                newest = entry;
+                found = true;
+            }
+            replicas.push_back({it->second.get(), has_entry ? entry.version : 0});
+        }
+        
+        // An intent means a transaction may be committing the key; its
+        // resolution will drop copies, but a copy kept now could outlive it
+        VersionedValue answer = found ? newest : VersionedValue{"", 0, true};
+        bool live = answer.isLive(HybridClock::wallMillis());
+        WriteIntent intent;
+        if ((reader || ticket || (absence_ticket && !live)) &&
+            !nodes.at(responsible_nodes[0])->getIntent(key, intent)) {
+            if (reader) reader->fillCopy(key, answer, generation);
+            keepAnswer(key, answer, ticket, absence_ticket);
+        }
+        if (!found) {
+            return nullopt;
+        }
+        
+        // Read repair: bring replicas read that are behind up to date,
+        // tombstones included, so a stale value cannot be served later
+        for (const auto& replica : replicas) {
+            if (replica.second < newest.version) {
+                replica.first->merge(key, newest);
+            }
+        }
+        return liveValue(newest, version);
+    }
+    
+    // Atomic operations run on the key's primary, which resolves the new
+    // value and version; replicas then receive that result as is.
+    
+    // Write value only if the key is still at expected_version (0 = the key
+    // must not exist). Returns whether the swap happened
+    bool compareAndSet(const string& key, uint64_t expected_version, const string& value) {
+        return updateOnPrimary(key, [&](const VersionedValue* current, VersionedValue& next) {
+            if ((current ? current->version : 0) != expected_version) return false;
+            next.value = value;
+            return true;
+        });
+    }
+    
+    // Add delta to an integer value (a missing key counts as 0) and return
+    // the result. A TTL on the key is kept
+    long long increment(const string& key, long long delta = 1) {
+        long long result = 0;
+        updateOnPrimary(key, [&](const VersionedValue* current, VersionedValue& next) {
+            long long base = 0;
+            if (current) {
+                size_t parsed = 0;
+                try {
+                    base = stoll(current->value, &parsed);
+                } catch (const exception&) {
+                    parsed = 0;
+                }
+                if (parsed != current->value.size()) {
+                    throw runtime_error("Value of " + key + " is not an integer");
+                }
+                next.expires_at = current->expires_at;
+            }
+            result = base + delta;
+            next.value = to_string(result);
+            return true;
+        });
+        return result;
+    }
+    
+    // Append suffix to the value (a missing key counts as empty) and return
+    // the new value. A TTL on the key is kept
+    string append(const string& key, const string& suffix) {
+        string result;
+        updateOnPrimary(key, [&](const VersionedValue* current, VersionedValue& next) {
+            string value;
+            if (current) {
+                value = current->value;
+                next.expires_at = current->expires_at;
+            }
+            result = value + suffix;
+            next.value = result;
+            return true;
+        });
+        return result;
+    }
+    
+    bool remove(const string& key) {
+        LatencyTimer timer(StoreLatency::remove);
+        shared_lock<shared_mutex> lock(cluster_mutex);
+        
+        auto responsible_nodes = hash_ring.getNodes(key, replication_factor);
+        bool success = false;
+        
+        // Validate we have enough nodes for replication
+        if (responsible_nodes.size() < replication_factor) {
+            cout << "Warning: Only " << responsible_nodes.size() 
+                 << " nodes available for replication (requested " << replication_factor << ")" << endl;
+        }
+        
+        // Every replica keeps a tombstone with the same version
+        uint64_t version = HybridClock::shared().now();
+        {
+            LatencyTimer fan_out(StoreLatency::fan_out);
+            for (const auto& node_id : responsible_nodes) {
+                auto it = nodes.find(node_id);
+                if (it != nodes.end()) {
+                    bool node_success = it->second->remove(key, version);
+                    success |= node_success;
+                }
+            }
+        }
+        dropCopies(key);
+        return success;
+    }
+    
+    // Anti-entropy: push every node's entries, tombstones included, to the
+    // other replicas of each key that hold an older version or none.
+    // Returns what it copied
+    RedistributionStats repairReplicas() {
+        shared_lock<shared_mutex> lock(cluster_mutex);
+        cout << "\n=== Anti-Entropy Repair ===" << endl;
+        
+        // Finish cross-node transactions whose coordinator went away
+        size_t settled = 0;
+        for (const auto& node : nodes) {
+            for (const auto& record : node.second->getTxnRecords()) {
+                if (record.second.keys.empty()) continue;
+                const string& anchor = *min_element(record.second.keys.begin(), record.second.keys.end());
+                if (settleTransaction(record.first, anchor, anchor)) ++settled;
+            }
+            for (const auto& intent : node.second->getIntents()) {
+                if (settleTransaction(intent.second.txn_id, intent.second.anchor, intent.first)) ++settled;
+            }
+        }
+        
+        RedistributionStats repaired;
+        for (const auto& source : nodes) {
+            unordered_map<string, unordered_map<string, VersionedValue>> updates;
+            for (const auto& pair : source.second->getAllEntries()) {
+                for (const auto& replica_id : hash_ring.getNodes(pair.first, replication_factor)) {
+                    auto it = nodes.find(replica_id);
+                    if (replica_id == source.first || it == nodes.end()) continue;
+                    
+                    VersionedValue current;
+                    if (!it->second->getEntry(pair.first, current) || current.version < pair.second.version) {
+                        updates[replica_id][pair.first] = pair.second;
+                    }
+                }
+            }
+            
+            for (const auto& update : updates) {
+                nodes.at(update.first)->mergeBatch(update.second);
+                repaired.keys_moved += update.second.size();
+                for (const auto& kv : update.second) {
+                    repaired.bytes_moved += kv.first.size() + kv.second.value.size();
+                }
+            }
+        }
+        cout << "✓ Repair complete: " << repaired.keys_moved << " replica entries updated, "
+             << settled << " transaction records or intents settled" << endl;
+        return repaired;
+    }
+    
+    // Tombstones younger than grace survive checkpoints; applies to current
+    // and future nodes
+    void setTombstoneGracePeriod(chrono::milliseconds grace) {
+        unique_lock<shared_mutex> lock(cluster_mutex);
+        tombstone_grace = grace;
+        for (auto& pair : nodes) {
+            pair.second->setTombstoneGracePeriod(grace);
+        }
+    }
+    
+    // Subscribe to writes of keys starting with prefix; see Watch. Every
+    // node, including those added later, reports to it until unwatch
+    shared_ptr<Watch> watch(const string& prefix, size_t capacity = Watch::DEFAULT_CAPACITY) {
+        unique_lock<shared_mutex> lock(cluster_mutex);
+        auto subscription = make_shared<Watch>(prefix, capacity);
+        watches.push_back(subscription);
+        for (auto& pair : nodes) {
+            pair.second->addWatch(subscription);
+        }
+        return subscription;
+    }
+    
+    void unwatch(const shared_ptr<Watch>& watch) {
+        unique_lock<shared_mutex> lock(cluster_mutex);
+        watches.erase(std::remove(watches.begin(), watches.end(), watch), watches.end());
+        for (auto& pair : nodes) {
+            pair.second->removeWatch(watch);
+        }
+    }
+    
+    // Change feed of one node's writes: start from changeCursor(node_id),
+    // or a saved cursor, and call readChanges in a loop. Each replica of a
+    // key reports its writes, so a feed per node covers the cluster
+    ChangeCursor changeCursor(const string& node_id) {
+        shared_lock<shared_mutex> lock(cluster_mutex);
+        return feedNode(node_id).changeCursor();
+    }
+    
+    // Returns whether anything was read; waits up to wait for a write, in
+    // slices so a waiting feed does not hold up adding or removing nodes
+    bool readChanges(ChangeCursor& cursor, vector<ChangeEvent>& events, size_t max_events,
+                     chrono::milliseconds wait = chrono::milliseconds(0)) {
+        auto deadline = chrono::steady_clock::now() + wait;
+        while (true) {
+            auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now());
+            {
+                shared_lock<shared_mutex> lock(cluster_mutex);
+                KVNode& node = feedNode(cursor.node);
+                auto slice = max(chrono::milliseconds(0), min(left, CHANGE_WAIT_SLICE));
+                if (node.readChanges(cursor, events, max_events, slice)) return true;
+            }
+            if (chrono::steady_clock::now() >= deadline) return false;
+        }
+    }
+    
+    void printClusterInfo() {
+        shared_lock<shared_mutex> lock(cluster_mutex);
+        cout << "Cluster has " << nodes.size() << " nodes:" << endl;
+        for (const auto& pair : nodes) {
+            cout << "- Node: " << pair.first << endl;
+        }
+    }
+    
+    void printDistributionStats() {
+        shared_lock<shared_mutex> lock(cluster_mutex);
+        cout << "\n=== Data Distribution Statistics ===" << endl;
         
-        // Perform smart redistribution before removing
-        redistributeOnRemove(node_id, old_ring);
+        unordered_map<string, int> key_counts;
+        int total_keys = 0;
+        StorageEngine::TombstoneStats tombstones;
         
-        // Remove from hash ring and nodes
-        hash_ring.removeNode(node_id);
-        nodes.erase(node_id);
+        for (const auto& pair : nodes) {
+            auto all_data = pair.second->getAllData();
+            key_counts[pair.first] = all_data.size();
+            total_keys += all_data.size();
+            
+            auto node_tombstones = pair.second->tombstoneStats();
+            tombstones.count += node_tombstones.count;
+            tombstones.memory_bytes += node_tombstones.memory_bytes;
+            tombstones.disk_bytes += node_tombstones.disk_bytes;
+        }
         
-        cout << "✓ Node " << node_id << " removed successfully with data preserved" << endl;
+        if (total_keys > 0) {
+            for (const auto& pair : key_counts) {
+                double percentage = (double)pair.second / total_keys * 100;
+                cout << "Node " << pair.first << ": " << pair.second 
+                     << " keys (" << fixed << setprecision(1) << percentage << "%)" << endl;
+            }
+        }
+        cout << "Total keys in cluster: " << total_keys << endl;
+        cout << "Tombstones: " << tombstones.count << " (" << tombstones.memory_bytes
+             << " bytes in memory, " << tombstones.disk_bytes << " bytes on disk)" << endl;
+        if (node_cache == NodeCache::Lru) {
+            auto caches = cacheStatsLocked();
+            cout << "Node caches: " << caches.entries << " entries (" << caches.bytes
+                 << " bytes copied from storage)" << endl;
+        } else {
+            cout << "Node caches: none (reads are served from storage)" << endl;
+        }
+        cout << "Hot keys: " << hot_key_count << endl;
+        if (near_cache.isEnabled()) {
+            cout << "Near cache: " << near_cache.hits() << " hits, " << near_cache.misses() << " misses" << endl;
+        }
+        if (negative_cache.isEnabled()) {
+            cout << "Negative cache: " << negative_cache.hits() << " misses answered" << endl;
+        }
+    }
+    
+    Transaction beginTransaction() {
+        return Transaction(*this);
+    }
+    
+    // Hot keys are found from each node's most read keys and served from
+    // copies on their replicas and extra_replicas more nodes along the ring
+    void setHotKeyReplicas(bool enabled, size_t extra_replicas = DEFAULT_HOT_KEY_REPLICAS) {
+        unique_lock<shared_mutex> lock(cluster_mutex);
+        hot_key_tracking = enabled;
+        hot_key_replicas = extra_replicas;
+        for (const auto& pair : nodes) {
+            pair.second->trackHotKeys(enabled);
+        }
+        coolHotKeys();
+    }
+    
+    // Cache up to capacity entries in front of the ring; 0 turns it off
+    void setNearCache(size_t capacity) {
+        near_cache.resize(capacity);
+    }
+    
+    // How many replicas each read consults; see ReadConsistency
+    void setReadConsistency(ReadConsistency consistency) {
+        read_consistency = consistency;
+    }
+    
+    // Read every replica and repair the ones behind on one read in every;
+    // 0 leaves repair to reads that consult several replicas anyway
+    void setReadRepair(uint32_t every) {
+        read_repair_every = every;
+    }
+    
+    // Remember up to capacity keys found missing; 0 turns it off
+    void setNegativeCache(size_t capacity = NegativeCache::DEFAULT_CAPACITY) {
+        negative_cache.resize(capacity);
+    }
+    
+    // How keys are placed, and the virtual nodes per node for Ring. Only
+    // before the first node is added
+    void setPlacement(Placement placement, int virtual_nodes = 100) {
+        unique_lock<shared_mutex> lock(cluster_mutex);
+        if (!nodes.empty()) {
+            throw runtime_error("Placement can only be set on an empty cluster");
+        }
+        hash_ring = ConsistentHash(virtual_nodes, placement);
     }
     
-    void put(const string& key, const string& value) {
+    RedistributionStats lastRedistribution() {
         shared_lock<shared_mutex> lock(cluster_mutex);
-        
-        auto responsible_nodes = hash_ring.getNodes(key, replication_factor);
-        if (responsible_nodes.empty()) {
+        return last_redistribution;
+    }
+    
+    // How many of the key's replicas hold no entry for it
+    size_t missingReplicas(const string& key) {
+        shared_lock<shared_mutex> lock(cluster_mutex);
+        size_t missing = 0;
+        for (const auto& node_id : hash_ring.getNodes(key, replication_factor)) {
+            auto it = nodes.find(node_id);
+            VersionedValue entry;
+            if (it == nodes.end() || !it->second->getEntry(key, entry)) ++missing;
+        }
+        return missing;
+    }
+    
+    // Entries held by the node caches, summed over the nodes
+    KVNode::CacheStats cacheStats() {
+        shared_lock<shared_mutex> lock(cluster_mutex);
+        return cacheStatsLocked();
+    }
+    
+    // Client reads each node has served, hot key copies included
+    map<string, uint64_t> nodeReads() {
+        shared_lock<shared_mutex> lock(cluster_mutex);
+        map<string, uint64_t> reads;
+        for (const auto& pair : nodes) {
+            reads[pair.first] = pair.second->readsServed();
+        }
+        return reads;
+    }
+    
+    // Distinct value buffers held by the replicas of a key; 1 when they all
+    // share one
+    size_t valueBuffers(const string& key) {
+        shared_lock<shared_mutex> lock(cluster_mutex);
+        vector<SharedValue> buffers;
+        for (const auto& node_id : hash_ring.getNodes(key, replication_factor)) {
+            auto it = nodes.find(node_id);
+            VersionedValue entry;
+            if (it == nodes.end() || !it->second->getEntry(key, entry) || entry.value.empty()) continue;
+            bool shared = any_of(buffers.begin(), buffers.end(),
+                                 [&](const SharedValue& buffer) { return buffer.sharesWith(entry.value); });
+            if (!shared) buffers.push_back(entry.value);
+        }
+        return buffers.size();
+    }
+    
+    // Cross-node commits use parallel commit (default) or plain two-phase
+    // commit
+    void setParallelCommit(bool enabled) {
+        parallel_commit = enabled;
+    }
+    
+    // Nodes holding key, primary first
+    vector<string> getReplicas(const string& key) {
+        shared_lock<shared_mutex> lock(cluster_mutex);
+        return hash_ring.getNodes(key, replication_factor);
+    }
+    
+private:
+    // Caller holds cluster_mutex
+    KVNode& feedNode(const string& node_id) {
+        auto it = nodes.find(node_id);
+        if (it == nodes.end()) throw runtime_error("No change feed: node " + node_id + " is not in the cluster");
+        return *it->second;
+    }
+    
+    // Live entry on the key's primary; false if it is missing or not live
+    bool readPrimary(const string& key, VersionedValue& entry) {
+        shared_lock<shared_mutex> lock(cluster_mutex);
+        auto replicas = hash_ring.getNodes(key, replication_factor);
+        if (replicas.empty()) {
+            throw runtime_error("No nodes available");
+        }
+        settleIntent(replicas, key);
+        return nodes.at(replicas[0])->getEntry(key, entry) && entry.isLive(HybridClock::wallMillis());
+    }
+    
+    // Keys on a single set of nodes commit on their primary, which ships
+    // the versioned writes to the other replicas as one transaction each;
+    // anything wider goes through commitAcrossNodes
+    bool commitTransaction(const unordered_map<string, uint64_t>& reads,
+                           unordered_map<string, VersionedValue>& writes) {
+        shared_lock<shared_mutex> lock(cluster_mutex);
+        if (nodes.empty()) {
             throw runtime_error("No nodes available");
         }
         
-        // Validate we have enough nodes for replication
-        if (responsible_nodes.size() < replication_factor) {
-            cout << "Warning: Only " << responsible_nodes.size() 
-                 << " nodes available for replication (requested " << replication_factor << ")" << endl;
+        map<vector<string>, Participant> participants;
+        for (const auto& read : reads) {
+            participants[hash_ring.getNodes(read.first, replication_factor)].reads.insert(read);
         }
+        for (const auto& change : writes) {
+            participants[hash_ring.getNodes(change.first, replication_factor)].writes.insert(change);
+        }
+        if (participants.empty()) return true;
+        if (participants.size() > 1) return commitAcrossNodes(participants);
         
-        // Write to primary node and replicas
-        for (const auto& node_id : responsible_nodes) {
-            auto it = nodes.find(node_id);
+        const vector<string>& replicas = participants.begin()->first;
+        auto primary = nodes.find(replicas[0]);
+        if (primary == nodes.end() || !primary->second->commitTransaction(reads, writes)) {
+            return false;
+        }
+        if (writes.empty()) return true;
+        
+        for (size_t i = 1; i < replicas.size(); ++i) {
+            auto it = nodes.find(replicas[i]);
             if (it != nodes.end()) {
-                it->second->put(key, value);
+                it->second->mergeTransaction(writes);
             }
         }
+        for (const auto& change : writes) {
+            dropCopies(change.first);
+        }
+        return true;
     }
     
-    string get(const string& key) {
-        shared_lock<shared_mutex> lock(cluster_mutex);
+    // Two-phase commit. Round one, run on all participants at once, stores
+    // intents on every participant (the primary votes after validating its
+    // reads) and writes the transaction record to the anchor's replicas.
+    // Plain two-phase commit writes the record as Pending and needs a second
+    // round to mark it Committed. Parallel commit writes it as Staging,
+    // listing the keys, which makes the transaction committed the moment
+    // round one succeeds; the record is marked afterwards. Either way the
+    // intents are resolved in the background. Caller holds cluster_mutex
+    bool commitAcrossNodes(map<vector<string>, Participant>& participants) {
+        bool parallel = parallel_commit;
+        uint64_t txn_id = HybridClock::shared().now();
+        TxnRecord record;
+        record.status = parallel ? TxnStatus::Staging : TxnStatus::Pending;
+        for (auto& participant : participants) {
+            for (auto& change : participant.second.writes) {
+                change.second.version = txn_id;
+                record.keys.push_back(change.first);
+            }
+        }
         
-        auto responsible_nodes = hash_ring.getNodes(key, replication_factor);
-        if (responsible_nodes.empty()) {
-            return "";
+        // Read-only: each participant just checks its reads
+        if (record.keys.empty()) {
+            for (auto& participant : participants) {
+                if (!nodes.at(participant.first[0])->commitTransaction(participant.second.reads,
+                                                                       participant.second.writes)) {
+                    return false;
+                }
+            }
+            return true;
         }
         
-        // Validate we have enough nodes for replication
-        if (responsible_nodes.size() < replication_factor) {
-            cout << "Warning: Only " << responsible_nodes.size() 
-                 << " nodes available for replication (requested " << replication_factor << ")" << endl;
+        string anchor = *min_element(record.keys.begin(), record.keys.end());
+        auto anchor_nodes = hash_ring.getNodes(anchor, replication_factor);
+        
+        // The participants prepare on the commit workers while this thread
+        // writes the record
+        vector<future<bool>> round;
+        for (const auto& participant : participants) {
+            round.push_back(submitCommitTask([&, txn_id]() {
+                return prepareParticipant(txn_id, anchor, participant.first, participant.second);
+            }));
+        }
+        bool committed = writeTxnRecord(anchor_nodes, txn_id, record) == record.status;
+        for (auto& vote : round) {
+            committed = vote.get() && committed;
         }
         
-        // Try to read from any available replica
-        for (const auto& node_id : responsible_nodes) {
-            auto it = nodes.find(node_id);
+        // A round one that ran long may have been judged abandoned by a
+        // reader, so settle it with the record instead of implicitly
+        bool slow = HybridClock::wallMillis() > HybridClock::toMillis(txn_id) + TXN_ABANDON_TIMEOUT.count() / 2;
+        bool mark_committed = parallel && !slow;
+        if (committed && !mark_committed) {
+            record.status = TxnStatus::Committed;
+            committed = writeTxnRecord(anchor_nodes, txn_id, record) == TxnStatus::Committed;
+        }
+        if (!committed) {
+            record.status = TxnStatus::Aborted;
+            writeTxnRecord(anchor_nodes, txn_id, record);
+        }
+        
+        enqueueResolution({txn_id, anchor, move(record.keys), committed, committed && mark_committed});
+        return committed;
+    }
+    
+    // Tasks never wait on one another, so a full pool only queues them
+    future<bool> submitCommitTask(function<bool()> task) {
+        auto packaged = make_shared<packaged_task<bool()>>(move(task));
+        future<bool> result = packaged->get_future();
+        {
+            lock_guard<mutex> lock(commit_mutex);
+            while (commit_workers.size() < COMMIT_WORKERS) {
+                commit_workers.emplace_back([this]() { runCommitWorker(); });
+            }
+            commit_tasks.push([packaged]() { (*packaged)(); });
+        }
+        commit_cv.notify_one();
+        return result;
+    }
+    
+    void runCommitWorker() {
+        unique_lock<mutex> lock(commit_mutex);
+        while (true) {
+            commit_cv.wait(lock, [this]() { return commit_stopping || !commit_tasks.empty(); });
+            if (commit_tasks.empty()) return;
+            auto task = move(commit_tasks.front());
+            commit_tasks.pop();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+    
+    // The primary's vote; replicas follow a yes. Caller holds cluster_mutex
+    bool prepareParticipant(uint64_t txn_id, const string& anchor, const vector<string>& replicas,
+                            const Participant& participant) {
+        if (!nodes.at(replicas[0])->prepareIntents(txn_id, anchor, participant.reads, participant.writes)) {
+            return false;
+        }
+        for (size_t i = 1; i < replicas.size(); ++i) {
+            auto it = nodes.find(replicas[i]);
             if (it != nodes.end()) {
-                string value = it->second->get(key);
-                if (!value.empty()) {
-                    return value;
+                it->second->prepareIntents(txn_id, anchor, {}, participant.writes, false);
+            }
+        }
+        for (const auto& change : participant.writes) {
+            dropCopies(change.first);
+        }
+        return true;
+    }
+    
+    // The anchor's primary arbitrates between the coordinator and readers
+    // settling the transaction; its replicas copy the outcome. Returns the
+    // status the record ends up with. Caller holds cluster_mutex
+    TxnStatus writeTxnRecord(const vector<string>& anchor_nodes, uint64_t txn_id, TxnRecord record) {
+        record.status = nodes.at(anchor_nodes[0])->putTxnRecord(txn_id, record);
+        for (size_t i = 1; i < anchor_nodes.size(); ++i) {
+            auto it = nodes.find(anchor_nodes[i]);
+            if (it != nodes.end()) {
+                it->second->putTxnRecord(txn_id, record);
+            }
+        }
+        return record.status;
+    }
+    
+    // Caller holds cluster_mutex
+    void settleIntent(const vector<string>& replicas, const string& key) {
+        auto primary = nodes.find(replicas[0]);
+        WriteIntent intent;
+        if (primary != nodes.end() && primary->second->getIntent(key, intent)) {
+            settleTransaction(intent.txn_id, intent.anchor, key);
+        }
+    }
+    
+    static size_t hotFilterBit(const string& key) {
+        return hash<string>()(key) % (64 * 64);
+    }
+    
+    bool mayBeHot(const string& key) const {
+        size_t bit = hotFilterBit(key);
+        return hot_filter[bit / 64].load(memory_order_relaxed) & (1ULL << (bit % 64));
+    }
+    
+    KVNode::CacheStats cacheStatsLocked() {
+        KVNode::CacheStats total;
+        for (const auto& pair : nodes) {
+            auto stats = pair.second->cacheStats();
+            total.entries += stats.entries;
+            total.bytes += stats.bytes;
+        }
+        return total;
+    }
+    
+    static optional<SharedValue> liveValue(const VersionedValue& entry, uint64_t& version) {
+        version = 0;
+        if (!entry.isLive(HybridClock::wallMillis())) {
+            return nullopt;
+        }
+        version = entry.version;
+        return entry.value;
+    }
+    
+    // The near cache keeps the answer, and the negative cache a miss
+    void keepAnswer(const string& key, const VersionedValue& answer, uint64_t ticket, uint64_t absence_ticket) {
+        near_cache.fill(key, answer, ticket);
+        if (!answer.isLive(HybridClock::wallMillis())) {
+            negative_cache.insert(key, absence_ticket);
+        }
+    }
+    
+    // Caller holds cluster_mutex. reader is the node whose turn it is to
+    // answer for a hot key, and generation its copy's if that is not filled
+    bool readHotCopy(const string& key, VersionedValue& entry, KVNode*& reader, uint64_t& generation) {
+        thread_local size_t turn = 0;
+        shared_lock<shared_mutex> lock(hot_mutex);
+        auto it = hot_keys.find(key);
+        if (it == hot_keys.end()) return false;
+        
+        auto node = nodes.find(it->second[turn++ % it->second.size()]);
+        if (node == nodes.end()) return false;
+        reader = node->second.get();
+        return reader->readCopy(key, entry, generation);
+    }
+    
+    // Writers call this once the write is on every replica. Hot key copies
+    // go first, since a near cache miss may be filled from one. Caller
+    // holds cluster_mutex
+    void dropCopies(const string& key) {
+        if (hot_key_count > 0) {
+            shared_lock<shared_mutex> lock(hot_mutex);
+            auto it = hot_keys.find(key);
+            if (it != hot_keys.end()) {
+                for (const auto& node_id : it->second) {
+                    auto node = nodes.find(node_id);
+                    if (node != nodes.end()) {
+                        node->second->dropCopy(key);
+                    }
+                }
+            }
+        }
+        near_cache.invalidate(key);
+        negative_cache.invalidate(key);
+    }
+    
+    void startHotKeyRefresh() {
+        lock_guard<mutex> lock(hot_refresh_mutex);
+        if (!hot_refresh_thread.joinable()) {
+            hot_refresh_thread = thread([this]() { runHotKeyRefresh(); });
+        }
+    }
+    
+    void runHotKeyRefresh() {
+        unique_lock<mutex> lock(hot_refresh_mutex);
+        while (!hot_refresh_cv.wait_for(lock, HOT_KEY_REFRESH, [this]() { return hot_refresh_stopping; })) {
+            lock.unlock();
+            {
+                shared_lock<shared_mutex> cluster_lock(cluster_mutex);
+                refreshHotKeys();
+            }
+            lock.lock();
+        }
+    }
+    
+    // Poll the nodes for hot keys. Keys no node reports any more lose their
+    // copies. Only the refresh thread calls it, holding cluster_mutex
+    void refreshHotKeys() {
+        if (!hot_key_tracking) return;
+        
+        set<string> hot;
+        for (const auto& pair : nodes) {
+            for (const string& key : pair.second->hotKeys()) {
+                hot.insert(key);
+            }
+        }
+        
+        unique_lock<shared_mutex> lock(hot_mutex);
+        for (auto it = hot_keys.begin(); it != hot_keys.end();) {
+            if (hot.erase(it->first)) {
+                ++it;
+                continue;
+            }
+            for (const auto& node_id : it->second) {
+                auto node = nodes.find(node_id);
+                if (node != nodes.end()) {
+                    node->second->closeCopy(it->first);
                 }
             }
+            it = hot_keys.erase(it);
+        }
+        for (const string& key : hot) {
+            auto readers = hash_ring.getNodes(key, replication_factor + hot_key_replicas);
+            for (const auto& node_id : readers) {
+                nodes.at(node_id)->openCopy(key);
+            }
+            hot_keys.emplace(key, move(readers));
+        }
+        hot_key_count = hot_keys.size();
+        
+        array<uint64_t, 64> filter{};
+        for (const auto& pair : hot_keys) {
+            size_t bit = hotFilterBit(pair.first);
+            filter[bit / 64] |= 1ULL << (bit % 64);
+        }
+        for (size_t i = 0; i < filter.size(); ++i) {
+            hot_filter[i].store(filter[i], memory_order_relaxed);
+        }
+    }
+    
+    // Caller holds cluster_mutex exclusively
+    void coolHotKeys() {
+        unique_lock<shared_mutex> lock(hot_mutex);
+        for (const auto& pair : nodes) {
+            pair.second->closeCopies();
+        }
+        hot_keys.clear();
+        hot_key_count = 0;
+        for (auto& word : hot_filter) {
+            word.store(0, memory_order_relaxed);
+        }
+    }
+    
+    // Decide a transaction met through its intent on key or its record. A
+    // decided one is finished off, a Staging one whose intents all exist
+    // is committed, and one still undecided after TXN_ABANDON_TIMEOUT is
+    // aborted. Returns whether it is decided. Caller holds cluster_mutex
+    bool settleTransaction(uint64_t txn_id, const string& anchor, const string& key) {
+        auto anchor_nodes = hash_ring.getNodes(anchor, replication_factor);
+        TxnRecord record;
+        bool found = nodes.at(anchor_nodes[0])->getTxnRecord(txn_id, record);
+        if (!found) record.keys = {key};
+        
+        bool abandoned = HybridClock::wallMillis() > HybridClock::toMillis(txn_id) + TXN_ABANDON_TIMEOUT.count();
+        if (record.status == TxnStatus::Staging && intentsInPlace(txn_id, record.keys)) {
+            record.status = TxnStatus::Committed;
+            record.status = writeTxnRecord(anchor_nodes, txn_id, record);
+        } else if (!isFinal(record.status) && abandoned) {
+            record.status = TxnStatus::Aborted;
+            record.status = writeTxnRecord(anchor_nodes, txn_id, record);
+        }
+        if (!isFinal(record.status)) return false;
+        
+        // Without the original record the other keys are unknown; the
+        // Aborted record written here stays until repair gets to it
+        finishTransaction(txn_id, anchor, record.keys, record.status == TxnStatus::Committed, found);
+        return true;
+    }
+    
+    // Caller holds cluster_mutex
+    bool intentsInPlace(uint64_t txn_id, const vector<string>& keys) {
+        for (const string& key : keys) {
+            WriteIntent intent;
+            auto replicas = hash_ring.getNodes(key, replication_factor);
+            if (!nodes.at(replicas[0])->getIntent(key, intent) || intent.txn_id != txn_id) return false;
+        }
+        return true;
+    }
+    
+    // Resolve a decided transaction's intents on every replica of its keys,
+    // then drop its record. Caller holds cluster_mutex
+    void finishTransaction(uint64_t txn_id, const string& anchor, const vector<string>& keys,
+                           bool commit, bool forget = true) {
+        unordered_map<string, vector<string>> keys_by_node;
+        for (const string& key : keys) {
+            for (const auto& node_id : hash_ring.getNodes(key, replication_factor)) {
+                keys_by_node[node_id].push_back(key);
+            }
+        }
+        for (const auto& pair : keys_by_node) {
+            nodes.at(pair.first)->resolveIntents(txn_id, pair.second, commit);
+        }
+        if (commit) {
+            for (const string& key : keys) {
+                dropCopies(key);
+            }
+        }
+        if (!forget) return;
+        for (const auto& node_id : hash_ring.getNodes(anchor, replication_factor)) {
+            nodes.at(node_id)->forgetTxnRecord(txn_id);
+        }
+    }
+    
+    void enqueueResolution(Resolution resolution) {
+        lock_guard<mutex> lock(resolver_mutex);
+        resolutions.push_back(move(resolution));
+        if (!resolver_thread.joinable()) {
+            resolver_thread = thread([this]() { runResolver(); });
+        }
+        resolver_cv.notify_one();
+    }
+    
+    void runResolver() {
+        unique_lock<mutex> lock(resolver_mutex);
+        while (true) {
+            resolver_cv.wait(lock, [this]() { return resolver_stopping || !resolutions.empty(); });
+            if (resolutions.empty()) return;
+            lock.unlock();
+            {
+                // Taken before the queue is emptied, so a membership change
+                // never finds a resolution half done
+                shared_lock<shared_mutex> cluster_lock(cluster_mutex);
+                resolvePending();
+            }
+            lock.lock();
+        }
+    }
+    
+    // Caller holds cluster_mutex
+    void resolvePending() {
+        deque<Resolution> pending;
+        {
+            lock_guard<mutex> lock(resolver_mutex);
+            pending.swap(resolutions);
+        }
+        for (const auto& resolution : pending) {
+            bool commit = resolution.commit;
+            if (resolution.mark_committed) {
+                auto anchor_nodes = hash_ring.getNodes(resolution.anchor, replication_factor);
+                TxnRecord record{TxnStatus::Committed, resolution.keys};
+                commit = writeTxnRecord(anchor_nodes, resolution.txn_id, record) == TxnStatus::Committed;
+            }
+            finishTransaction(resolution.txn_id, resolution.anchor, resolution.keys, commit);
         }
-        return "";
     }
     
-    bool remove(const string& key) {
+    bool updateOnPrimary(const string& key,
+                         const function<bool(const VersionedValue*, VersionedValue&)>& compute) {
         shared_lock<shared_mutex> lock(cluster_mutex);
         
         auto responsible_nodes = hash_ring.getNodes(key, replication_factor);
-        bool success = false;
+        if (responsible_nodes.empty()) {
+            throw runtime_error("No nodes available");
+        }
         
-        // Validate we have enough nodes for replication
-        if (responsible_nodes.size() < replication_factor) {
-            cout << "Warning: Only " << responsible_nodes.size() 
-                 << " nodes available for replication (requested " << replication_factor << ")" << endl;
+        VersionedValue result;
+        if (!nodes.at(responsible_nodes[0])->update(key, compute, result)) {
+            return false;
         }
         
-        for (const auto& node_id : responsible_nodes) {
-            auto it = nodes.find(node_id);
+        // Replicas take the primary's result; merge ignores it if they
+        // somehow already hold something newer
+        for (size_t i = 1; i < responsible_nodes.size(); ++i) {
+            auto it = nodes.find(responsible_nodes[i]);
             if (it != nodes.end()) {
-                bool node_success = it->second->remove(key);
-                success |= node_success;
+                it->second->merge(key, result);
             }
         }
-        return success;
-    }
-    
-    void printClusterInfo() {
-        shared_lock<shared_mutex> lock(cluster_mutex);
-        cout << "Cluster has " << nodes.size() << " nodes:" << endl;
-        for (const auto& pair : nodes) {
-            cout << "- Node: " << pair.first << endl;
-        }
+        dropCopies(key);
+        return true;
     }
     
-    void printDistributionStats() {
-        shared_lock<shared_mutex> lock(cluster_mutex);
-        cout << "\n=== Data Distribution Statistics ===" << endl;
+    // Caller holds cluster_mutex exclusively
+    void attachNode(const string& node_id, unique_ptr<KVNode> node) {
+        cout << "\n=== Adding Node: " << node_id << " ===" << endl;
         
-        unordered_map<string, int> key_counts;
-        int total_keys = 0;
+        // Intents are found through the ring, so resolve them before it changes
+        resolvePending();
         
-        for (const auto& pair : nodes) {
-            auto all_data = pair.second->getAllData();
-            key_counts[pair.first] = all_data.size();
-            total_keys += all_data.size();
+        node->setTombstoneGracePeriod(tombstone_grace);
+        node->trackHotKeys(hot_key_tracking);
+        for (const auto& watch : watches) {
+            node->addWatch(watch);
         }
+        nodes[node_id] = move(node);
+        coolHotKeys();
+        startHotKeyRefresh();
         
-        if (total_keys > 0) {
-            for (const auto& pair : key_counts) {
-                double percentage = (double)pair.second / total_keys * 100;
-                cout << "Node " << pair.first << ": " << pair.second 
-                     << " keys (" << fixed << setprecision(1) << percentage << "%)" << endl;
-            }
-        }
-        cout << "Total keys in cluster: " << total_keys << endl;
+        // Store old ring state for redistribution
+        ConsistentHash old_ring = hash_ring;
+        
+        // Add to hash ring
+        hash_ring.addNode(node_id);
+        
+        // Perform smart redistribution
+        redistributeOnAdd(node_id, old_ring);
+        
+        // Set up replication
+        setupReplication();
+        
+        cout << "✓ Node " << node_id << " added successfully with minimal redistribution" << endl;
     }
     
-private:
     void redistributeOnAdd(const string& new_node_id, const ConsistentHash& old_ring) {
         cout << "Performing smart redistribution for new node..." << endl;
         
         int keys_moved = 0;
+        last_redistribution = RedistributionStats{};
         
         // For each existing node, check which keys should move to the new node
         for (const auto& pair : nodes) {
@@ -623,19 +5653,21 @@ private:
                 cout << "  Moving " << keys_to_move.size() << " keys from " 
                      << node_id << " to " << new_node_id << endl;
                 
-                // Move keys to new node
-                nodes[new_node_id]->putBatch(keys_to_move);
+                // Move keys to new node, keeping their versions
+                nodes[new_node_id]->mergeBatch(keys_to_move);
                 
-                // Remove keys from old node
+                // Remove keys from old node, which no longer owns them
                 vector<string> keys_to_remove;
                 for (const auto& kv : keys_to_move) {
                     keys_to_remove.push_back(kv.first);
+                    last_redistribution.bytes_moved += kv.first.size() + kv.second.value.size();
                 }
-                node->removeBatch(keys_to_remove);
+                node->dropBatch(keys_to_remove);
                 
                 keys_moved += keys_to_move.size();
             }
         }
+        last_redistribution.keys_moved = keys_moved;
         
         cout << "✓ Redistribution complete: " << keys_moved << " keys moved" << endl;
     }
@@ -643,8 +5675,9 @@ private:
     void redistributeOnRemove(const string& node_to_remove, const ConsistentHash& old_ring) {
         cout << "Performing smart redistribution for node removal..." << endl;
         
+        last_redistribution = RedistributionStats{};
         auto departing_node = nodes[node_to_remove].get();
-        auto all_data = departing_node->getAllData();
+        auto all_data = departing_node->getAllEntries();
         
         if (all_data.empty()) {
             cout << "  No data to redistribute" << endl;
@@ -653,17 +5686,15 @@ private:
         
         cout << "  Redistributing " << all_data.size() << " keys from " << node_to_remove << endl;
         
-        // Group keys by their new responsible nodes
-        unordered_map<string, unordered_map<string, string>> redistribution_plan;
+        // Group keys by their new responsible nodes, found on the ring
+        // without the departing node
+        unordered_map<string, unordered_map<string, VersionedValue>> redistribution_plan;
+        ConsistentHash temp_ring = old_ring;
+        temp_ring.removeNode(node_to_remove);
         
         for (const auto& pair : all_data) {
             const string& key = pair.first;
-            const string& value = pair.second;
-            
-            // Find which node should be responsible for this key in the new ring
-            // (simulate ring without the departing node)
-            ConsistentHash temp_ring = old_ring;
-            temp_ring.removeNode(node_to_remove);
+            const VersionedValue& value = pair.second;
             string new_responsible = temp_ring.getNode(key);
             
             if (!new_responsible.empty() && nodes.find(new_responsible) != nodes.end()) {
@@ -678,22 +5709,811 @@ private:
             const auto& keys_to_move = plan.second;
             
             cout << "    Moving " << keys_to_move.size() << " keys to " << target_node << endl;
-            nodes[target_node]->putBatch(keys_to_move);
+            nodes[target_node]->mergeBatch(keys_to_move);
             total_moved += keys_to_move.size();
+            for (const auto& kv : keys_to_move) {
+                last_redistribution.bytes_moved += kv.first.size() + kv.second.value.size();
+            }
+        }
+        last_redistribution.keys_moved = total_moved;
+        
+        cout << "✓ Redistribution complete: " << total_moved << " keys redistributed" << endl;
+    }
+    
+    void setupReplication() {
+        // Simple replication setup - each node knows about its replicas
+        for (auto& pair : nodes) {
+            const string& node_id = pair.first;
+            auto replicas = hash_ring.getNodes(node_id, replication_factor);
+            
+            for (const auto& replica_id : replicas) {
+                if (replica_id != node_id) {
+                    pair.second->addReplica(replica_id);
+                }
+            }
+        }
+    }
+};
+
+// Ranks 0..n-1 drawn with probability proportional to 1 / (rank + 1)^theta
+class ZipfDistribution {
+public:
+    ZipfDistribution(size_t n, double theta) : cdf(max<size_t>(1, n)) {
+        double sum = 0;
+        for (size_t i = 0; i < cdf.size(); ++i) {
+            sum += 1.0 / pow(double(i + 1), theta);
+            cdf[i] = sum;
+        }
+        for (double& total : cdf) {
+            total /= sum;
+        }
+    }
+    
+    template <typename Rng>
+    size_t operator()(Rng& rng) const {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        size_t rank = lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+        return min(rank, cdf.size() - 1);
+    }
+    
+private:
+    vector<double> cdf;
+};
+
+// YCSB core workloads: an operation mix over records "user<id>" and how
+// their ids are picked. Thread-safe, so client threads can share one. A scan
+// reads a run of consecutive ids with gets, since the ring keeps no order
+class YcsbWorkload {
+public:
+    enum class Op { Read, Update, Insert, Scan, ReadModifyWrite };
+    enum class Keys { Uniform, Zipfian, Latest };
+    
+    struct Spec {
+        string name;
+        double read = 0, update = 0, insert = 0, scan = 0, read_modify_write = 0;
+        Keys keys = Keys::Zipfian;
+        size_t max_scan_length = 100;
+    };
+    
+    // Workload A to F, or a custom mix given as read:update:insert:scan:rmw
+    // proportions (zipfian keys unless overridden)
+    static Spec spec(const string& name) {
+        string unknown = "Unknown workload " + name + " (expected A-F or read:update:insert:scan:rmw)";
+        if (name.size() == 1) {
+            switch (toupper(name[0])) {
+                case 'A': return Spec{"A", 0.5, 0.5, 0, 0, 0, Keys::Zipfian};
+                case 'B': return Spec{"B", 0.95, 0.05, 0, 0, 0, Keys::Zipfian};
+                case 'C': return Spec{"C", 1.0, 0, 0, 0, 0, Keys::Zipfian};
+                case 'D': return Spec{"D", 0.95, 0, 0.05, 0, 0, Keys::Latest};
+                case 'E': return Spec{"E", 0, 0, 0.05, 0.95, 0, Keys::Zipfian};
+                case 'F': return Spec{"F", 0.5, 0, 0, 0, 0.5, Keys::Zipfian};
+            }
+            throw runtime_error(unknown);
+        }
+        Spec custom{name};
+        double* parts[] = {&custom.read, &custom.update, &custom.insert, &custom.scan, &custom.read_modify_write};
+        stringstream in(name);
+        string part;
+        size_t i = 0;
+        while (getline(in, part, ':')) {
+            if (i == 5) throw runtime_error("Too many proportions in workload " + name);
+            try {
+                *parts[i++] = stod(part);
+            } catch (const logic_error&) {
+                throw runtime_error(unknown);
+            }
+        }
+        if (i == 0 || custom.read + custom.update + custom.insert + custom.scan + custom.read_modify_write <= 0) {
+            throw runtime_error(unknown);
+        }
+        return custom;
+    }
+    
+    static Keys keys(const string& name) {
+        if (name == "uniform") return Keys::Uniform;
+        if (name == "zipfian") return Keys::Zipfian;
+        if (name == "latest") return Keys::Latest;
+        throw runtime_error("Unknown key distribution " + name + " (expected uniform, zipfian or latest)");
+    }
+    
+    static const char* keysName(Keys keys) {
+        switch (keys) {
+            case Keys::Uniform: return "uniform";
+            case Keys::Zipfian: return "zipfian";
+            case Keys::Latest: return "latest";
+        }
+        return "?";
+    }
+    
+    static const char* opName(Op op) {
+        switch (op) {
+            case Op::Read: return "read";
+            case Op::Update: return "update";
+            case Op::Insert: return "insert";
+            case Op::Scan: return "scan";
+            case Op::ReadModifyWrite: return "rmw";
+        }
+        return "?";
+    }
+    
+    // Values are min_value_size to max_value_size bytes, uniformly; equal
+    // bounds give a constant size. Zipfian ranks are drawn with YCSB's
+    // constant 0.99
+    YcsbWorkload(Spec workload_spec, size_t record_count, size_t min_size, size_t max_size)
+        : workload(move(workload_spec)), zipf(record_count, 0.99),
+          min_value_size(min(min_size, max_size)), max_value_size(max(min_size, max_size)),
+          next_record(record_count), records(record_count) {
+        double total = workload.read + workload.update + workload.insert + workload.scan + workload.read_modify_write;
+        double sum = 0;
+        for (double part : {workload.read, workload.update, workload.insert, workload.scan}) {
+            sum += part / total;
+            thresholds.push_back(sum);
+        }
+    }
+    
+    const Spec& spec() const { return workload; }
+    size_t recordCount() const { return records.load(); }
+    
+    static string key(size_t id) { return "user" + to_string(id); }
+    
+    template <typename Rng>
+    string value(Rng& rng) const {
+        size_t size = uniform_int_distribution<size_t>(min_value_size, max_value_size)(rng);
+        return string(size, char('a' + rng() % 26));
+    }
+    
+    // Puts the initial records
+    void load(DistributedKVStore& store) {
+        mt19937_64 rng(7);
+        for (size_t id = 0; id < records.load(); ++id) {
+            store.put(key(id), value(rng));
+        }
+    }
+    
+    template <typename Rng>
+    Op nextOp(Rng& rng) const {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        size_t i = 0;
+        while (i < thresholds.size() && u >= thresholds[i]) ++i;
+        return Op(i);
+    }
+    
+    // Runs one operation against the store and returns its type
+    template <typename Rng>
+    Op run(DistributedKVStore& store, Rng& rng) {
+        Op op = nextOp(rng);
+        switch (op) {
+            case Op::Read:
+                store.get(key(nextId(rng)));
+                break;
+            case Op::Update:
+                store.put(key(nextId(rng)), value(rng));
+                break;
+            case Op::Insert: {
+                size_t id = next_record.fetch_add(1);
+                store.put(key(id), value(rng));
+                records.fetch_add(1);
+                break;
+            }
+            case Op::Scan: {
+                size_t start = nextId(rng);
+                size_t length = 1 + rng() % workload.max_scan_length;
+                size_t end = min(start + length, records.load());
+                for (size_t id = start; id < end; ++id) {
+                    store.get(key(id));
+                }
+                break;
+            }
+            case Op::ReadModifyWrite: {
+                string id_key = key(nextId(rng));
+                optional<SharedValue> current = store.get(id_key);
+                string updated = current ? current->str() : value(rng);
+                if (!updated.empty()) updated[0] = char('a' + rng() % 26);
+                store.put(id_key, move(updated));
+                break;
+            }
+        }
+        return op;
+    }
+    
+private:
+    // An id among the records inserted so far
+    template <typename Rng>
+    size_t nextId(Rng& rng) const {
+        size_t count = max<size_t>(1, records.load());
+        switch (workload.keys) {
+            case Keys::Uniform: return rng() % count;
+            case Keys::Zipfian: return zipf(rng) % count;
+            case Keys::Latest: return count - 1 - zipf(rng) % count;
+        }
+        return 0;
+    }
+    
+    Spec workload;
+    ZipfDistribution zipf;
+    size_t min_value_size, max_value_size;
+    vector<double> thresholds;     // Cumulative proportions of all but RMW
+    atomic<size_t> next_record;    // Next id to insert
+    atomic<size_t> records;        // Inserts completed
+};
+
+// Drives a YcsbWorkload from several client threads. In a closed loop each
+// thread issues its next operation as soon as the last one returns. In an
+// open loop operations arrive on a fixed schedule, and latency is measured
+// from each one's scheduled start: a stall then also counts against every
+// operation queued behind it, instead of hiding them (coordinated omission).
+// Operations still waiting at the deadline count with the time they waited
+class LoadDriver {
+public:
+    struct Result {
+        double offered = 0;            // Operations/sec scheduled, 0 for a closed loop
+        double throughput = 0;         // Operations/sec completed
+        uint64_t operations = 0;
+        uint64_t behind = 0;           // Scheduled but not yet issued at the deadline
+        LatencyHistogram latency;      // ns from the scheduled start, to the deadline for those behind
+        LatencyHistogram service_time; // ns from the actual start
+    };
+    
+    static Result closedLoop(DistributedKVStore& store, YcsbWorkload& workload, int num_threads,
+                             chrono::milliseconds duration) {
+        return drive(store, workload, num_threads, 0, duration);
+    }
+    
+    static Result openLoop(DistributedKVStore& store, YcsbWorkload& workload, int num_threads,
+                           double ops_per_sec, chrono::milliseconds duration) {
+        return drive(store, workload, num_threads, ops_per_sec, duration);
+    }
+    
+private:
+    using Clock = chrono::steady_clock;
+    
+    struct ThreadResult {
+        uint64_t operations = 0, behind = 0;
+        LatencyHistogram latency, service_time;
+    };
+    
+    static uint64_t nanos(Clock::duration elapsed) {
+        return chrono::duration_cast<chrono::nanoseconds>(elapsed).count();
+    }
+    
+    // ops_per_sec = 0 runs a closed loop. In an open loop each thread takes
+    // an equal share of the rate, its schedule offset so arrivals interleave
+    static Result drive(DistributedKVStore& store, YcsbWorkload& workload, int num_threads,
+                        double ops_per_sec, chrono::milliseconds duration) {
+        num_threads = max(1, num_threads);
+        vector<ThreadResult> results(num_threads);
+        auto start = Clock::now() + chrono::milliseconds(10);
+        auto deadline = start + duration;
+        
+        vector<thread> clients;
+        for (int t = 0; t < num_threads; ++t) {
+            clients.emplace_back([&, t]() {
+                mt19937_64 rng(1000 + t);
+                ThreadResult& result = results[t];
+                chrono::duration<double> interval(ops_per_sec > 0 ? num_threads / ops_per_sec : 0);
+                auto next = start + chrono::duration_cast<Clock::duration>(interval * (double(t) / num_threads));
+                this_thread::sleep_until(start);
+                
+                while (true) {
+                    auto now = Clock::now();
+                    if (ops_per_sec > 0) {
+                        if (next >= deadline) break;
+                        if (now >= deadline) {
+                            // Their wait up to now is as much a part of the
+                            // tail as any completed operation's
+                            for (; next < deadline; next += chrono::duration_cast<Clock::duration>(interval)) {
+                                ++result.behind;
+                                result.latency.record(nanos(deadline - next));
+                            }
+                            break;
+                        }
+                        // Sleep most of the way, then yield until the slot
+                        if (next - now > chrono::microseconds(200)) {
+                            this_thread::sleep_until(next - chrono::microseconds(100));
+                        }
+                        while ((now = Clock::now()) < next) {
+                            this_thread::yield();
+                        }
+                    } else if (now >= deadline) {
+                        break;
+                    }
+                    
+                    workload.run(store, rng);
+                    auto done = Clock::now();
+                    ++result.operations;
+                    result.service_time.record(nanos(done - now));
+                    result.latency.record(nanos(done - (ops_per_sec > 0 ? next : now)));
+                    next += chrono::duration_cast<Clock::duration>(interval);
+                }
+            });
+        }
+        for (auto& client : clients) {
+            client.join();
+        }
+        
+        Result total;
+        total.offered = ops_per_sec;
+        for (auto& result : results) {
+            total.operations += result.operations;
+            total.behind += result.behind;
+            total.latency.merge(result.latency);
+            total.service_time.merge(result.service_time);
+        }
+        total.throughput = total.operations / chrono::duration<double>(duration).count();
+        return total;
+    }
+};
+
+// Results of --bench runs in machine-readable form. Each benchmark adds a
+// row per case it measures; rows added again by --repeat gather their
+// values as samples. compare() checks a run against a baseline, judging
+// each change against the noise the repeated samples show
+class BenchmarkReport {
+public:
+    enum class Better { Higher, Lower };
+    
+    struct Metric {
+        string name;
+        double value;
+        Better better = Better::Higher;
+    };
+    
+    static BenchmarkReport& shared() {
+        static BenchmarkReport report;
+        return report;
+    }
+    
+    void add(const string& benchmark, const string& name, const vector<pair<string, string>>& config,
+             const vector<Metric>& metrics) {
+        auto row = find_if(rows.begin(), rows.end(), [&](const Row& row) {
+            return row.benchmark == benchmark && row.name == name && row.config == config;
+        });
+        if (row == rows.end()) {
+            rows.push_back(Row{benchmark, name, config, {}});
+            row = rows.end() - 1;
+        }
+        for (const Metric& metric : metrics) {
+            auto series = find_if(row->metrics.begin(), row->metrics.end(),
+                                  [&](const Series& series) { return series.name == metric.name; });
+            if (series == row->metrics.end()) {
+                row->metrics.push_back(Series{metric.name, metric.better, {}});
+                series = row->metrics.end() - 1;
+            }
+            series->samples.push_back(metric.value);
+        }
+    }
+    
+    // p50/p90/p99/p99.9/max of a nanosecond histogram, in microseconds
+    static void addLatency(vector<Metric>& metrics, const string& prefix, const LatencyHistogram& histogram) {
+        for (double p : {50.0, 90.0, 99.0, 99.9}) {
+            string label = p == 99.9 ? "p99.9" : "p" + to_string(int(p));
+            metrics.push_back({prefix + label + "_us", histogram.valueAtPercentile(p) / 1000.0, Better::Lower});
+        }
+        metrics.push_back({prefix + "max_us", histogram.maxValue() / 1000.0, Better::Lower});
+    }
+    
+    bool empty() const { return rows.empty(); }
+    
+    // format is "json" or "csv"; empty picks by the file's extension
+    void write(const string& path, string format) const {
+        if (format.empty()) {
+            format = path.size() > 4 && path.compare(path.size() - 4, 4, ".csv") == 0 ? "csv" : "json";
+        }
+        if (format != "json" && format != "csv") {
+            throw runtime_error("Unknown output format " + format + " (expected json or csv)");
+        }
+        ofstream file;
+        if (path != "-") {
+            file.open(path, ios::trunc);
+            if (!file) throw runtime_error("Cannot write " + path);
+        }
+        ostream& out = path == "-" ? cout : file;
+        if (format == "csv") {
+            writeCsv(out);
+        } else {
+            writeJson(out);
+        }
+    }
+    
+    void writeJson(ostream& out) const {
+        out << "{\n  \"environment\": {";
+        auto env = environment();
+        for (size_t i = 0; i < env.size(); ++i) {
+            out << (i ? ", " : "") << jsonString(env[i].first) << ": " << jsonString(env[i].second);
+        }
+        out << "},\n  \"results\": [";
+        for (size_t r = 0; r < rows.size(); ++r) {
+            const Row& row = rows[r];
+            out << (r ? ",\n" : "\n") << "    {\"benchmark\": " << jsonString(row.benchmark)
+                << ", \"case\": " << jsonString(row.name) << ", \"config\": {";
+            for (size_t i = 0; i < row.config.size(); ++i) {
+                out << (i ? ", " : "") << jsonString(row.config[i].first) << ": " << jsonString(row.config[i].second);
+            }
+            out << "},\n     \"metrics\": [";
+            for (size_t m = 0; m < row.metrics.size(); ++m) {
+                const Series& series = row.metrics[m];
+                out << (m ? ",\n" : "\n") << "       {\"name\": " << jsonString(series.name)
+                    << ", \"better\": \"" << (series.better == Better::Higher ? "higher" : "lower")
+                    << "\", \"mean\": " << number(series.mean()) << ", \"stddev\": " << number(series.stddev())
+                    << ", \"samples\": [";
+                for (size_t i = 0; i < series.samples.size(); ++i) {
+                    out << (i ? ", " : "") << number(series.samples[i]);
+                }
+                out << "]}";
+            }
+            out << "]}";
+        }
+        out << "\n  ]\n}\n";
+    }
+    
+    // One line per metric. The environment comes first as # comment lines
+    void writeCsv(ostream& out) const {
+        for (const auto& pair : environment()) {
+            out << "# " << pair.first << ": " << pair.second << "\n";
+        }
+        out << "benchmark,case,config,metric,better,runs,mean,stddev,samples\n";
+        for (const Row& row : rows) {
+            string config;
+            for (const auto& pair : row.config) {
+                config += (config.empty() ? "" : ";") + pair.first + "=" + pair.second;
+            }
+            for (const Series& series : row.metrics) {
+                string samples;
+                for (double sample : series.samples) {
+                    samples += (samples.empty() ? "" : ";") + number(sample);
+                }
+                out << csvField(row.benchmark) << "," << csvField(row.name) << "," << csvField(config) << ","
+                    << csvField(series.name) << "," << (series.better == Better::Higher ? "higher" : "lower") << ","
+                    << series.samples.size() << "," << number(series.mean()) << "," << number(series.stddev())
+                    << "," << csvField(samples) << "\n";
+            }
+        }
+    }
+    
+    // Diffs current against baseline, metric by metric. A change counts
+    // when it goes past floor_pct or three standard errors of the
+    // difference of the two means, whichever is larger, so more repeats
+    // give a tighter threshold. Returns false if any metric regressed or
+    // is missing from current, as a crashed or renamed benchmark would be
+    static bool compare(const string& baseline_path, const string& current_path, double floor_pct = 5.0) {
+        BenchmarkReport baseline = read(baseline_path), current = read(current_path);
+        cout << "\n=== Comparing " << current_path << " against " << baseline_path << " ===" << endl;
+        cout << left << setw(40) << "benchmark/case/metric" << right << setw(14) << "baseline" << setw(14) << "current"
+             << setw(10) << "change" << setw(11) << "threshold" << endl;
+        
+        size_t regressions = 0, improvements = 0, unmatched = 0;
+        for (const Row& row : current.rows) {
+            for (const Series& series : row.metrics) {
+                const Series* before = baseline.find(row, series.name);
+                string label = row.benchmark + "/" + row.name + "/" + series.name;
+                if (!before || before->mean() == 0) {
+                    ++unmatched;
+                    continue;
+                }
+                double change = (series.mean() - before->mean()) / fabs(before->mean()) * 100;
+                double noise = sqrt(before->squaredError() + series.squaredError()) / fabs(before->mean()) * 100;
+                double threshold = max(floor_pct, 3 * noise);
+                double worse = series.better == Better::Higher ? -change : change;
+                string verdict = "";
+                if (worse > threshold) {
+                    verdict = "  ✗ regression";
+                    ++regressions;
+                } else if (-worse > threshold) {
+                    verdict = "  improved";
+                    ++improvements;
+                }
+                cout << left << setw(40) << label << right << fixed << setprecision(2)
+                     << setw(14) << before->mean() << setw(14) << series.mean()
+                     << setw(9) << setprecision(1) << showpos << change << "%" << noshowpos
+                     << setw(10) << threshold << "%" << verdict << endl;
+            }
+        }
+        
+        size_t missing = 0;
+        for (const Row& row : baseline.rows) {
+            for (const Series& series : row.metrics) {
+                if (current.find(row, series.name)) continue;
+                cout << left << setw(40) << row.benchmark + "/" + row.name + "/" + series.name << right << fixed
+                     << setprecision(2) << setw(14) << series.mean() << setw(14) << "-" << "  ✗ missing" << endl;
+                ++missing;
+            }
+        }
+        cout << regressions << " regressions, " << improvements << " improvements";
+        if (missing) cout << ", " << missing << " metrics missing";
+        if (unmatched) cout << ", " << unmatched << " metrics not in the baseline";
+        cout << endl;
+        return regressions == 0 && missing == 0;
+    }
+    
+private:
+    struct Series {
+        string name;
+        Better better;
+        vector<double> samples;
+        
+        double mean() const {
+            double sum = 0;
+            for (double sample : samples) sum += sample;
+            return samples.empty() ? 0 : sum / samples.size();
+        }
+        
+        double stddev() const {
+            if (samples.size() < 2) return 0;
+            double average = mean(), sum = 0;
+            for (double sample : samples) sum += (sample - average) * (sample - average);
+            return sqrt(sum / (samples.size() - 1));
+        }
+        
+        // Squared standard error of the mean, 0 for a single sample
+        double squaredError() const {
+            return samples.empty() ? 0 : stddev() * stddev() / samples.size();
+        }
+    };
+    
+    struct Row {
+        string benchmark, name;
+        vector<pair<string, string>> config;
+        vector<Series> metrics;
+    };
+    
+    vector<Row> rows;
+    
+    const Series* find(const Row& like, const string& metric) const {
+        for (const Row& row : rows) {
+            if (row.benchmark != like.benchmark || row.name != like.name || row.config != like.config) continue;
+            for (const Series& series : row.metrics) {
+                if (series.name == metric) return &series;
+            }
+        }
+        return nullptr;
+    }
+    
+    static vector<pair<string, string>> environment() {
+        vector<pair<string, string>> env;
+        string cpu = "unknown", line;
+        ifstream cpuinfo("/proc/cpuinfo");
+        while (getline(cpuinfo, line)) {
+            if (line.compare(0, 10, "model name") == 0 && line.find(':') != string::npos) {
+                cpu = line.substr(line.find(':') + 2);
+                break;
+            }
+        }
+        env.push_back({"cpu", cpu});
+        env.push_back({"cores", to_string(thread::hardware_concurrency())});
+        struct utsname host;
+        env.push_back({"os", uname(&host) == 0 ? string(host.sysname) + " " + host.release : "unknown"});
+#if defined(__clang__)
+        env.push_back({"compiler", "clang " __clang_version__});
+#elif defined(__GNUC__)
+        env.push_back({"compiler", "gcc " __VERSION__});
+#else
+        env.push_back({"compiler", "unknown"});
+#endif
+        // Pass -DKVSTORE_BUILD_FLAGS='"..."' to record the exact flags
+#ifdef KVSTORE_BUILD_FLAGS
+        env.push_back({"flags", KVSTORE_BUILD_FLAGS});
+#else
+        string flags;
+#ifdef __OPTIMIZE__
+        flags += "optimized ";
+#endif
+#ifdef NDEBUG
+        flags += "-DNDEBUG ";
+#endif
+#ifdef DEBUG
+        flags += "-DDEBUG ";
+#endif
+#ifdef KVSTORE_COUNT_ALLOCATIONS
+        flags += "-DKVSTORE_COUNT_ALLOCATIONS ";
+#endif
+        env.push_back({"flags", flags.empty() ? "unoptimized" : flags.substr(0, flags.size() - 1)});
+#endif
+        env.push_back({"wal_io", WalIoBackend::shared().name()});
+        time_t now = time(nullptr);
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+        env.push_back({"time", stamp});
+        return env;
+    }
+    
+    static string number(double value) {
+        char text[32];
+        snprintf(text, sizeof(text), "%.10g", value);
+        return text;
+    }
+    
+    static string jsonString(const string& text) {
+        string out = "\"";
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if ((unsigned char)c < 0x20) {
+                char escape[8];
+                snprintf(escape, sizeof(escape), "\\u%04x", c);
+                out += escape;
+            } else {
+                out += c;
+            }
+        }
+        return out + "\"";
+    }
+    
+    static string csvField(const string& text) {
+        if (text.find_first_of(",\"\n") == string::npos) return text;
+        string out = "\"";
+        for (char c : text) {
+            out += c;
+            if (c == '"') out += '"';
+        }
+        return out + "\"";
+    }
+    
+    // Reads a file written by write(), in either format
+    static BenchmarkReport read(const string& path) {
+        ifstream file(path);
+        if (!file) throw runtime_error("Cannot read " + path);
+        string text((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        size_t first = text.find_first_not_of(" \t\r\n");
+        BenchmarkReport report;
+        if (first != string::npos && text[first] == '{') {
+            report.readJson(text);
+        } else {
+            report.readCsv(text);
+        }
+        return report;
+    }
+    
+    void readCsv(const string& text) {
+        stringstream in(text);
+        string line;
+        bool header = true;
+        while (getline(in, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            if (header) {
+                header = false;
+                continue;
+            }
+            vector<string> fields;
+            string field;
+            bool quoted_field = false;
+            for (size_t i = 0; i < line.size(); ++i) {
+                char c = line[i];
+                if (quoted_field) {
+                    if (c == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+                        field += '"';
+                        ++i;
+                    } else if (c == '"') {
+                        quoted_field = false;
+                    } else {
+                        field += c;
+                    }
+                } else if (c == '"') {
+                    quoted_field = true;
+                } else if (c == ',') {
+                    fields.push_back(move(field));
+                    field.clear();
+                } else if (c != '\r') {
+                    field += c;
+                }
+            }
+            fields.push_back(move(field));
+            if (fields.size() < 9) throw runtime_error("Malformed benchmark CSV line: " + line);
+            
+            vector<pair<string, string>> config;
+            stringstream pairs(fields[2]);
+            string pair;
+            while (getline(pairs, pair, ';')) {
+                size_t equals = pair.find('=');
+                config.push_back({pair.substr(0, equals), equals == string::npos ? "" : pair.substr(equals + 1)});
+            }
+            Better better = fields[4] == "lower" ? Better::Lower : Better::Higher;
+            stringstream samples(fields[8]);
+            string sample;
+            while (getline(samples, sample, ';')) {
+                add(fields[0], fields[1], config, {{fields[3], stod(sample), better}});
+            }
+        }
+    }
+    
+    // Just enough JSON for what writeJson produces: objects, arrays,
+    // strings and numbers
+    struct Json {
+        enum class Type { Null, Number, String, Array, Object } type = Type::Null;
+        double number = 0;
+        string text;
+        vector<Json> items;
+        vector<pair<string, Json>> fields;
+        
+        const Json& operator[](const string& key) const {
+            static const Json missing;
+            for (const auto& field : fields) {
+                if (field.first == key) return field.second;
+            }
+            return missing;
+        }
+    };
+    
+    static Json parseJson(const string& text, size_t& pos) {
+        auto skip = [&]() {
+            while (pos < text.size() && isspace((unsigned char)text[pos])) ++pos;
+        };
+        auto fail = [&]() -> Json {
+            throw runtime_error("Malformed benchmark JSON at offset " + to_string(pos));
+        };
+        skip();
+        if (pos >= text.size()) return fail();
+        Json value;
+        char c = text[pos];
+        if (c == '{' || c == '[') {
+            bool object = c == '{';
+            value.type = object ? Json::Type::Object : Json::Type::Array;
+            ++pos;
+            skip();
+            if (pos < text.size() && text[pos] == (object ? '}' : ']')) {
+                ++pos;
+                return value;
+            }
+            while (true) {
+                if (object) {
+                    Json key = parseJson(text, pos);
+                    skip();
+                    if (key.type != Json::Type::String || pos >= text.size() || text[pos] != ':') return fail();
+                    ++pos;
+                    value.fields.push_back({key.text, parseJson(text, pos)});
+                } else {
+                    value.items.push_back(parseJson(text, pos));
+                }
+                skip();
+                if (pos < text.size() && text[pos] == ',') {
+                    ++pos;
+                } else if (pos < text.size() && text[pos] == (object ? '}' : ']')) {
+                    ++pos;
+                    return value;
+                } else {
+                    return fail();
+                }
+            }
+        }
+        if (c == '"') {
+            value.type = Json::Type::String;
+            for (++pos; pos < text.size() && text[pos] != '"'; ++pos) {
+                if (text[pos] == '\\' && pos + 1 < text.size()) {
+                    ++pos;
+                    if (text[pos] == 'u' && pos + 4 < text.size()) {
+                        value.text += char(stoi(text.substr(pos + 1, 4), nullptr, 16));
+                        pos += 4;
+                        continue;
+                    }
+                }
+                value.text += text[pos];
+            }
+            if (pos >= text.size()) return fail();
+            ++pos;
+            return value;
         }
-        
-        cout << "✓ Redistribution complete: " << total_moved << " keys redistributed" << endl;
+        size_t end = text.find_first_of(",]} \t\r\n", pos);
+        string token = text.substr(pos, end - pos);
+        pos = end == string::npos ? text.size() : end;
+        if (token == "null" || token == "true" || token == "false") return value;
+        value.type = Json::Type::Number;
+        value.number = stod(token);
+        return value;
     }
     
-    void setupReplication() {
-        // Simple replication setup - each node knows about its replicas
-        for (auto& pair : nodes) {
-            const string& node_id = pair.first;
-            auto replicas = hash_ring.getNodes(node_id, replication_factor);
-            
-            for (const auto& replica_id : replicas) {
-                if (replica_id != node_id) {
-                    pair.second->addReplica(replica_id);
+    void readJson(const string& text) {
+        size_t pos = 0;
+        Json root = parseJson(text, pos);
+        for (const Json& result : root["results"].items) {
+            vector<pair<string, string>> config;
+            for (const auto& field : result["config"].fields) {
+                config.push_back({field.first, field.second.text});
+            }
+            for (const Json& metric : result["metrics"].items) {
+                Better better = metric["better"].text == "lower" ? Better::Lower : Better::Higher;
+                for (const Json& sample : metric["samples"].items) {
+                    add(result["benchmark"].text, result["case"].text, config,
+                        {{metric["name"].text, sample.number, better}});
                 }
             }
         }
@@ -703,16 +6523,42 @@ private:
 // Performance benchmarking
 class Benchmark {
 public:
+    // Percentiles of nanosecond histograms, in microseconds
+    static void printLatencyHeader() {
+        cout << left << setw(12) << "latency us" << right << setw(10) << "count" << setw(10) << "p50"
+             << setw(10) << "p90" << setw(10) << "p99" << setw(10) << "p99.9" << setw(10) << "max" << endl;
+    }
+    
+    static void printLatency(const string& label, const LatencyHistogram& histogram) {
+        cout << left << setw(12) << label << right << setw(10) << histogram.count() << fixed << setprecision(1);
+        for (double p : {50.0, 90.0, 99.0, 99.9}) {
+            cout << setw(10) << histogram.valueAtPercentile(p) / 1000.0;
+        }
+        cout << setw(10) << histogram.maxValue() / 1000.0 << endl;
+    }
+    
+    // The store's own metrics that have recorded anything
+    static void printStoreLatencies() {
+        printLatencyHeader();
+        for (LatencyRecorder* recorder : StoreLatency::all()) {
+            LatencyHistogram histogram = recorder->snapshot();
+            if (histogram.count() > 0) printLatency(recorder->name(), histogram);
+        }
+    }
+    
     static void runBenchmark(DistributedKVStore& store, int num_operations = 10000) {
         cout << "\n=== Running Benchmark ===" << endl;
         
+        LatencyHistogram write_latency, read_latency;
         auto start = chrono::high_resolution_clock::now();
         
         // Write benchmark
         for (int i = 0; i < num_operations; ++i) {
             string key = "key" + to_string(i);
             string value = "value" + to_string(i);
-            store.put(key, value);
+            auto op_start = chrono::steady_clock::now();
+            store.put(key, move(value));
+            write_latency.record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - op_start).count());
         }
         
         auto write_end = chrono::high_resolution_clock::now();
@@ -722,7 +6568,9 @@ public:
         // Read benchmark
         for (int i = 0; i < num_operations; ++i) {
             string key = "key" + to_string(i);
+            auto op_start = chrono::steady_clock::now();
             store.get(key);
+            read_latency.record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - op_start).count());
         }
         
         auto read_end = chrono::high_resolution_clock::now();
@@ -749,21 +6597,1039 @@ public:
         if (write_duration_ms.count() == 0 || read_duration_ms.count() == 0) {
             cout << "[Warning] Benchmark completed too quickly for accurate timing. Increase num_operations for more reliable results." << endl;
         }
+        printLatencyHeader();
+        printLatency("write", write_latency);
+        printLatency("read", read_latency);
+    }
+    
+    // A YCSB workload on a fresh in-memory cluster: load record_count
+    // records, run a tenth of num_operations as untimed warm-up, then time
+    // num_operations. keys overrides the workload's key distribution
+    static void runYcsbBenchmark(const string& workload_name, size_t record_count = 100000, int num_operations = 200000,
+                                 size_t min_value_size = 100, size_t max_value_size = 100, const string& keys = "") {
+        YcsbWorkload::Spec spec = YcsbWorkload::spec(workload_name);
+        if (!keys.empty()) spec.keys = YcsbWorkload::keys(keys);
+        cout << "\n=== Running YCSB Workload " << spec.name << " ===" << endl;
+        
+        DistributedKVStore store(3, Durability::None);
+        store.addNodes({"bench_ycsb_node1", "bench_ycsb_node2", "bench_ycsb_node3"});
+        YcsbWorkload workload(spec, record_count, min_value_size, max_value_size);
+        
+        auto start = chrono::high_resolution_clock::now();
+        workload.load(store);
+        auto load_us = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start);
+        
+        mt19937_64 rng(42);
+        for (int i = 0; i < num_operations / 10; ++i) {
+            workload.run(store, rng);
+        }
+        
+        // Per operation type, and the store's own metrics for the run
+        array<LatencyHistogram, 5> latencies;
+        StoreLatency::reset();
+        start = chrono::high_resolution_clock::now();
+        for (int i = 0; i < num_operations; ++i) {
+            auto op_start = chrono::steady_clock::now();
+            YcsbWorkload::Op op = workload.run(store, rng);
+            latencies[size_t(op)].record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - op_start).count());
+        }
+        auto run_us = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start);
+        
+        double total = spec.read + spec.update + spec.insert + spec.scan + spec.read_modify_write;
+        cout << "Mix:" << fixed << setprecision(0);
+        double parts[] = {spec.read, spec.update, spec.insert, spec.scan, spec.read_modify_write};
+        for (size_t op = 0; op < latencies.size(); ++op) {
+            if (parts[op] > 0) cout << " " << YcsbWorkload::opName(YcsbWorkload::Op(op)) << " " << parts[op] * 100 / total << "%";
+        }
+        cout << "; " << YcsbWorkload::keysName(spec.keys) << " keys, " << min_value_size;
+        if (max_value_size != min_value_size) cout << "-" << max_value_size;
+        cout << " byte values" << endl;
+        cout << "Load: " << record_count << " records at "
+             << record_count / (max<long long>(1, load_us.count()) / 1e6) << " puts/sec" << endl;
+        cout << "Run:  " << num_operations << " operations at "
+             << num_operations / (max<long long>(1, run_us.count()) / 1e6) << " ops/sec ("
+             << num_operations / 10 << " warm-up operations first)" << endl;
+        printLatencyHeader();
+        vector<BenchmarkReport::Metric> metrics{{"load_puts_per_sec", record_count * 1e6 / max<long long>(1, load_us.count())},
+                                                {"ops_per_sec", num_operations * 1e6 / max<long long>(1, run_us.count())}};
+        for (size_t op = 0; op < latencies.size(); ++op) {
+            if (latencies[op].count() == 0) continue;
+            string name = YcsbWorkload::opName(YcsbWorkload::Op(op));
+            printLatency(name, latencies[op]);
+            BenchmarkReport::addLatency(metrics, name + "_", latencies[op]);
+        }
+        report("ycsb", spec.name, {{"records", to_string(record_count)}, {"operations", to_string(num_operations)},
+                                   {"value_bytes", to_string(min_value_size) + "-" + to_string(max_value_size)},
+                                   {"keys", YcsbWorkload::keysName(spec.keys)}}, metrics);
+        cout << "Store instrumentation:" << endl;
+        printStoreLatencies();
+    }
+    
+    // Finds the saturation knee for a YCSB workload: a closed loop of
+    // num_threads clients gives the peak throughput, then open loops offer
+    // fractions of it. Past the knee throughput stops following the offered
+    // load and latency from the scheduled start climbs, while service time
+    // alone (what a closed loop sees) barely moves
+    static void runLoadBenchmark(const string& workload_name = "A", int num_threads = 8,
+                                 int step_ms = 2000, size_t record_count = 100000) {
+        YcsbWorkload::Spec spec = YcsbWorkload::spec(workload_name);
+        cout << "\n=== Running Load Benchmark (workload " << spec.name << ", "
+             << num_threads << " client threads) ===" << endl;
+        
+        DistributedKVStore store(3, Durability::None);
+        store.addNodes({"bench_load_node1", "bench_load_node2", "bench_load_node3"});
+        YcsbWorkload workload(spec, record_count, 100, 100);
+        workload.load(store);
+        LoadDriver::closedLoop(store, workload, num_threads, chrono::milliseconds(step_ms / 4));
+        
+        auto print = [&](const string& mode, const LoadDriver::Result& result) {
+            cout << left << setw(14) << mode << right << fixed << setprecision(0)
+                 << setw(10) << (result.offered > 0 ? to_string(llround(result.offered)) : "-") << setw(10) << result.throughput
+                 << setprecision(1)
+                 << setw(10) << result.latency.valueAtPercentile(50) / 1000.0
+                 << setw(10) << result.latency.valueAtPercentile(99) / 1000.0
+                 << setw(10) << result.latency.valueAtPercentile(99.9) / 1000.0
+                 << setw(10) << result.service_time.valueAtPercentile(99) / 1000.0
+                 << setw(10) << result.behind << endl;
+            vector<BenchmarkReport::Metric> metrics{{"ops_per_sec", result.throughput}};
+            BenchmarkReport::addLatency(metrics, "", result.latency);
+            metrics.push_back({"service_p99_us", result.service_time.valueAtPercentile(99) / 1000.0, Better::Lower});
+            metrics.push_back({"behind", double(result.behind), Better::Lower});
+            report("load", mode, {{"workload", spec.name}, {"threads", to_string(num_threads)}, {"step_ms", to_string(step_ms)}},
+                   metrics);
+        };
+        cout << left << setw(14) << "mode" << right << setw(10) << "offered" << setw(10) << "ops/sec"
+             << setw(10) << "p50 us" << setw(10) << "p99 us" << setw(10) << "p99.9 us" << setw(10) << "svc p99"
+             << setw(10) << "behind" << endl;
+        
+        auto closed = LoadDriver::closedLoop(store, workload, num_threads, chrono::milliseconds(step_ms));
+        print("closed loop", closed);
+        for (double fraction : {0.25, 0.5, 0.75, 0.9, 1.0, 1.1, 1.25}) {
+            auto open = LoadDriver::openLoop(store, workload, num_threads, closed.throughput * fraction,
+                                             chrono::milliseconds(step_ms));
+            print("open " + to_string(int(fraction * 100)) + "%", open);
+        }
+    }
+    
+    // Loads num_keys records onto four nodes, then adds a fifth and removes
+    // one of the four, for each replication factor and placement (the ring
+    // at 16, 100 and 400 virtual nodes, and rendezvous). Redistribution
+    // moves keys to their new primaries only, so each change is followed by
+    // a repair that copies what the other replicas lack. For each change it
+    // reports the entries the two copied against the ideal (the RF * K / N
+    // entries the joining or departing node holds), the keys left short of
+    // replicas before the repair, wall times, peak RSS, and the p99 and max
+    // latency of client threads running workload B before and during it
+    static void runScalingBenchmark(size_t num_keys = 1000000, size_t value_bytes = 100, int num_clients = 2) {
+        cout << "\n=== Running Scaling Benchmark ===" << endl;
+        
+        struct Setup {
+            Placement placement;
+            int virtual_nodes;
+        };
+        const size_t initial_nodes = 4;
+        vector<string> rows;
+        
+        for (int rf : {1, 3}) {
+            for (Setup setup : {Setup{Placement::Ring, 16}, Setup{Placement::Ring, 100}, Setup{Placement::Ring, 400},
+                                Setup{Placement::Rendezvous, 0}}) {
+                string placement = setup.placement == Placement::Ring
+                    ? "ring/" + to_string(setup.virtual_nodes) : string("rendezvous");
+                resetPeakRss();
+                
+                DistributedKVStore store(rf, Durability::None);
+                store.setPlacement(setup.placement, max(1, setup.virtual_nodes));
+                vector<string> node_ids;
+                for (size_t i = 1; i <= initial_nodes + 1; ++i) {
+                    node_ids.push_back("bench_scale_node" + to_string(i));
+                }
+                store.addNodes(vector<string>(node_ids.begin(), node_ids.begin() + initial_nodes));
+                YcsbWorkload workload(YcsbWorkload::spec("B"), num_keys, value_bytes, value_bytes);
+                workload.load(store);
+                
+                auto steady = measureDuring(store, workload, num_clients, []() {
+                    this_thread::sleep_for(chrono::milliseconds(300));
+                });
+                
+                for (bool adding : {true, false}) {
+                    resetPeakRss();
+                    auto change = measureDuring(store, workload, num_clients, [&]() {
+                        if (adding) {
+                            store.addNode(node_ids.back());
+                        } else {
+                            store.removeNode(node_ids.front());
+                        }
+                    });
+                    auto moved = store.lastRedistribution();
+                    // Both changes are to or from five nodes
+                    size_t nodes_holding = initial_nodes + 1;
+                    double ideal = double(num_keys) * min<size_t>(rf, nodes_holding) / nodes_holding;
+                    
+                    // Sample up to 100,000 keys for ones short of replicas
+                    size_t stride = max<size_t>(1, num_keys / 100000), sampled = 0, short_keys = 0;
+                    for (size_t id = 0; id < num_keys; id += stride, ++sampled) {
+                        if (store.missingReplicas(YcsbWorkload::key(id)) > 0) ++short_keys;
+                    }
+                    double short_pct = 100.0 * short_keys / max<size_t>(1, sampled);
+                    
+                    auto repair_start = chrono::steady_clock::now();
+                    auto repaired = store.repairReplicas();
+                    double repair_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - repair_start).count();
+                    double copies = moved.keys_moved + repaired.keys_moved;
+                    double mb = (moved.bytes_moved + repaired.bytes_moved) / (1024.0 * 1024.0);
+                    double rss_mb = peakRssMb();
+                    
+                    ostringstream row;
+                    row << left << setw(12) << placement << right << setw(3) << rf << setw(8) << (adding ? "add" : "remove")
+                        << setw(10) << moved.keys_moved << setw(10) << repaired.keys_moved << setw(10) << size_t(ideal)
+                        << fixed << setprecision(2) << setw(7) << copies / ideal << setprecision(1)
+                        << setw(8) << short_pct << "%" << setw(8) << mb << setw(9) << change.ms << setw(11) << repair_ms
+                        << setw(9) << rss_mb
+                        << setw(11) << steady.latency.valueAtPercentile(99) / 1000.0
+                        << setw(11) << change.latency.valueAtPercentile(99) / 1000.0
+                        << setw(12) << change.latency.maxValue() / 1000.0;
+                    rows.push_back(row.str());
+                    
+                    vector<BenchmarkReport::Metric> metrics{
+                        {"keys_moved", double(moved.keys_moved), Better::Lower},
+                        {"keys_repaired", double(repaired.keys_moved), Better::Lower},
+                        {"copies_vs_ideal", copies / ideal, Better::Lower},
+                        {"short_of_replicas_pct", short_pct, Better::Lower},
+                        {"mb_copied", mb, Better::Lower},
+                        {"ms", change.ms, Better::Lower},
+                        {"repair_ms", repair_ms, Better::Lower},
+                        {"peak_rss_mb", rss_mb, Better::Lower},
+                        {"steady_p99_us", steady.latency.valueAtPercentile(99) / 1000.0, Better::Lower}};
+                    BenchmarkReport::addLatency(metrics, "change_", change.latency);
+                    report("scaling", placement + " " + (adding ? "add" : "remove"),
+                           {{"keys", to_string(num_keys)}, {"value_bytes", to_string(value_bytes)}, {"rf", to_string(rf)}},
+                           metrics);
+                }
+            }
+        }
+        
+        cout << "\n" << num_keys << " keys of " << value_bytes << " bytes, " << initial_nodes << " nodes, "
+             << num_clients << " client threads (latencies in us)" << endl;
+        cout << left << setw(12) << "placement" << right << setw(3) << "rf" << setw(8) << "change"
+             << setw(10) << "moved" << setw(10) << "repaired" << setw(10) << "ideal" << setw(7) << "ratio"
+             << setw(9) << "short" << setw(8) << "MB" << setw(9) << "ms" << setw(11) << "repair ms"
+             << setw(9) << "RSS MB" << setw(11) << "p99 steady" << setw(11) << "p99 change" << setw(12) << "max change" << endl;
+        for (const string& row : rows) {
+            cout << row << endl;
+        }
+    }
+    
+    // Startup time: replay a synthetic WAL of wal_mb megabytes with one
+    // worker and with the default worker count, then recover several nodes
+    // one after another and concurrently
+    static void runRecoveryBenchmark(size_t wal_mb = 256, int num_nodes = 3) {
+        cout << "\n=== Running Recovery Benchmark ===" << endl;
+        
+        const string wal_path = "bench_recovery.wal";
+        size_t records = writeSyntheticWAL(wal_path, wal_mb << 20);
+        cout << "Generated " << wal_mb << " MB WAL with " << records << " records" << endl;
+        
+        for (unsigned threads : {1u, 0u}) {
+            auto start = chrono::high_resolution_clock::now();
+            StorageEngine engine(wal_path, Durability::GroupSync, threads);
+            auto duration_ms = chrono::duration_cast<chrono::milliseconds>(
+                chrono::high_resolution_clock::now() - start);
+            
+            cout << "Replay (" << (threads ? "1 worker" : "parallel") << "): "
+                 << engine.getAllKeys().size() << " live keys in " << duration_ms.count() << "ms";
+            if (duration_ms.count() > 0) {
+                cout << " (" << (wal_mb * 1000 / duration_ms.count()) << " MB/s)";
+            }
+            cout << endl;
+            report("recovery", threads ? "replay 1 worker" : "replay parallel", {{"wal_mb", to_string(wal_mb)}},
+                   {{"ms", double(duration_ms.count()), Better::Lower},
+                    {"mb_per_sec", wal_mb * 1000.0 / max<long long>(1, duration_ms.count())}});
+        }
+        WriteAheadLog::removeFiles(wal_path);
+        
+        // Per-node WALs share the total size
+        vector<string> node_ids;
+        for (int i = 1; i <= num_nodes; ++i) {
+            node_ids.push_back("bench_recovery_node" + to_string(i));
+            writeSyntheticWAL(node_ids.back() + ".wal", (wal_mb << 20) / num_nodes);
+        }
+        
+        auto sequential_start = chrono::high_resolution_clock::now();
+        for (const auto& node_id : node_ids) {
+            KVNode node(node_id);
+        }
+        auto sequential_end = chrono::high_resolution_clock::now();
+        DistributedKVStore::recoverNodes(node_ids);
+        auto concurrent_end = chrono::high_resolution_clock::now();
+        
+        cout << num_nodes << "-node recovery (sequential): "
+             << chrono::duration_cast<chrono::milliseconds>(sequential_end - sequential_start).count() << "ms" << endl;
+        cout << num_nodes << "-node recovery (concurrent): "
+             << chrono::duration_cast<chrono::milliseconds>(concurrent_end - sequential_end).count() << "ms" << endl;
+        report("recovery", "nodes sequential", {{"nodes", to_string(num_nodes)}},
+               {{"ms", double(chrono::duration_cast<chrono::milliseconds>(sequential_end - sequential_start).count()), Better::Lower}});
+        report("recovery", "nodes concurrent", {{"nodes", to_string(num_nodes)}},
+               {{"ms", double(chrono::duration_cast<chrono::milliseconds>(concurrent_end - sequential_end).count()), Better::Lower}});
+        
+        for (const auto& node_id : node_ids) {
+            WriteAheadLog::removeFiles(node_id + ".wal");
+        }
+    }
+    
+    // put() throughput and latency under each durability mode, with one
+    // writer and with several writers sharing group commits
+    static void runDurabilityBenchmark(int num_operations = 20000) {
+        cout << "\n=== Running Durability Benchmark ===" << endl;
+        cout << "WAL I/O backend: " << WalIoBackend::shared().name() << endl;
+        
+        const string wal_path = "bench_durability.wal";
+        const string value(100, 'v');
+        
+        for (Durability mode : {Durability::None, Durability::Buffered,
+                                Durability::GroupSync, Durability::Direct}) {
+            for (int num_threads : {1, 8}) {
+                WriteAheadLog::removeFiles(wal_path);
+                StorageEngine engine(wal_path, mode);
+                
+                vector<vector<long long>> latencies_ns(num_threads);
+                auto start = chrono::high_resolution_clock::now();
+                vector<thread> writers;
+                for (int t = 0; t < num_threads; ++t) {
+                    writers.emplace_back([&, t]() {
+                        for (int i = t; i < num_operations; i += num_threads) {
+                            auto op_start = chrono::high_resolution_clock::now();
+                            engine.put("key" + to_string(i), value);
+                            latencies_ns[t].push_back(chrono::duration_cast<chrono::nanoseconds>(
+                                chrono::high_resolution_clock::now() - op_start).count());
+                        }
+                    });
+                }
+                for (auto& writer : writers) {
+                    writer.join();
+                }
+                auto duration_us = chrono::duration_cast<chrono::microseconds>(
+                    chrono::high_resolution_clock::now() - start);
+                
+                vector<long long> all;
+                for (const auto& per_thread : latencies_ns) {
+                    all.insert(all.end(), per_thread.begin(), per_thread.end());
+                }
+                sort(all.begin(), all.end());
+                auto percentile_us = [&](double p) {
+                    return all[min(all.size() - 1, (size_t)(p * all.size()))] / 1000.0;
+                };
+                
+                cout << left << setw(10) << durabilityName(mode) << right
+                     << " threads=" << num_threads
+                     << "  " << setw(8) << (num_operations * 1000000LL / max<long long>(1, duration_us.count()))
+                     << " ops/sec  p50=" << fixed << setprecision(1) << percentile_us(0.50)
+                     << "us  p99=" << percentile_us(0.99)
+                     << "us  max=" << all.back() / 1000.0 << "us" << endl;
+                report("durability", durabilityName(mode), {{"threads", to_string(num_threads)}, {"operations", to_string(num_operations)}},
+                       {{"ops_per_sec", num_operations * 1e6 / max<long long>(1, duration_us.count())},
+                        {"p50_us", percentile_us(0.50), Better::Lower}, {"p99_us", percentile_us(0.99), Better::Lower},
+                        {"max_us", all.back() / 1000.0, Better::Lower}});
+            }
+        }
+        WriteAheadLog::removeFiles(wal_path);
+    }
+    
+    // Transfers between the two balances of a random account, as
+    // read-read-write-write transactions from several threads. Fewer
+    // accounts mean more conflicts; the balances of each account must
+    // still sum to zero afterwards. Each account's keys share a hash tag
+    // for single-node commits and sit on different primaries for two-phase
+    // and parallel commit. Every mode first runs one uncontended client, for
+    // commit latency, then num_threads clients. The WAL is fdatasync'd, so
+    // each commit round costs what it would on a real disk
+    static void runTransactionBenchmark(int num_transactions = 2000, int num_threads = 8) {
+        cout << "\n=== Running Transaction Benchmark ===" << endl;
+        
+        vector<string> node_ids = {"bench_txn_node1", "bench_txn_node2", "bench_txn_node3"};
+        for (const auto& node_id : node_ids) {
+            WriteAheadLog::removeFiles(node_id + ".wal");
+        }
+        
+        {
+            DistributedKVStore store(3, Durability::GroupSync);
+            store.addNodes(node_ids);
+            auto balance = [](const optional<SharedValue>& value) { return value ? stoll(*value) : 0LL; };
+            
+            for (const string mode : {"single-node", "2pc", "parallel"}) {
+                store.setParallelCommit(mode == "parallel");
+                for (auto run : vector<pair<int, int>>{{1, 1024}, {num_threads, 1}, {num_threads, 8},
+                                                       {num_threads, 64}, {num_threads, 1024}}) {
+                    int clients_count = run.first, accounts = run.second;
+                    // Two keys per account
+                    vector<pair<string, string>> keys;
+                    for (int a = 0; a < accounts; ++a) {
+                        string account = mode + ":" + to_string(clients_count) + ":acct" + to_string(accounts) +
+                                         ":" + to_string(a);
+                        if (mode == "single-node") {
+                            keys.push_back({"{" + account + "}:checking", "{" + account + "}:savings"});
+                            continue;
+                        }
+                        string checking = account + ":checking", savings;
+                        for (int n = 0; savings.empty() || store.getReplicas(savings)[0] == store.getReplicas(checking)[0]; ++n) {
+                            savings = account + ":savings" + to_string(n);
+                        }
+                        keys.push_back({checking, savings});
+                    }
+                    
+                    atomic<long long> commits{0}, aborts{0};
+                    vector<vector<long long>> latencies_ns(clients_count);
+                    auto start = chrono::high_resolution_clock::now();
+                    vector<thread> clients;
+                    for (int t = 0; t < clients_count; ++t) {
+                        clients.emplace_back([&, t]() {
+                            mt19937 rng(t);
+                            for (int i = t; i < num_transactions; i += clients_count) {
+                                const auto& account = keys[rng() % accounts];
+                                auto op_start = chrono::high_resolution_clock::now();
+                                auto txn = store.beginTransaction();
+                                long long from = balance(txn.get(account.first));
+                                long long to = balance(txn.get(account.second));
+                                txn.put(account.first, to_string(from - 1));
+                                txn.put(account.second, to_string(to + 1));
+                                if (txn.commit()) ++commits; else ++aborts;
+                                latencies_ns[t].push_back(chrono::duration_cast<chrono::nanoseconds>(
+                                    chrono::high_resolution_clock::now() - op_start).count());
+                            }
+                        });
+                    }
+                    for (auto& client : clients) {
+                        client.join();
+                    }
+                    auto duration_us = chrono::duration_cast<chrono::microseconds>(
+                        chrono::high_resolution_clock::now() - start);
+                    
+                    vector<long long> all;
+                    for (const auto& per_thread : latencies_ns) {
+                        all.insert(all.end(), per_thread.begin(), per_thread.end());
+                    }
+                    sort(all.begin(), all.end());
+                    auto percentile_us = [&](double p) {
+                        return all[min(all.size() - 1, (size_t)(p * all.size()))] / 1000.0;
+                    };
+                    
+                    long long total = 0;
+                    for (const auto& account : keys) {
+                        total += balance(store.get(account.first)) + balance(store.get(account.second));
+                    }
+                    
+                    cout << left << setw(12) << mode << right << " clients=" << clients_count
+                         << " accounts=" << left << setw(5) << accounts << right
+                         << " commits=" << setw(6) << commits
+                         << " aborts=" << setw(6) << aborts
+                         << " (" << fixed << setprecision(1) << setw(4) << (100.0 * aborts / num_transactions) << "%)"
+                         << "  " << setw(7) << (num_transactions * 1000000LL / max<long long>(1, duration_us.count()))
+                         << " txn/sec  p50=" << percentile_us(0.50) << "us  p99=" << percentile_us(0.99) << "us  "
+                         << (total == 0 ? "✓" : "✗ balances off by " + to_string(total)) << endl;
+                    report("transactions", mode, {{"clients", to_string(clients_count)}, {"accounts", to_string(accounts)}},
+                           {{"txn_per_sec", num_transactions * 1e6 / max<long long>(1, duration_us.count())},
+                            {"abort_pct", 100.0 * aborts / num_transactions, Better::Lower},
+                            {"p50_us", percentile_us(0.50), Better::Lower}, {"p99_us", percentile_us(0.99), Better::Lower}});
+                }
+            }
+        }
+        
+        for (const auto& node_id : node_ids) {
+            WriteAheadLog::removeFiles(node_id + ".wal");
+        }
+    }
+    
+    // Full scans of num_keys balances while writers move amounts between
+    // random pairs of them in transactions. A scan by copying the map under
+    // data_mutex stalls every writer for its length; a snapshot scan lets
+    // them through between slices. Either way each scan must see the
+    // balances sum to zero
+    static void runSnapshotBenchmark(int num_keys = 200000, int num_writers = 4) {
+        cout << "\n=== Running Snapshot Benchmark ===" << endl;
+        
+        for (const string mode : {"locked copy", "snapshot"}) {
+            StorageEngine engine("bench_snapshot.wal", Durability::None);
+            unordered_map<string, string> balances;
+            for (int i = 0; i < num_keys; ++i) {
+                balances["balance" + to_string(i)] = "0";
+            }
+            engine.putBatch(balances);
+            
+            atomic<bool> stopping{false};
+            vector<vector<long long>> latencies_ns(num_writers);
+            vector<thread> writers;
+            for (int t = 0; t < num_writers; ++t) {
+                writers.emplace_back([&, t]() {
+                    mt19937 rng(t);
+                    while (!stopping) {
+                        string from = "balance" + to_string(rng() % num_keys);
+                        string to = "balance" + to_string(rng() % num_keys);
+                        if (from == to) continue;
+                        auto op_start = chrono::high_resolution_clock::now();
+                        VersionedValue from_entry, to_entry;
+                        engine.getEntry(from, from_entry);
+                        engine.getEntry(to, to_entry);
+                        unordered_map<string, uint64_t> reads{{from, from_entry.version}, {to, to_entry.version}};
+                        unordered_map<string, VersionedValue> writes{
+                            {from, VersionedValue{to_string(stoll(from_entry.value) - 1)}},
+                            {to, VersionedValue{to_string(stoll(to_entry.value) + 1)}}};
+                        engine.commitTransaction(reads, writes);
+                        latencies_ns[t].push_back(chrono::duration_cast<chrono::nanoseconds>(
+                            chrono::high_resolution_clock::now() - op_start).count());
+                    }
+                });
+            }
+            
+            int scans = 0;
+            bool consistent = true;
+            auto start = chrono::high_resolution_clock::now();
+            while (chrono::high_resolution_clock::now() - start < chrono::seconds(2)) {
+                long long total = 0;
+                if (mode == "snapshot") {
+                    engine.scan(*engine.snapshot(), [&](const string&, const VersionedValue& entry) {
+                        total += stoll(entry.value);
+                    });
+                } else {
+                    for (const auto& pair : engine.getAllEntries()) {
+                        total += stoll(pair.second.value);
+                    }
+                }
+                consistent = consistent && total == 0;
+                ++scans;
+            }
+            stopping = true;
+            for (auto& writer : writers) {
+                writer.join();
+            }
+            auto duration_us = chrono::duration_cast<chrono::microseconds>(
+                chrono::high_resolution_clock::now() - start);
+            
+            vector<long long> all;
+            for (const auto& per_thread : latencies_ns) {
+                all.insert(all.end(), per_thread.begin(), per_thread.end());
+            }
+            sort(all.begin(), all.end());
+            auto percentile_us = [&](double p) {
+                return all[min(all.size() - 1, (size_t)(p * all.size()))] / 1000.0;
+            };
+            
+            cout << left << setw(12) << mode << right << " scans=" << setw(4) << scans
+                 << "  writes " << setw(7) << (all.size() * 1000000LL / max<long long>(1, duration_us.count()))
+                 << " txn/sec  p50=" << fixed << setprecision(1) << percentile_us(0.50)
+                 << "us  p99=" << percentile_us(0.99) << "us  max=" << all.back() / 1000.0 << "us  "
+                 << (consistent ? "✓" : "✗ a scan saw balances not summing to zero") << endl;
+            report("snapshots", mode, {{"keys", to_string(num_keys)}, {"writers", to_string(num_writers)}},
+                   {{"scans", double(scans)}, {"txn_per_sec", all.size() * 1e6 / max<long long>(1, duration_us.count())},
+                    {"p50_us", percentile_us(0.50), Better::Lower}, {"p99_us", percentile_us(0.99), Better::Lower},
+                    {"max_us", all.back() / 1000.0, Better::Lower}});
+        }
+    }
+    
+    // Change feed lag: a feed tails the WAL while writers put, and each
+    // event's delay after its put returned is recorded. Then a second feed
+    // reads everything again from the start
+    static void runChangeFeedBenchmark(int num_operations = 20000, int num_writers = 4) {
+        cout << "\n=== Running Change Feed Benchmark ===" << endl;
+        
+        const string wal_path = "bench_changes.wal";
+        WriteAheadLog::removeFiles(wal_path);
+        {
+            StorageEngine engine(wal_path, Durability::GroupSync);
+            const string value(100, 'v');
+            ChangeCursor start = engine.changeCursor();
+            
+            vector<atomic<long long>> written_ns(num_operations);
+            auto since_start_ns = [origin = chrono::steady_clock::now()]() {
+                return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - origin).count();
+            };
+            
+            vector<long long> lags_ns;
+            thread feed([&]() {
+                ChangeCursor cursor = start;
+                vector<ChangeEvent> events;
+                while ((int)lags_ns.size() < num_operations) {
+                    events.clear();
+                    if (!engine.readChanges(cursor, events, 256, chrono::milliseconds(100))) continue;
+                    long long now = since_start_ns();
+                    for (const auto& event : events) {
+                        long long written = written_ns[stoi(event.key.substr(3))];
+                        lags_ns.push_back(max(0LL, written ? now - written : 0LL));
+                    }
+                }
+            });
+            
+            vector<thread> writers;
+            auto write_start = chrono::high_resolution_clock::now();
+            for (int t = 0; t < num_writers; ++t) {
+                writers.emplace_back([&, t]() {
+                    for (int i = t; i < num_operations; i += num_writers) {
+                        engine.put("key" + to_string(i), value);
+                        written_ns[i] = since_start_ns();
+                    }
+                });
+            }
+            for (auto& writer : writers) {
+                writer.join();
+            }
+            auto write_us = chrono::duration_cast<chrono::microseconds>(
+                chrono::high_resolution_clock::now() - write_start);
+            feed.join();
+            
+            sort(lags_ns.begin(), lags_ns.end());
+            auto percentile_us = [&](double p) {
+                return lags_ns[min(lags_ns.size() - 1, (size_t)(p * lags_ns.size()))] / 1000.0;
+            };
+            cout << "Tail: " << lags_ns.size() << " events from " << num_writers << " writers at "
+                 << (num_operations * 1000000LL / max<long long>(1, write_us.count())) << " puts/sec"
+                 << "  lag p50=" << fixed << setprecision(1) << percentile_us(0.50)
+                 << "us  p99=" << percentile_us(0.99) << "us  max=" << lags_ns.back() / 1000.0 << "us" << endl;
+            report("changes", "tail", {{"operations", to_string(num_operations)}, {"writers", to_string(num_writers)}},
+                   {{"puts_per_sec", num_operations * 1e6 / max<long long>(1, write_us.count())},
+                    {"lag_p50_us", percentile_us(0.50), Better::Lower}, {"lag_p99_us", percentile_us(0.99), Better::Lower},
+                    {"lag_max_us", lags_ns.back() / 1000.0, Better::Lower}});
+            
+            ChangeCursor cursor = start;
+            vector<ChangeEvent> events;
+            size_t read = 0;
+            auto read_start = chrono::high_resolution_clock::now();
+            while (engine.readChanges(cursor, events, 4096)) {
+                read += events.size();
+                events.clear();
+            }
+            auto read_us = chrono::duration_cast<chrono::microseconds>(
+                chrono::high_resolution_clock::now() - read_start);
+            cout << "Catch-up from the start: " << read << " events in " << read_us.count() / 1000.0
+                 << "ms (" << (read * 1000000LL / max<long long>(1, read_us.count())) << " events/sec)" << endl;
+            report("changes", "catch-up", {{"operations", to_string(num_operations)}},
+                   {{"events_per_sec", read * 1e6 / max<long long>(1, read_us.count())}});
+        }
+        WriteAheadLog::removeFiles(wal_path);
+    }
+    
+    // put() throughput in memory with no watches, with watches on other
+    // prefixes, and with a watch on the keys written that a poller drains
+    static void runWatchBenchmark(int num_operations = 200000) {
+        cout << "\n=== Running Watch Benchmark ===" << endl;
+        
+        vector<string> node_ids = {"bench_watch_node1", "bench_watch_node2", "bench_watch_node3"};
+        DistributedKVStore store(3, Durability::None);
+        store.addNodes(node_ids);
+        const string value(100, 'v');
+        
+        for (const string setup : {"no watches", "16 other", "1 matching"}) {
+            vector<shared_ptr<Watch>> watches;
+            if (setup == "16 other") {
+                for (int i = 0; i < 16; ++i) {
+                    watches.push_back(store.watch("other" + to_string(i) + ":"));
+                }
+            } else if (setup == "1 matching") {
+                watches.push_back(store.watch("session:"));
+            }
+            
+            atomic<bool> stopping{false};
+            size_t delivered = 0;
+            thread poller([&]() {
+                while (!stopping) {
+                    for (const auto& watch : watches) {
+                        delivered += watch->poll(1024, chrono::milliseconds(10)).size();
+                    }
+                    if (watches.empty()) this_thread::sleep_for(chrono::milliseconds(10));
+                }
+            });
+            
+            auto start = chrono::high_resolution_clock::now();
+            for (int i = 0; i < num_operations; ++i) {
+                store.put("session:" + to_string(i % 10000), value);
+            }
+            auto duration_us = chrono::duration_cast<chrono::microseconds>(
+                chrono::high_resolution_clock::now() - start);
+            stopping = true;
+            poller.join();
+            
+            size_t dropped = 0;
+            for (const auto& watch : watches) {
+                dropped += watch->dropped();
+                store.unwatch(watch);
+            }
+            cout << left << setw(11) << setup << right << "  "
+                 << setw(8) << (num_operations * 1000000LL / max<long long>(1, duration_us.count()))
+                 << " puts/sec  delivered=" << delivered << " dropped=" << dropped << endl;
+            report("watch", setup, {{"operations", to_string(num_operations)}},
+                   {{"puts_per_sec", num_operations * 1e6 / max<long long>(1, duration_us.count())}});
+        }
+    }
+    
+    // Zipf-distributed reads from several threads: plain, with hot key
+    // copies, and with a near cache. Reports throughput and how evenly the
+    // nodes share the reads
+    static void runHotKeyBenchmark(int num_reads = 400000, double theta = 1.2, int num_threads = 4) {
+        cout << "\n=== Running Hot Key Benchmark ===" << endl;
+        
+        const int num_keys = 100000;
+        const int num_nodes = 8;
+        ZipfDistribution zipf(num_keys, theta);
+        
+        for (const string mode : {"plain", "hot copies", "near cache"}) {
+            vector<string> node_ids;
+            for (int i = 0; i < num_nodes; ++i) {
+                node_ids.push_back("bench_hot_node" + to_string(i + 1));
+            }
+            DistributedKVStore store(3, Durability::None);
+            store.addNodes(node_ids);
+            store.setHotKeyReplicas(mode == "hot copies");
+            store.setNearCache(mode == "near cache" ? 4096 : 0);
+            const string value(100, 'v');
+            for (int i = 0; i < num_keys; ++i) {
+                store.put("user:" + to_string(i), value);
+            }
+            
+            // Warm up so hot keys are found before measuring
+            auto read_zipf = [&](int reads, int seed) {
+                mt19937_64 rng(seed);
+                for (int i = 0; i < reads; ++i) {
+                    store.get("user:" + to_string(zipf(rng)));
+                }
+            };
+            auto warm_until = chrono::steady_clock::now() + chrono::milliseconds(600);
+            for (int seed = 1000; chrono::steady_clock::now() < warm_until; ++seed) {
+                read_zipf(5000, seed);
+            }
+            
+            auto before = store.nodeReads();
+            auto start = chrono::high_resolution_clock::now();
+            vector<thread> readers;
+            for (int t = 0; t < num_threads; ++t) {
+                readers.emplace_back([&, t]() { read_zipf(num_reads / num_threads, t); });
+            }
+            for (auto& reader : readers) {
+                reader.join();
+            }
+            auto duration_us = chrono::duration_cast<chrono::microseconds>(
+                chrono::high_resolution_clock::now() - start);
+            
+            uint64_t busiest = 0, total = 0;
+            for (const auto& pair : store.nodeReads()) {
+                uint64_t served = pair.second - before[pair.first];
+                busiest = max(busiest, served);
+                total += served;
+            }
+            double mean = double(total) / num_nodes;
+            cout << left << setw(11) << mode << right
+                 << setw(9) << (num_reads * 1000000LL / max<long long>(1, duration_us.count())) << " reads/sec  "
+                 << setw(5) << fixed << setprecision(1) << (double(total) / num_reads) << " node reads/read  "
+                 << "busiest node " << setprecision(2) << (mean > 0 ? busiest / mean : 0) << "x mean" << endl;
+            report("hotkeys", mode, {{"reads", to_string(num_reads)}, {"theta", to_string(theta)}},
+                   {{"reads_per_sec", num_reads * 1e6 / max<long long>(1, duration_us.count())},
+                    {"node_reads_per_read", double(total) / num_reads, Better::Lower},
+                    {"busiest_vs_mean", mean > 0 ? busiest / mean : 0, Better::Lower}});
+        }
+    }
+    
+    // Puts, then Zipf reads from several threads, with no node cache and
+    // with LRU node caches. Reports both rates and the memory the caches
+    // spend on values storage already holds
+    static void runNodeCacheBenchmark(int num_keys = 100000, int num_reads = 400000, int num_threads = 4) {
+        cout << "\n=== Running Node Cache Benchmark ===" << endl;
+        
+        const string value(1024, 'v');
+        ZipfDistribution zipf(num_keys, 0.99);
+        
+        for (NodeCache mode : {NodeCache::None, NodeCache::Lru}) {
+            DistributedKVStore store(3, Durability::None, mode);
+            store.addNodes({"bench_cache_node1", "bench_cache_node2", "bench_cache_node3"});
+            
+            auto start = chrono::high_resolution_clock::now();
+            for (int i = 0; i < num_keys; ++i) {
+                store.put("key" + to_string(i), value);
+            }
+            auto put_us = chrono::duration_cast<chrono::microseconds>(
+                chrono::high_resolution_clock::now() - start);
+            
+            start = chrono::high_resolution_clock::now();
+            vector<thread> readers;
+            for (int t = 0; t < num_threads; ++t) {
+                readers.emplace_back([&, t]() {
+                    mt19937_64 rng(t);
+                    for (int i = 0; i < num_reads / num_threads; ++i) {
+                        store.get("key" + to_string(zipf(rng)));
+                    }
+                });
+            }
+            for (auto& reader : readers) {
+                reader.join();
+            }
+            auto get_us = chrono::duration_cast<chrono::microseconds>(
+                chrono::high_resolution_clock::now() - start);
+            
+            auto caches = store.cacheStats();
+            cout << left << setw(5) << (mode == NodeCache::Lru ? "lru" : "none") << right
+                 << setw(9) << (num_keys * 1000000LL / max<long long>(1, put_us.count())) << " puts/sec"
+                 << setw(10) << (num_reads * 1000000LL / max<long long>(1, get_us.count())) << " gets/sec  "
+                 << "cached " << caches.entries << " entries, " << fixed << setprecision(1)
+                 << caches.bytes / (1024.0 * 1024.0) << " MB" << endl;
+            report("cache", mode == NodeCache::Lru ? "lru" : "none", {{"keys", to_string(num_keys)}, {"reads", to_string(num_reads)}},
+                   {{"puts_per_sec", num_keys * 1e6 / max<long long>(1, put_us.count())},
+                    {"gets_per_sec", num_reads * 1e6 / max<long long>(1, get_us.count())},
+                    {"cached_mb", caches.bytes / (1024.0 * 1024.0), Better::Lower}});
+        }
+    }
+    
+    // Reads of which nine in ten are for missing keys, Zipf-distributed,
+    // with and without the negative cache
+    static void runNegativeCacheBenchmark(int num_reads = 400000, int num_threads = 4) {
+        cout << "\n=== Running Negative Cache Benchmark ===" << endl;
+        
+        const int num_keys = 100000;
+        ZipfDistribution zipf(num_keys, 0.99);
+        
+        for (bool negative : {false, true}) {
+            DistributedKVStore store(3, Durability::None);
+            store.addNodes({"bench_miss_node1", "bench_miss_node2", "bench_miss_node3"});
+            store.setNegativeCache(negative ? NegativeCache::DEFAULT_CAPACITY : 0);
+            const string value(100, 'v');
+            for (int i = 0; i < num_keys / 10; ++i) {
+                store.put("present:" + to_string(i), value);
+            }
+            
+            auto before = store.nodeReads();
+            atomic<long long> found{0};
+            auto start = chrono::high_resolution_clock::now();
+            vector<thread> readers;
+            for (int t = 0; t < num_threads; ++t) {
+                readers.emplace_back([&, t]() {
+                    mt19937_64 rng(t);
+                    long long hits = 0;
+                    for (int i = 0; i < num_reads / num_threads; ++i) {
+                        bool present = rng() % 10 == 0;
+                        size_t rank = zipf(rng);
+                        hits += store.get((present ? "present:" : "absent:") + to_string(present ? rank / 10 : rank))
+                                    .has_value();
+                    }
+                    found += hits;
+                });
+            }
+            for (auto& reader : readers) {
+                reader.join();
+            }
+            auto duration_us = chrono::duration_cast<chrono::microseconds>(
+                chrono::high_resolution_clock::now() - start);
+            
+            uint64_t node_reads = 0;
+            for (const auto& pair : store.nodeReads()) {
+                node_reads += pair.second - before[pair.first];
+            }
+            cout << left << setw(12) << (negative ? "negative on" : "negative off") << right
+                 << setw(9) << (num_reads * 1000000LL / max<long long>(1, duration_us.count())) << " reads/sec  "
+                 << fixed << setprecision(2) << double(node_reads) / num_reads << " node reads/read  "
+                 << found << " found" << endl;
+            report("misses", negative ? "negative on" : "negative off", {{"reads", to_string(num_reads)}},
+                   {{"reads_per_sec", num_reads * 1e6 / max<long long>(1, duration_us.count())},
+                    {"node_reads_per_read", double(node_reads) / num_reads, Better::Lower}});
+        }
+    }
+    
+    // Reads of large values from several threads, keeping the shared
+    // handle get returns or copying it into a string as before handles
+    static void runLargeValueBenchmark(int num_reads = 4000, size_t value_kb = 1024, int num_threads = 4) {
+        cout << "\n=== Running Large Value Benchmark ===" << endl;
+        
+        const int num_keys = 64;
+        DistributedKVStore store(3, Durability::None);
+        store.addNodes({"bench_value_node1", "bench_value_node2", "bench_value_node3"});
+        for (int i = 0; i < num_keys; ++i) {
+            store.put("blob" + to_string(i), string(value_kb * 1024, char('a' + i % 26)));
+        }
+        
+        for (bool copy : {false, true}) {
+            atomic<size_t> bytes{0};
+            auto start = chrono::high_resolution_clock::now();
+            vector<thread> readers;
+            for (int t = 0; t < num_threads; ++t) {
+                readers.emplace_back([&, t]() {
+                    size_t read = 0;
+                    for (int i = 0; i < num_reads / num_threads; ++i) {
+                        optional<SharedValue> value = store.get("blob" + to_string((i * num_threads + t) % num_keys));
+                        if (!value) continue;
+                        if (copy) {
+                            string bytes_copy = *value;
+                            read += bytes_copy.size();
+                        } else {
+                            read += value->size();
+                        }
+                    }
+                    bytes += read;
+                });
+            }
+            for (auto& reader : readers) {
+                reader.join();
+            }
+            auto duration_us = chrono::duration_cast<chrono::microseconds>(
+                chrono::high_resolution_clock::now() - start);
+            double seconds = max<long long>(1, duration_us.count()) / 1e6;
+            cout << left << setw(7) << (copy ? "copy" : "handle") << right
+                 << setw(10) << fixed << setprecision(0) << num_reads / seconds << " reads/sec  "
+                 << setprecision(2) << bytes / seconds / (1024.0 * 1024 * 1024) << " GB/s of " << value_kb << " KB values" << endl;
+            report("values", copy ? "copy" : "handle", {{"reads", to_string(num_reads)}, {"value_kb", to_string(value_kb)}},
+                   {{"reads_per_sec", num_reads / seconds}, {"gb_per_sec", bytes / seconds / (1024.0 * 1024 * 1024)}});
+        }
+    }
+    
+    // Puts at RF=3 with the value passed as an lvalue (copied once into the
+    // shared buffer) and moved in (no copy). Allocations are counted when
+    // built with -DKVSTORE_COUNT_ALLOCATIONS
+    static void runWriteBenchmark(int num_puts = 20000, size_t value_kb = 4) {
+        cout << "\n=== Running Write Path Benchmark ===" << endl;
+        
+        DistributedKVStore store(3, Durability::None);
+        store.addNodes({"bench_write_node1", "bench_write_node2", "bench_write_node3"});
+        
+        for (bool moved : {false, true}) {
+            const string prefix = moved ? "moved" : "copied";
+#ifdef KVSTORE_COUNT_ALLOCATIONS
+            uint64_t allocations = AllocationCounter::count.load();
+            uint64_t allocated = AllocationCounter::bytes.load();
+#endif
+            auto start = chrono::high_resolution_clock::now();
+            for (int i = 0; i < num_puts; ++i) {
+                string value(value_kb * 1024, char('a' + i % 26));
+                if (moved) {
+                    store.put(prefix + to_string(i), move(value));
+                } else {
+                    store.put(prefix + to_string(i), value);
+                }
+            }
+            auto duration_us = chrono::duration_cast<chrono::microseconds>(
+                chrono::high_resolution_clock::now() - start);
+#ifdef KVSTORE_COUNT_ALLOCATIONS
+            allocations = AllocationCounter::count.load() - allocations;
+            allocated = AllocationCounter::bytes.load() - allocated;
+#endif
+            double seconds = max<long long>(1, duration_us.count()) / 1e6;
+            cout << left << setw(7) << (moved ? "move" : "copy") << right
+                 << setw(10) << fixed << setprecision(0) << num_puts / seconds << " puts/sec";
+#ifdef KVSTORE_COUNT_ALLOCATIONS
+            cout << setw(8) << setprecision(1) << double(allocations) / num_puts << " allocations/put"
+                 << setw(8) << double(allocated) / num_puts / 1024 << " KB allocated/put";
+#endif
+            cout << "  (" << value_kb << " KB values, RF=3)" << endl;
+            vector<BenchmarkReport::Metric> metrics{{"puts_per_sec", num_puts / seconds}};
+#ifdef KVSTORE_COUNT_ALLOCATIONS
+            metrics.push_back({"allocations_per_put", double(allocations) / num_puts, Better::Lower});
+            metrics.push_back({"kb_allocated_per_put", double(allocated) / num_puts / 1024, Better::Lower});
+#endif
+            report("writes", moved ? "move" : "copy", {{"puts", to_string(num_puts)}, {"value_kb", to_string(value_kb)}}, metrics);
+        }
+        
+        cout << "Value buffers per key across replicas: " << store.valueBuffers("copied0")
+             << " copied, " << store.valueBuffers("moved0") << " moved" << endl;
+#ifndef KVSTORE_COUNT_ALLOCATIONS
+        cout << "(build with -DKVSTORE_COUNT_ALLOCATIONS to count allocations)" << endl;
+#endif
+    }
+    
+private:
+    using Better = BenchmarkReport::Better;
+    
+    static void report(const string& benchmark, const string& name, const vector<pair<string, string>>& config,
+                       const vector<BenchmarkReport::Metric>& metrics) {
+        BenchmarkReport::shared().add(benchmark, name, config, metrics);
+    }
+    
+    struct Measured {
+        LatencyHistogram latency;        // ns, of every client operation
+        double ms = 0;                   // Time the action took
+    };
+    
+    // Runs action while num_clients threads run workload operations back
+    // to back, and returns their latencies
+    static Measured measureDuring(DistributedKVStore& store, YcsbWorkload& workload, int num_clients,
+                                  const function<void()>& action) {
+        atomic<bool> done{false};
+        vector<LatencyHistogram> latencies(num_clients);
+        vector<thread> clients;
+        for (int t = 0; t < num_clients; ++t) {
+            clients.emplace_back([&, t]() {
+                mt19937_64 rng(2000 + t);
+                while (!done.load()) {
+                    auto start = chrono::steady_clock::now();
+                    workload.run(store, rng);
+                    latencies[t].record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+                }
+            });
+        }
+        
+        Measured measured;
+        auto start = chrono::steady_clock::now();
+        action();
+        measured.ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        done = true;
+        for (auto& client : clients) {
+            client.join();
+        }
+        for (const auto& histogram : latencies) {
+            measured.latency.merge(histogram);
+        }
+        return measured;
+    }
+    
+    // Peak resident set size since the last resetPeakRss, from Linux's
+    // VmHWM; 0 where /proc is not available
+    static double peakRssMb() {
+        ifstream status("/proc/self/status");
+        string line;
+        while (getline(status, line)) {
+            if (line.compare(0, 6, "VmHWM:") == 0) return stod(line.substr(6)) / 1024;
+        }
+        return 0;
+    }
+    
+    static void resetPeakRss() {
+        ofstream("/proc/self/clear_refs") << "5";
+    }
+    
+    // Write PUT/DEL records (about 1 in 10 a DEL) over a key space a quarter
+    // the size of the record count, as WAL segments totalling target_bytes
+    static size_t writeSyntheticWAL(const string& path, size_t target_bytes) {
+        WriteAheadLog::removeFiles(path);
+        mt19937_64 rng(42);
+        const string value(100, 'v');
+        size_t key_space = max<size_t>(1, target_bytes / 128 / 4);
+        
+        size_t bytes = 0, records = 0;
+        uint64_t segment = 0;
+        while (bytes < target_bytes) {
+            string frames = WalFormat::encodeHeader(++segment, records + 1);
+            string body;
+            while (frames.size() < (size_t)WriteAheadLog::SEGMENT_SIZE - 256 && bytes < target_bytes) {
+                string key = "key" + to_string(rng() % key_space);
+                body.clear();
+                ++records;
+                if (rng() % 10 == 0) {
+                    WalFormat::appendRecord(body, WalFormat::DEL, records, key);
+                } else {
+                    WalFormat::appendRecord(body, WalFormat::PUT, records, key, value);
+                }
+                WalFormat::stampSequence(body, records);
+                frames += body;
+                bytes += body.size();
+            }
+            ofstream(WriteAheadLog::segmentPath(path, segment), ios::trunc | ios::binary) << frames;
+        }
+        return records;
     }
 };
 
 // Interactive demo 
 void interactiveDemo() {
     cout << "\n=== INTERACTIVE DEMO MODE ===" << endl;
-    cout << "Commands: put <key> <value>, get <key>, del <key>, nodes, benchmark, addnode <id>, removenode <id>, stats, exit" << endl;
+    cout << "Commands: put <key> <value>, putttl <key> <seconds> <value>, get <key>, del <key>, "
+         << "cas <key> <version> <value>, incr <key> <delta>, append <key> <suffix>, "
+         << "nodes, benchmark, addnode <id>, removenode <id>, stats, latency [file_prefix], repair, exit" << endl;
     cout << "Note: For values with spaces, use quotes like: put user:1001 \"Alice Johnson\"" << endl;
     
     DistributedKVStore cluster(3);
     
-    // Add initial nodes
-    cluster.addNode("node1");
-    cluster.addNode("node2");
-    cluster.addNode("node3");
+    // Add initial nodes, recovering their WALs concurrently
+    cluster.addNodes({"node1", "node2", "node3"});
     
     string command;
     while (cout << "\nkvstore> " && cin >> command) {
@@ -791,16 +7657,56 @@ void interactiveDemo() {
             cluster.put(key, value);
             cout << "✓ Stored: " << key << " -> " << value << endl;
         }
+        else if (command == "putttl") {
+            string key;
+            long long seconds;
+            cin >> key >> seconds;
+            
+            string value;
+            getline(cin, value);
+            if (!value.empty() && value[0] == ' ') {
+                value = value.substr(1);
+            }
+            if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+                value = value.substr(1, value.length() - 2);
+            }
+            
+            cluster.put(key, value, chrono::seconds(seconds));
+            cout << "✓ Stored: " << key << " -> " << value << " (expires in " << seconds << "s)" << endl;
+        }
         else if (command == "get") {
             string key;
             cin >> key;
-            string value = cluster.get(key);
-            if (value.empty()) {
+            uint64_t version;
+            optional<SharedValue> value = cluster.get(key, version);
+            if (!value) {
                 cout << "✗ Key not found: " << key << endl;
             } else {
-                cout << "✓ Retrieved: " << key << " -> " << value << endl;
+                cout << "✓ Retrieved: " << key << " -> " << *value << " (version " << version << ")" << endl;
+            }
+        }
+        else if (command == "cas") {
+            string key, value;
+            uint64_t expected_version;
+            cin >> key >> expected_version >> value;
+            bool swapped = cluster.compareAndSet(key, expected_version, value);
+            cout << (swapped ? "✓ Swapped: " : "✗ Version mismatch: ") << key << endl;
+        }
+        else if (command == "incr") {
+            string key;
+            long long delta;
+            cin >> key >> delta;
+            try {
+                cout << "✓ " << key << " = " << cluster.increment(key, delta) << endl;
+            } catch (const exception& e) {
+                cout << "✗ " << e.what() << endl;
             }
         }
+        else if (command == "append") {
+            string key, suffix;
+            cin >> key >> suffix;
+            cout << "✓ " << key << " = " << cluster.append(key, suffix) << endl;
+        }
         else if (command == "del") {
             string key;
             cin >> key;
@@ -813,6 +7719,24 @@ void interactiveDemo() {
         else if (command == "stats") {
             cluster.printDistributionStats();
         }
+        else if (command == "latency") {
+            // latency [file_prefix] also writes <file_prefix>.<metric>.hdr
+            Benchmark::printStoreLatencies();
+            string prefix;
+            getline(cin, prefix);
+            prefix.erase(0, prefix.find_first_not_of(' '));
+            if (!prefix.empty()) {
+                for (LatencyRecorder* recorder : StoreLatency::all()) {
+                    string path = prefix + "." + recorder->name() + ".hdr";
+                    ofstream out(path);
+                    recorder->snapshot().writePercentiles(out);
+                    cout << (out ? "✓ Wrote " : "✗ Could not write ") << path << endl;
+                }
+            }
+        }
+        else if (command == "repair") {
+            cluster.repairReplicas();
+        }
         else if (command == "benchmark") {
             cout << "Running benchmark..." << endl;
             Benchmark::runBenchmark(cluster, 1000);
@@ -831,7 +7755,7 @@ void interactiveDemo() {
             break;
         }
         else {
-            cout << "Unknown command. Available: put, get, del, nodes, stats, benchmark, addnode, removenode, exit" << endl;
+            cout << "Unknown command. Available: put, putttl, get, del, cas, incr, append, nodes, stats, latency, repair, benchmark, addnode, removenode, exit" << endl;
         }
     }
 }
@@ -847,10 +7771,8 @@ void automatedDemo() {
     cout << "1. INITIAL CLUSTER SETUP" << endl;
     cout << "Creating cluster with replication factor 3..." << endl;
     
-    // Add initial nodes
-    cluster.addNode("node1");
-    cluster.addNode("node2");
-    cluster.addNode("node3");
+    // Add initial nodes, recovering their WALs concurrently
+    cluster.addNodes({"node1", "node2", "node3"});
     
     cluster.printClusterInfo();
     this_thread::sleep_for(chrono::milliseconds(1000));
@@ -865,10 +7787,11 @@ void automatedDemo() {
         cluster.put(key, value);
     }
     
+    // Sessions expire on their own after 30 minutes
     for (int i = 1; i <= 10; ++i) {
         string key = "session:" + to_string(i);
         string value = "SessionData_" + to_string(i);
-        cluster.put(key, value);
+        cluster.put(key, value, chrono::minutes(30));
     }
     
     cout << "✓ Added 30 keys to the cluster" << endl;
@@ -899,12 +7822,12 @@ void automatedDemo() {
     bool all_found = true;
     
     for (const string& key : test_keys) {
-        string value = cluster.get(key);
-        if (value.empty()) {
+        optional<SharedValue> value = cluster.get(key);
+        if (!value) {
             cout << "✗ Key not found: " << key << endl;
             all_found = false;
         } else {
-            cout << "✓ " << key << " = " << value << endl;
+            cout << "✓ " << key << " = " << *value << endl;
         }
     }
     
@@ -924,11 +7847,11 @@ void automatedDemo() {
     // Verify data is still accessible
     cout << "\nVerifying data accessibility after node removal..." << endl;
     for (const string& key : test_keys) {
-        string value = cluster.get(key);
-        if (value.empty()) {
+        optional<SharedValue> value = cluster.get(key);
+        if (!value) {
             cout << "✗ Key not found: " << key << endl;
         } else {
-            cout << "✓ " << key << " = " << value << endl;
+            cout << "✓ " << key << " = " << *value << endl;
         }
     }
     
@@ -968,7 +7891,7 @@ void automatedDemo() {
             string value = "ConcurrentValue_" + to_string(counter);
             
             cluster.put(key, value);
-            string retrieved = cluster.get(key);
+            optional<SharedValue> retrieved = cluster.get(key);
             
             if (retrieved == value) {
                 operations_completed++;
@@ -1020,13 +7943,184 @@ void automatedDemo() {
 }
 
 // Demo and testing
+// Runs parse, which reads and checks a benchmark's arguments before anything
+// starts; bad input is rethrown together with the benchmark's usage line
+void parseBenchArguments(const string& usage, const function<void()>& parse) {
+    try {
+        parse();
+    } catch (const invalid_argument& e) {
+        throw runtime_error("Expected a number (" + string(e.what()) + ")\nUsage: " + usage);
+    } catch (const exception& e) {
+        throw runtime_error(string(e.what()) + "\nUsage: " + usage);
+    }
+}
+
+// Runs ./kvstore --bench <name> [args...]; false if there is no such
+// benchmark
+bool runBenchCommand(int argc, char* argv[]) {
+    string benchmark = argv[2];
+    if (benchmark == "recovery") {
+        // ./kvstore --bench recovery [wal_mb]
+        size_t wal_mb = argc > 3 ? stoul(argv[3]) : 256;
+        Benchmark::runRecoveryBenchmark(wal_mb);
+    } else if (benchmark == "durability") {
+        // ./kvstore --bench durability [num_operations]
+        int num_operations = argc > 3 ? stoi(argv[3]) : 20000;
+        Benchmark::runDurabilityBenchmark(num_operations);
+    } else if (benchmark == "transactions") {
+        // ./kvstore --bench transactions [num_transactions]
+        int num_transactions = argc > 3 ? stoi(argv[3]) : 2000;
+        Benchmark::runTransactionBenchmark(num_transactions);
+    } else if (benchmark == "snapshots") {
+        // ./kvstore --bench snapshots [num_keys]
+        int num_keys = argc > 3 ? stoi(argv[3]) : 200000;
+        Benchmark::runSnapshotBenchmark(num_keys);
+    } else if (benchmark == "changes") {
+        // ./kvstore --bench changes [num_operations]
+        int num_operations = argc > 3 ? stoi(argv[3]) : 20000;
+        Benchmark::runChangeFeedBenchmark(num_operations);
+    } else if (benchmark == "watch") {
+        // ./kvstore --bench watch [num_operations]
+        int num_operations = argc > 3 ? stoi(argv[3]) : 200000;
+        Benchmark::runWatchBenchmark(num_operations);
+    } else if (benchmark == "hotkeys") {
+        // ./kvstore --bench hotkeys [num_reads] [zipf_theta]
+        int num_reads = argc > 3 ? stoi(argv[3]) : 400000;
+        double theta = argc > 4 ? stod(argv[4]) : 1.2;
+        Benchmark::runHotKeyBenchmark(num_reads, theta);
+    } else if (benchmark == "cache") {
+        // ./kvstore --bench cache [num_keys]
+        int num_keys = argc > 3 ? stoi(argv[3]) : 100000;
+        Benchmark::runNodeCacheBenchmark(num_keys);
+    } else if (benchmark == "misses") {
+        // ./kvstore --bench misses [num_reads]
+        int num_reads = argc > 3 ? stoi(argv[3]) : 400000;
+        Benchmark::runNegativeCacheBenchmark(num_reads);
+    } else if (benchmark == "values") {
+        // ./kvstore --bench values [num_reads] [value_kb]
+        int num_reads = argc > 3 ? stoi(argv[3]) : 4000;
+        size_t value_kb = argc > 4 ? stoul(argv[4]) : 1024;
+        Benchmark::runLargeValueBenchmark(num_reads, value_kb);
+    } else if (benchmark == "writes") {
+        // ./kvstore --bench writes [num_puts] [value_kb]
+        int num_puts = argc > 3 ? stoi(argv[3]) : 20000;
+        size_t value_kb = argc > 4 ? stoul(argv[4]) : 4;
+        Benchmark::runWriteBenchmark(num_puts, value_kb);
+    } else if (benchmark == "ycsb") {
+        string workload = argc > 3 ? argv[3] : "all";
+        string keys = argc > 7 ? argv[7] : "";
+        size_t record_count, min_value_size, max_value_size;
+        int num_operations;
+        parseBenchArguments("./kvstore --bench ycsb [A-F|all|r:u:i:s:m] [record_count] [num_operations] [value_bytes|min-max] [uniform|zipfian|latest]", [&]() {
+            if (workload != "all") YcsbWorkload::spec(workload);
+            if (!keys.empty()) YcsbWorkload::keys(keys);
+            record_count = argc > 4 ? stoul(argv[4]) : 100000;
+            num_operations = argc > 5 ? stoi(argv[5]) : 200000;
+            string value_bytes = argc > 6 ? argv[6] : "100";
+            size_t dash = value_bytes.find('-');
+            min_value_size = stoul(value_bytes.substr(0, dash));
+            max_value_size = dash == string::npos ? min_value_size : stoul(value_bytes.substr(dash + 1));
+        });
+        for (const string& name : workload == "all" ? vector<string>{"A", "B", "C", "D", "E", "F"} : vector<string>{workload}) {
+            Benchmark::runYcsbBenchmark(name, record_count, num_operations, min_value_size, max_value_size, keys);
+        }
+    } else if (benchmark == "load") {
+        string workload = argc > 3 ? argv[3] : "A";
+        int num_threads, step_ms;
+        parseBenchArguments("./kvstore --bench load [A-F|r:u:i:s:m] [num_threads] [step_ms]", [&]() {
+            YcsbWorkload::spec(workload);
+            num_threads = argc > 4 ? stoi(argv[4]) : 8;
+            step_ms = argc > 5 ? stoi(argv[5]) : 2000;
+        });
+        Benchmark::runLoadBenchmark(workload, num_threads, step_ms);
+    } else if (benchmark == "scaling") {
+        // ./kvstore --bench scaling [num_keys] [value_bytes]
+        size_t num_keys = argc > 3 ? stoul(argv[3]) : 1000000;
+        size_t value_bytes = argc > 4 ? stoul(argv[4]) : 100;
+        Benchmark::runScalingBenchmark(num_keys, value_bytes);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Runs a --bench or --compare command and returns its exit code; a bad
+// argument or an unreadable file is reported on stderr instead of aborting
+int runCommand(const function<int()>& command) {
+    try {
+        return command();
+    } catch (const invalid_argument& e) {
+        // stoi and friends name only themselves
+        cerr << "✗ Expected a number (" << e.what() << ")" << endl;
+    } catch (const exception& e) {
+        cerr << "✗ " << e.what() << endl;
+    }
+    return 1;
+}
+
 int main(int argc, char* argv[]) {
+    // --output <file>, --format json|csv and --repeat <n> may follow a
+    // --bench command; take them out so benchmarks see their own arguments
+    string output, format, repeat = "1";
+    vector<char*> args;
+    for (int i = 0; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 < argc && (arg == "--output" || arg == "--format" || arg == "--repeat")) {
+            string value = argv[++i];
+            if (arg == "--output") output = value;
+            else if (arg == "--format") format = value;
+            else repeat = value;
+            continue;
+        }
+        args.push_back(argv[i]);
+    }
+    argc = int(args.size());
+    argv = args.data();
+    
+    // Checked up front so a typo doesn't cost a whole benchmark run
+    if (!format.empty() && format != "json" && format != "csv") {
+        cerr << "✗ Unknown output format " << format << " (expected json or csv)" << endl;
+        return 1;
+    }
+    
+    // Results written to stdout get it to themselves; the progress goes to
+    // stderr instead
+    bool results_to_stdout = (!format.empty() && output.empty()) || output == "-";
+    streambuf* stdout_buffer = cout.rdbuf();
+    if (results_to_stdout) cout.rdbuf(cerr.rdbuf());
+    
     cout << "Enhanced Distributed Key-Value Store - System Design Interview Demo" << endl;
     cout << "=================================================================" << endl;
     cout << "Featuring Smart Data Redistribution with Consistent Hashing" << endl;
     
     if (argc > 1 && string(argv[1]) == "--interactive") {
         interactiveDemo();
+    } else if (argc > 3 && string(argv[1]) == "--compare") {
+        // ./kvstore --compare <baseline> <current> [threshold_pct]; exits 1 on a regression
+        return runCommand([&]() {
+            double threshold = argc > 4 ? stod(argv[4]) : 5.0;
+            return BenchmarkReport::compare(argv[2], argv[3], threshold) ? 0 : 1;
+        });
+    } else if (argc > 2 && string(argv[1]) == "--bench") {
+        int status = runCommand([&]() {
+            int runs = max(1, stoi(repeat));
+            if (!runBenchCommand(argc, argv)) {
+                throw runtime_error("Unknown benchmark " + string(argv[2]));
+            }
+            for (int run = 1; run < runs; ++run) {
+                runBenchCommand(argc, argv);
+            }
+            if (results_to_stdout) {
+                cout.rdbuf(stdout_buffer);
+                BenchmarkReport::shared().write("-", format);
+            } else if (!output.empty()) {
+                BenchmarkReport::shared().write(output, format);
+                cout << "✓ Results written to " << output << endl;
+            }
+            return 0;
+        });
+        cout.rdbuf(stdout_buffer);
+        return status;
     } else {
         automatedDemo();
         